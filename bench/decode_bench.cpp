@@ -0,0 +1,90 @@
+/*
+------------------------------------------------------------------------------
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+------------------------------------------------------------------------------
+*/
+
+// Decodes each file a number of times and prints the best speed in MB/s.
+// The build also makes decode_bench_fuzzsafe from the same source with
+// OOZLIN_FUZZ_SAFE=1; running both over the same files shows what the fuzz
+// safe checks cost.
+//
+// Usage: decode_bench [-r<reps>] files...
+
+
+#include "../stdafx.h"
+#include "../utilities.h"
+#include "../kraken.h"
+
+
+
+// Seconds()
+static double Seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+
+int main(int argc, char *argv[])
+{
+    int reps = 10;
+    int argi = 1;
+
+    if (argi < argc && argv[argi][0] == '-' && argv[argi][1] == 'r')
+    {
+        reps = atoi(argv[argi++] + 2);
+    }
+    if (argi >= argc || reps < 1)
+    {
+        fprintf(stderr, "Usage: decode_bench [-r<reps>] files...\n");
+        return 1;
+    }
+
+    printf("%s build\n", OOZLIN_FUZZ_SAFE ? "fuzz safe" : "unchecked");
+    for (; argi < argc; argi++)
+    {
+        const char *curfile = argv[argi];
+        size_t input_size;
+        byte *input = load_file(curfile, &input_size);
+
+        // same header detection as oozlin
+        int hdrsize = *(uint64_t*)input >= 0x10000000000 ? 4 : 8;
+        uint64_t unpacked_size = (hdrsize == 8) ? *(uint64_t*)input : *(uint32_t*)input;
+        byte *output = new byte[unpacked_size];
+        double best = 1e30;
+
+        for (int i = 0; i < reps; i++)
+        {
+            double start = Seconds();
+            int outbytes = Kraken_Decompress(input + hdrsize, input_size - hdrsize, output, unpacked_size, false);
+            double t = Seconds() - start;
+            if (outbytes != (int)unpacked_size)
+            {
+                error("decompress error", curfile);
+            }
+            if (t < best)
+            {
+                best = t;
+            }
+        }
+        printf("%-32s %10llu %10.1f MB/s\n", curfile, (unsigned long long)unpacked_size, unpacked_size * 1e-6 / best);
+
+        delete[] output;
+        delete[] input;
+    }
+    return 0;
+}
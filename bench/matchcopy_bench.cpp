@@ -0,0 +1,156 @@
+/*
+------------------------------------------------------------------------------
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+------------------------------------------------------------------------------
+*/
+
+// Sweeps match distance and length over the CopyMatch kernels and prints the
+// time per copy in ns. Every kernel is first checked against a byte by byte
+// copy.
+//
+// Usage: matchcopy_bench [iterations]
+
+
+#include "../stdafx.h"
+#include "../utilities.h"
+#include "../matchcopy.h"
+
+
+
+#define BENCH_WINDOW 4096
+
+typedef void (*CopyMatchFunc)(byte *dst, size_t dist, size_t length);
+
+
+
+// CopyMatchBytewise()
+static void CopyMatchBytewise(byte *dst, size_t dist, size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        dst[i] = dst[i - dist];
+    }
+}
+
+
+
+// CopyMatchAVX2Call()
+static __attribute__((target("avx2"))) void CopyMatchAVX2Call(byte *dst, size_t dist, size_t length)
+{
+    CopyMatchAVX2(dst, dist, length);
+}
+
+
+
+// CopyMatchSSE2Call()
+static void CopyMatchSSE2Call(byte *dst, size_t dist, size_t length)
+{
+    CopyMatchSSE2(dst, dist, length);
+}
+
+
+
+// Verify()
+//
+// Compares |copy| with the byte by byte reference over all distances below
+// 80 and lengths below 160, and checks that it stays within the overrun.
+static bool Verify(CopyMatchFunc copy, const char *name)
+{
+    byte ref[512];
+    byte out[512];
+
+    for (size_t dist = 1; dist < 80; dist++)
+    {
+        for (size_t length = 1; length < 160; length++)
+        {
+            for (size_t i = 0; i < sizeof(ref); i++)
+            {
+                ref[i] = out[i] = (byte)(i * 7 + 3);
+            }
+            CopyMatchBytewise(ref + 128, dist, length);
+            copy(out + 128, dist, length);
+            if (memcmp(ref, out, 128 + length) != 0 ||
+                memcmp(ref + 128 + length + MATCHCOPY_OVERRUN, out + 128 + length + MATCHCOPY_OVERRUN,
+                       sizeof(ref) - 128 - length - MATCHCOPY_OVERRUN) != 0)
+            {
+                fprintf(stderr, "%s: mismatch at dist %zu length %zu\n", name, dist, length);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+
+
+// Measure()
+//
+// Returns the average time of one copy in ns. The copies walk through a
+// window so consecutive calls do not write the same bytes.
+static double Measure(CopyMatchFunc copy, byte *buf, size_t dist, size_t length, int iterations)
+{
+    size_t pos = dist;
+    clock_t start = clock();
+
+    for (int i = 0; i < iterations; i++)
+    {
+        copy(buf + pos, dist, length);
+        pos += length;
+        if (pos + length + MATCHCOPY_OVERRUN > dist + BENCH_WINDOW)
+        {
+            pos = dist;
+        }
+    }
+    return (double)(clock() - start) / CLOCKS_PER_SEC * 1e9 / iterations;
+}
+
+
+
+int main(int argc, char *argv[])
+{
+    static const size_t kDistances[] = { 1, 2, 3, 4, 7, 8, 12, 16, 24, 31, 32, 64, 1000 };
+    static const size_t kLengths[] = { 4, 8, 16, 32, 64, 256, 1024 };
+    int iterations = (argc > 1) ? atoi(argv[1]) : 1000000;
+    bool avx2 = (CpuFeatures() & kCpuFeature_AVX2) != 0;
+    byte *buf = new byte[2 * BENCH_WINDOW + 1000];
+
+    if (!Verify(CopyMatchSSE2Call, "sse2") || (avx2 && !Verify(CopyMatchAVX2Call, "avx2")))
+    {
+        return 1;
+    }
+
+    for (size_t i = 0; i < 2 * BENCH_WINDOW + 1000; i++)
+    {
+        buf[i] = (byte)(i * 13);
+    }
+
+    printf("%6s %6s %10s %10s %10s\n", "dist", "length", "bytewise", "sse2", avx2 ? "avx2" : "-");
+    for (size_t dist : kDistances)
+    {
+        for (size_t length : kLengths)
+        {
+            printf("%6zu %6zu %10.2f %10.2f", dist, length,
+                   Measure(CopyMatchBytewise, buf, dist, length, iterations),
+                   Measure(CopyMatchSSE2Call, buf, dist, length, iterations));
+            if (avx2)
+            {
+                printf(" %10.2f", Measure(CopyMatchAVX2Call, buf, dist, length, iterations));
+            }
+            printf("\n");
+        }
+    }
+
+    delete[] buf;
+    return 0;
+}
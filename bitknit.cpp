@@ -19,11 +19,109 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "stdafx.h"
 #include "bitknit.h"
+#include "utilities.h"
+#include "matchcopy.h"
 
 
 struct BitknitState;
 
 
+
+// Rescales the model towards the frequencies seen since the last adaptation,
+// a[i + 1] = (a[i + 1] + freq[0] + ... + freq[i]) / 2, and resets freq[] to 1.
+// The prefix sum and the average are done 8 symbols at a time.
+static void BitknitAdaptCdf(uint16_t *a, uint16_t *freq, size_t n)
+{
+    const __m128i one = _mm_set1_epi16(1);
+    __m128i carry = _mm_setzero_si128();
+    size_t i;
+
+    for (i = 0; i + 8 <= n; i += 8)
+    {
+        __m128i sum = _mm_loadu_si128((const __m128i *)&freq[i]);
+        sum = _mm_add_epi16(sum, _mm_slli_si128(sum, 2));
+        sum = _mm_add_epi16(sum, _mm_slli_si128(sum, 4));
+        sum = _mm_add_epi16(sum, _mm_slli_si128(sum, 8));
+        sum = _mm_add_epi16(sum, carry);
+        carry = _mm_shufflehi_epi16(sum, _MM_SHUFFLE(3, 3, 3, 3));
+        carry = _mm_unpackhi_epi64(carry, carry);
+
+        // pavgw rounds up, the model wants the floor
+        __m128i old = _mm_loadu_si128((const __m128i *)&a[i + 1]);
+        __m128i avg = _mm_avg_epu16(old, sum);
+        avg = _mm_sub_epi16(avg, _mm_and_si128(_mm_xor_si128(old, sum), one));
+        _mm_storeu_si128((__m128i *)&a[i + 1], avg);
+        _mm_storeu_si128((__m128i *)&freq[i], one);
+    }
+
+    uint32_t sum = (uint16_t)_mm_cvtsi128_si32(carry);
+    for (; i < n; i++)
+    {
+        sum += freq[i];
+        freq[i] = 1;
+        a[i + 1] = a[i + 1] + ((sum - a[i + 1]) >> 1);
+    }
+}
+
+
+
+// Rebuilds lookup[j] = first symbol i with (a[i + 1] - 1) >> shift >= j.
+// That's the number of symbols that end before j, so every symbol but the
+// last bumps the entry after its end and a prefix sum over the table
+// gives the result. |lookup_size| is a multiple of 8.
+static void BitknitFillLookup(uint16_t *lookup, size_t lookup_size, const uint16_t *a, size_t n, int shift)
+{
+    size_t i;
+
+    for (i = 0; i < lookup_size; i += 8)
+    {
+        _mm_storeu_si128((__m128i *)&lookup[i], _mm_setzero_si128());
+    }
+    for (i = 0; i + 1 < n; i++)
+    {
+        lookup[((a[i + 1] - 1) >> shift) + 1]++;
+    }
+
+    __m128i carry = _mm_setzero_si128();
+    for (i = 0; i < lookup_size; i += 8)
+    {
+        __m128i sum = _mm_loadu_si128((const __m128i *)&lookup[i]);
+        sum = _mm_add_epi16(sum, _mm_slli_si128(sum, 2));
+        sum = _mm_add_epi16(sum, _mm_slli_si128(sum, 4));
+        sum = _mm_add_epi16(sum, _mm_slli_si128(sum, 8));
+        sum = _mm_add_epi16(sum, carry);
+        carry = _mm_shufflehi_epi16(sum, _MM_SHUFFLE(3, 3, 3, 3));
+        carry = _mm_unpackhi_epi64(carry, carry);
+        _mm_storeu_si128((__m128i *)&lookup[i], sum);
+    }
+}
+
+
+
+// Returns the first symbol from |sym| on whose upper bound a[sym + 1] is above
+// |masked|. Compares 8 bounds per step with one movemask instead of walking
+// them one by one, the 0x8000 at the end of a[] stops the search.
+static __forceinline size_t BitknitFindSymbol(const uint16_t *a, size_t sym, uint32_t masked)
+{
+    const __m128i m = _mm_set1_epi16((short)masked);
+    const __m128i zero = _mm_setzero_si128();
+    uint32_t le;
+
+    for (;;)
+    {
+        __m128i bounds = _mm_loadu_si128((const __m128i *)&a[sym + 1]);
+        le = _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_subs_epu16(bounds, m), zero));
+        if (le != 0xFFFF)
+        {
+            break;
+        }
+        sym += 8;
+    }
+    return sym + (__builtin_ctz(~le) >> 1);
+}
+
+
+
 void BitknitLiteral_Init(BitknitLiteral *model)
 {
     size_t i;
@@ -118,7 +216,7 @@ void BitknitDistanceBits_Init(BitknitDistanceBits *model)
 
 
 
-void BitknitState_Init(BitknitState *bk)
+static void BitknitState_Build(BitknitState *bk)
 {
     size_t i;
 
@@ -149,33 +247,32 @@ void BitknitState_Init(BitknitState *bk)
 
 
 
-void BitknitLiteral_Adaptive(BitknitLiteral *model, uint32_t sym)
+// Built on first use; a restart is then one copy of this state rather than
+// filling all 9 models and their lookup tables again.
+static const BitknitState *BitknitState_Initial()
 {
-    size_t i;
-    uint32_t sum;
-    uint16_t *p;
-    uint16_t *p_end;
+    static BitknitState initial;
+    static const bool built = (BitknitState_Build(&initial), true);
+    (void)built;
+    return &initial;
+}
+
+
+
+void BitknitState_Init(BitknitState *bk)
+{
+    memcpy(bk, BitknitState_Initial(), sizeof(BitknitState));
+}
+
+
 
+void BitknitLiteral_Adaptive(BitknitLiteral *model, uint32_t sym)
+{
     model->adapt_interval = 1024;
     model->freq[sym] += 725;
 
-    sum = 0;
-    for (i = 0; i < 300; i++)
-    {
-        sum += model->freq[i];
-        model->freq[i] = 1;
-        model->a[i + 1] = model->a[i + 1] + ((sum - model->a[i + 1]) >> 1);
-    }
-
-    for (i = 0, p = model->lookup; i < 300; i++)
-    {
-        p_end = &model->lookup[(model->a[i + 1] - 1) >> 6];
-        do {
-            p[0] = p[1] = p[2] = p[3] = i;
-            p += 4;
-        } while (p <= p_end);
-        p = p_end + 1;
-    }
+    BitknitAdaptCdf(model->a, model->freq, 300);
+    BitknitFillLookup(model->lookup, 512, model->a, 300, 6);
 }
 
 
@@ -186,9 +283,9 @@ uint32_t BitknitLiteral_Lookup(BitknitLiteral *model, uint32_t *bits)
     size_t sym = model->lookup[masked >> 6];
     sym += masked > model->a[sym + 1];
 
-    while (masked >= model->a[sym + 1])
+    if (masked >= model->a[sym + 1])
     {
-        sym += 1;
+        sym = BitknitFindSymbol(model->a, sym + 1, masked);
     }
     *bits = masked + (*bits >> 15) * (model->a[sym + 1] - model->a[sym]) - model->a[sym];
     model->freq[sym] += 31;
@@ -203,31 +300,11 @@ uint32_t BitknitLiteral_Lookup(BitknitLiteral *model, uint32_t *bits)
 
 void BitknitDistanceLsb_Adaptive(BitknitDistanceLsb *model, uint32_t sym)
 {
-    size_t i;
-    uint32_t sum;
-    uint16_t *p;
-    uint16_t *p_end;
-
     model->adapt_interval = 1024;
     model->freq[sym] += 985;
 
-    sum = 0;
-    for (i = 0; i < 40; i++)
-    {
-        sum += model->freq[i];
-        model->freq[i] = 1;
-        model->a[i + 1] = model->a[i + 1] + ((sum - model->a[i + 1]) >> 1);
-    }
-
-    for (i = 0, p = model->lookup; i < 40; i++)
-    {
-        p_end = &model->lookup[(model->a[i + 1] - 1) >> 9];
-        do {
-            p[0] = p[1] = p[2] = p[3] = i;
-            p += 4;
-        } while (p <= p_end);
-        p = p_end + 1;
-    }
+    BitknitAdaptCdf(model->a, model->freq, 40);
+    BitknitFillLookup(model->lookup, 64, model->a, 40, 9);
 }
 
 
@@ -238,9 +315,9 @@ uint32_t BitknitDistanceLsb_Lookup(BitknitDistanceLsb *model, uint32_t *bits)
     size_t sym = model->lookup[masked >> 9];
     sym += masked > model->a[sym + 1];
 
-    while (masked >= model->a[sym + 1])
+    if (masked >= model->a[sym + 1])
     {
-        sym += 1;
+        sym = BitknitFindSymbol(model->a, sym + 1, masked);
     }
     *bits = masked + (*bits >> 15) * (model->a[sym + 1] - model->a[sym]) - model->a[sym];
     model->freq[sym] += 31;
@@ -255,31 +332,11 @@ uint32_t BitknitDistanceLsb_Lookup(BitknitDistanceLsb *model, uint32_t *bits)
 
 void BitknitDistanceBits_Adaptive(BitknitDistanceBits *model, uint32_t sym)
 {
-    size_t i;
-    uint32_t sum;
-    uint16_t *p;
-    uint16_t *p_end;
-
     model->adapt_interval = 1024;
     model->freq[sym] += 1004;
 
-    sum = 0;
-    for (i = 0; i < 21; i++)
-    {
-        sum += model->freq[i];
-        model->freq[i] = 1;
-        model->a[i + 1] = model->a[i + 1] + ((sum - model->a[i + 1]) >> 1);
-    }
-
-    for (i = 0, p = model->lookup; i < 21; i++)
-    {
-        p_end = &model->lookup[(model->a[i + 1] - 1) >> 9];
-        do {
-            p[0] = p[1] = p[2] = p[3] = i;
-            p += 4;
-        } while (p <= p_end);
-        p = p_end + 1;
-    }
+    BitknitAdaptCdf(model->a, model->freq, 21);
+    BitknitFillLookup(model->lookup, 64, model->a, 21, 9);
 }
 
 
@@ -290,9 +347,9 @@ uint32_t BitknitDistanceBits_Lookup(BitknitDistanceBits *model, uint32_t *bits)
     size_t sym = model->lookup[masked >> 9];
     sym += masked > model->a[sym + 1];
 
-    while (masked >= model->a[sym + 1])
+    if (masked >= model->a[sym + 1])
     {
-        sym += 1;
+        sym = BitknitFindSymbol(model->a, sym + 1, masked);
     }
     *bits = masked + (*bits >> 15) * (model->a[sym + 1] - model->a[sym]) - model->a[sym];
     model->freq[sym] += 31;
@@ -309,75 +366,6 @@ uint32_t BitknitDistanceBits_Lookup(BitknitDistanceBits *model, uint32_t *bits)
 
 
 
-static void BitknitCopyLongDist(byte *dst, size_t dist, size_t length)
-{
-    const byte *src = dst - dist;
-    ((uint64_t*)dst)[0] = ((uint64_t*)src)[0];
-    ((uint64_t*)dst)[1] = ((uint64_t*)src)[1];
-
-    if (length > 16)
-    {
-        do {
-            ((uint64_t*)dst)[2] = ((uint64_t*)src)[2];
-            dst += 8;
-            src += 8;
-            length -= 8;
-        } while (length > 16);
-    }
-}
-
-
-
-static void BitknitCopyShortDist(byte *dst, size_t dist, size_t length)
-{
-    const byte *src = dst - dist;
-
-    if (dist >= 4)
-    {
-        ((uint32_t*)dst)[0] = ((uint32_t*)src)[0];
-        ((uint32_t*)dst)[1] = ((uint32_t*)src)[1];
-        ((uint32_t*)dst)[2] = ((uint32_t*)src)[2];
-        if (length > 12)
-        {
-            ((uint32_t*)dst)[3] = ((uint32_t*)src)[3];
-            if (length > 16)
-            {
-                do {
-                    ((uint32_t*)dst)[4] = ((uint32_t*)src)[4];
-                    length -= 4;
-                    dst += 4;
-                    src += 4;
-                } while (length > 16);
-            }
-        }
-    }
-    else if (dist == 1)
-    {
-        memset(dst, *src, length);
-    }
-    else
-    {
-        ((byte*)dst)[0] = ((byte*)src)[0];
-        ((byte*)dst)[1] = ((byte*)src)[1];
-        ((byte*)dst)[2] = ((byte*)src)[2];
-        ((byte*)dst)[3] = ((byte*)src)[3];
-        ((byte*)dst)[4] = ((byte*)src)[4];
-        ((byte*)dst)[5] = ((byte*)src)[5];
-        ((byte*)dst)[6] = ((byte*)src)[6];
-        ((byte*)dst)[7] = ((byte*)src)[7];
-        ((byte*)dst)[8] = ((byte*)src)[8];
-        while (length > 9)
-        {
-            ((byte*)dst)[9] = ((byte*)src)[9];
-            dst += 1;
-            src += 1;
-            length -= 1;
-        }
-    }
-}
-
-
-
 size_t Bitknit_Decode(const byte *src, const byte *src_end, byte *dst, byte *dst_end, byte *dst_start, BitknitState *bk)
 {
     const byte *src_in = src;
@@ -394,6 +382,7 @@ size_t Bitknit_Decode(const byte *src, const byte *src_end, byte *dst, byte *dst
     uint32_t copy_length;
     uint32_t recent_dist_mask;
     uint32_t match_dist;
+    const byte *copy_end = dst_end - MATCHCOPY_OVERRUN;
 
     for (i = 0; i < 4; i++)
     {
@@ -442,6 +431,10 @@ size_t Bitknit_Decode(const byte *src, const byte *src_end, byte *dst, byte *dst
   
     while (dst + 4 < dst_end)
     {
+        if (OOZLIN_FUZZ_SAFE && src > src_end)
+        {
+            return -1;
+        }
         uint32 sym = BitknitLiteral_Lookup(litmodel[(intptr_t)dst & 3], &bits);
         RENORMALIZE();
 
@@ -503,13 +496,22 @@ size_t Bitknit_Decode(const byte *src, const byte *src_end, byte *dst, byte *dst
             recent_dist_mask = (recent_dist_mask & mask) | (idx + 8 * recent_dist_mask) & ~mask;
         }
     
-        if (match_dist >= 8)
+        if (OOZLIN_FUZZ_SAFE && (match_dist > dst - dst_start || copy_length > dst_end - dst))
         {
-            BitknitCopyLongDist(dst, match_dist, copy_length);
+            return -1;
+        }
+        if (copy_length > copy_end - dst)
+        {
+            // too close to the end for the overrun of the vector copy
+            if (copy_length > dst_end - dst)
+            {
+                return -1;
+            }
+            CopyMatchExact(dst, match_dist, copy_length);
         }
         else
         {
-            BitknitCopyShortDist(dst, match_dist, copy_length);
+            CopyMatchSSE2(dst, match_dist, copy_length);
         }
 
         dst += copy_length;
@@ -62,8 +62,6 @@ void BitknitDistanceLsb_Adaptive(BitknitDistanceLsb *model, uint32_t sym);
 uint32_t BitknitDistanceLsb_Lookup(BitknitDistanceLsb *model, uint32_t *bits);
 void BitknitDistanceBits_Adaptive(BitknitDistanceBits *model, uint32_t sym);
 uint32_t BitknitDistanceBits_Lookup(BitknitDistanceBits *model, uint32_t *bits);
-static void BitknitCopyLongDist(byte *dst, size_t dist, size_t length);
-static void BitknitCopyShortDist(byte *dst, size_t dist, size_t length);
 size_t Bitknit_Decode(const byte *src, const byte *src_end, byte *dst,
                       byte *dst_end, byte *dst_start, BitknitState *bk);
 
@@ -0,0 +1,270 @@
+/*
+------------------------------------------------------------------------------
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+------------------------------------------------------------------------------
+*/
+
+#include "stdafx.h"
+
+
+// Bit writers for the encoders, the counterparts of BitReader and the
+// Huffman stream reader in Kraken_DecodeBytesCore().
+//
+// BitWriter writes the most significant bit first, which is the order
+// BitReader reads forward streams in. A backward stream is written forward
+// into a temporary buffer and copied out in reverse with CopyReversed().
+typedef struct BitWriter {
+    uint8_t *p;
+
+    // Pending bits, the last |bitpos| bits of |bits| are not written yet
+    uint64_t bits;
+    int bitpos;
+} BitWriter;
+
+
+// HuffWriter writes the least significant bit first, the order of the
+// Huffman streams. Codes are either written one at a time, or added in
+// groups with HuffWriter_Add() and stored together by HuffWriter_Spill().
+typedef struct HuffWriter {
+    uint8_t *p;
+
+    // Pending bits, the first |bitpos| bits of |bits| are not written yet
+    uint64_t bits;
+    int bitpos;
+} HuffWriter;
+
+
+
+// RevWriter writes a HuffWriter stream from its last bit to its first, for
+// encoders that work from the end of their input. The bytes are stored down
+// from the end of the buffer, and RevWriter_Finish() shifts them so that
+// the stream starts on a whole byte.
+typedef struct RevWriter {
+    uint8_t *p;
+    uint8_t *end;
+
+    // Pending bits, which go before the stored ones: the last |bitpos| bits
+    // of |bits|, the earliest in the lowest bit
+    uint64_t bits;
+    int bitpos;
+} RevWriter;
+
+
+
+// BitWriter_Init()
+static __forceinline void BitWriter_Init(BitWriter *bw, uint8_t *p)
+{
+    bw->p = p;
+    bw->bits = 0;
+    bw->bitpos = 0;
+}
+
+
+
+// BitWriter_Write()
+//
+// Writes the low |n| bits of |v|, n <= 32.
+static __forceinline void BitWriter_Write(BitWriter *bw, uint32_t v, int n)
+{
+    bw->bits = (bw->bits << n) | v;
+    bw->bitpos += n;
+    while (bw->bitpos >= 8)
+    {
+        bw->bitpos -= 8;
+        *bw->p++ = (uint8_t)(bw->bits >> bw->bitpos);
+    }
+}
+
+
+
+// BitWriter_Flush()
+//
+// Pads the last byte with zeros and returns the end of the output.
+static __forceinline uint8_t *BitWriter_Flush(BitWriter *bw)
+{
+    if (bw->bitpos)
+    {
+        *bw->p++ = (uint8_t)(bw->bits << (8 - bw->bitpos));
+        bw->bitpos = 0;
+    }
+    return bw->p;
+}
+
+
+
+// BitWriter_BitCount()
+//
+// Number of bits written to a stream that started at |start|.
+static __forceinline size_t BitWriter_BitCount(const BitWriter *bw, const uint8_t *start)
+{
+    return (bw->p - start) * 8 + bw->bitpos;
+}
+
+
+
+// HuffWriter_Init()
+static __forceinline void HuffWriter_Init(HuffWriter *hw, uint8_t *p)
+{
+    hw->p = p;
+    hw->bits = 0;
+    hw->bitpos = 0;
+}
+
+
+
+// HuffWriter_Write()
+//
+// Writes the low |n| bits of |v|, n <= 32.
+static __forceinline void HuffWriter_Write(HuffWriter *hw, uint32_t v, int n)
+{
+    hw->bits |= (uint64_t)v << hw->bitpos;
+    hw->bitpos += n;
+    if (hw->bitpos >= 32)
+    {
+        *(uint32_t *)hw->p = (uint32_t)hw->bits;
+        hw->p += 4;
+        hw->bits >>= 32;
+        hw->bitpos -= 32;
+    }
+}
+
+
+
+// HuffWriter_Add()
+//
+// Adds the low |n| bits of |v| without storing them. The pending bits must
+// fit in 64 until HuffWriter_Spill(), which leaves fewer than 8.
+static __forceinline void HuffWriter_Add(HuffWriter *hw, uint32_t v, int n)
+{
+    hw->bits |= (uint64_t)v << hw->bitpos;
+    hw->bitpos += n;
+}
+
+
+
+// HuffWriter_Spill()
+//
+// Stores the whole bytes of the pending bits without branching. Writes 8
+// bytes, so the output needs that much room past the last whole byte.
+static __forceinline void HuffWriter_Spill(HuffWriter *hw)
+{
+    *(uint64_t *)hw->p = hw->bits;
+    hw->p += hw->bitpos >> 3;
+    hw->bits >>= hw->bitpos & ~7;
+    hw->bitpos &= 7;
+}
+
+
+
+// HuffWriter_Flush()
+static __forceinline uint8_t *HuffWriter_Flush(HuffWriter *hw)
+{
+    while (hw->bitpos > 0)
+    {
+        *hw->p++ = (uint8_t)hw->bits;
+        hw->bits >>= 8;
+        hw->bitpos -= 8;
+    }
+    hw->bitpos = 0;
+    return hw->p;
+}
+
+
+
+// RevWriter_Init()
+//
+// The stream ends at |end|. Stores go down to 8 bytes below the start of
+// the stream and up to 8 bytes past |end|.
+static __forceinline void RevWriter_Init(RevWriter *rw, uint8_t *end)
+{
+    rw->p = end;
+    rw->end = end;
+    rw->bits = 0;
+    rw->bitpos = 0;
+    *(uint64_t *)end = 0;
+}
+
+
+
+// RevWriter_Add()
+//
+// Puts the low |n| bits of |v| in front of the stream. |v| has no bits above
+// those, and the pending bits must fit in 64 until RevWriter_Spill(), which
+// leaves fewer than 8.
+static __forceinline void RevWriter_Add(RevWriter *rw, uint32_t v, int n)
+{
+    rw->bits = (rw->bits << n) | v;
+    rw->bitpos += n;
+}
+
+
+
+// RevWriter_Spill()
+//
+// Stores the whole bytes of the pending bits without branching, the last
+// bits in the top of the 8 bytes below the stored ones.
+static __forceinline void RevWriter_Spill(RevWriter *rw)
+{
+    *(uint64_t *)(rw->p - 8) = (rw->bits << (63 - rw->bitpos)) << 1;
+    rw->p -= rw->bitpos >> 3;
+    rw->bitpos &= 7;
+}
+
+
+
+// RevWriter_Finish()
+//
+// Stores the rest of the bits, which leave the first byte partly empty, and
+// moves the stream down by those empty bits. As from HuffWriter_Flush(), the
+// stream then starts with its first bit and the last byte is padded with
+// zeros. Returns the start, the stream ends at |end|.
+static __forceinline uint8_t *RevWriter_Finish(RevWriter *rw)
+{
+    RevWriter_Spill(rw);
+    if (rw->bitpos)
+    {
+        int shift = 8 - rw->bitpos;
+        uint8_t *p = --rw->p;
+        *p = (uint8_t)(rw->bits << shift);
+        for (size_t i = 0, n = rw->end - p; i < n; i += 8)
+        {
+            *(uint64_t *)(p + i) = (*(uint64_t *)(p + i) >> shift) | ((uint64_t)p[i + 8] << (64 - shift));
+        }
+        rw->bitpos = 0;
+    }
+    return rw->p;
+}
+
+
+
+// CopyReversed()
+//
+// 16 bytes at a time: swap the bytes of each word, then reverse the words.
+static __forceinline void CopyReversed(uint8_t *dst, const uint8_t *src, size_t n)
+{
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + n - 16 - i));
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        v = _mm_shufflelo_epi16(v, 0x1B);
+        v = _mm_shufflehi_epi16(v, 0x1B);
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_shuffle_epi32(v, 0x4E));
+    }
+    for (; i != n; i++)
+    {
+        dst[i] = src[n - 1 - i];
+    }
+}
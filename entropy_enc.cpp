@@ -0,0 +1,1797 @@
+/*
+------------------------------------------------------------------------------
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+------------------------------------------------------------------------------
+*/
+
+#include "entropy_enc.h"
+#include "utilities.h"
+#include "kraken.h"
+#include <math.h>
+
+
+// Encoders for the byte arrays Kraken_DecodeBytes() reads: stored arrays,
+// Huffman coded ones in the three and six stream layouts, tANS coded ones,
+// runs and arrays split in parts, and the selector that weighs their sizes
+// against their decode times.
+
+
+
+// Huff_CountSymbols()
+//
+// Counts the symbols of |src|. Eight bytes are loaded at a time and spread
+// over four tables, so that runs of the same byte don't wait on the count
+// they just wrote; the tables are added up four counts at a time.
+void Huff_CountSymbols(const uint8_t *src, size_t src_size, uint32_t *histo)
+{
+    uint32_t counts[4][256];
+    size_t i = 0;
+
+    memset(counts, 0, sizeof(counts));
+    for (; i + 8 <= src_size; i += 8)
+    {
+        uint64_t v = *(const uint64_t *)(src + i);
+        counts[0][v & 0xFF]++;
+        counts[1][(v >> 8) & 0xFF]++;
+        counts[2][(v >> 16) & 0xFF]++;
+        counts[3][(v >> 24) & 0xFF]++;
+        counts[0][(v >> 32) & 0xFF]++;
+        counts[1][(v >> 40) & 0xFF]++;
+        counts[2][(v >> 48) & 0xFF]++;
+        counts[3][v >> 56]++;
+    }
+    for (; i < src_size; i++)
+    {
+        counts[0][src[i]]++;
+    }
+    for (int j = 0; j != 256; j += 4)
+    {
+        __m128i a = _mm_add_epi32(_mm_loadu_si128((const __m128i *)&counts[0][j]),
+                                  _mm_loadu_si128((const __m128i *)&counts[1][j]));
+        __m128i b = _mm_add_epi32(_mm_loadu_si128((const __m128i *)&counts[2][j]),
+                                  _mm_loadu_si128((const __m128i *)&counts[3][j]));
+        _mm_storeu_si128((__m128i *)&histo[j], _mm_add_epi32(a, b));
+    }
+}
+
+
+
+// Huff_SortKeys()
+//
+// Sorts |n| keys in increasing order, a byte at a time from the lowest.
+static void Huff_SortKeys(uint32_t *keys, int n)
+{
+    uint32_t tmp[256];
+    uint32_t max_key = 0;
+
+    for (int i = 0; i != n; i++)
+    {
+        max_key |= keys[i];
+    }
+    for (int shift = 0; shift < 32 && (max_key >> shift); shift += 8)
+    {
+        int pos[256];
+        memset(pos, 0, sizeof(pos));
+        for (int i = 0; i != n; i++)
+        {
+            pos[(keys[i] >> shift) & 0xFF]++;
+        }
+        for (int b = 0, total = 0; b != 256; b++)
+        {
+            int count = pos[b];
+            pos[b] = total;
+            total += count;
+        }
+        for (int i = 0; i != n; i++)
+        {
+            tmp[pos[(keys[i] >> shift) & 0xFF]++] = keys[i];
+        }
+        memcpy(keys, tmp, n * sizeof(uint32_t));
+    }
+}
+
+
+
+// Huff_BuildCodeLengths()
+//
+// Builds Huffman code lengths for the 256 symbol counts in |histo| with the
+// in-place method of Moffat and Katajainen, then limits them to
+// |max_codelen| bits. The code is always complete, a single used symbol gets
+// an unused neighbour so that both have one bit codes.
+void Huff_BuildCodeLengths(const uint32_t *histo, uint8_t *codelen, int max_codelen)
+{
+    uint32_t keys[256];
+    uint32_t a[256];
+    int n = 0;
+    int i;
+
+    memset(codelen, 0, 256);
+    for (i = 0; i != 256; i++)
+    {
+        if (histo[i])
+        {
+            keys[n++] = histo[i] << 8 | i;
+        }
+    }
+    if (n == 0)
+    {
+        return;
+    }
+    if (n == 1)
+    {
+        codelen[keys[0] & 0xFF] = 1;
+        codelen[(keys[0] & 0xFF) ^ 1] = 1;
+        return;
+    }
+
+    // sort by count, rarest first
+    Huff_SortKeys(keys, n);
+    for (i = 0; i != n; i++)
+    {
+        a[i] = keys[i] >> 8;
+    }
+
+    // Combine the two smallest weights into internal nodes, |a| ends up
+    // holding the parent of each internal node
+    int leaf = 0;
+    int root = 0;
+    int next;
+    for (next = 0; next < n - 1; next++)
+    {
+        if (leaf >= n || (root < next && a[root] < a[leaf]))
+        {
+            a[next] = a[root];
+            a[root++] = next;
+        }
+        else
+        {
+            a[next] = a[leaf++];
+        }
+        if (leaf >= n || (root < next && a[root] < a[leaf]))
+        {
+            a[next] += a[root];
+            a[root++] = next;
+        }
+        else
+        {
+            a[next] += a[leaf++];
+        }
+    }
+
+    // Depths of the internal nodes
+    a[n - 2] = 0;
+    for (next = n - 3; next >= 0; next--)
+    {
+        a[next] = a[a[next]] + 1;
+    }
+
+    // Depths of the leaves
+    int avail = 1;
+    int used = 0;
+    int depth = 0;
+    root = n - 2;
+    next = n - 1;
+    while (avail > 0)
+    {
+        while (root >= 0 && (int)a[root] == depth)
+        {
+            used++;
+            root--;
+        }
+        while (avail > used)
+        {
+            a[next--] = depth;
+            avail--;
+        }
+        avail = 2 * used;
+        depth++;
+        used = 0;
+    }
+
+    // Clamp to |max_codelen| and repair the Kraft sum, in units of the
+    // longest code, on the number of codes of each length. Lengthening the
+    // longest codes that can still grow costs the least; if that overshoots,
+    // the shortest codes that fit the room left are shortened again. The
+    // lengths then go back to the symbols, the longest to the rarest.
+    int count[32];
+    int kraft = 0;
+    memset(count, 0, sizeof(count));
+    for (i = 0; i != n; i++)
+    {
+        int len = ((int)a[i] > max_codelen) ? max_codelen : a[i];
+        count[len]++;
+        kraft += 1 << (max_codelen - len);
+    }
+    while (kraft > (1 << max_codelen))
+    {
+        int len = max_codelen - 1;
+        while (!count[len])
+        {
+            len--;
+        }
+        count[len]--;
+        count[len + 1]++;
+        kraft -= 1 << (max_codelen - len - 1);
+    }
+    while (kraft < (1 << max_codelen))
+    {
+        int room = (1 << max_codelen) - kraft;
+        int len = 2;
+        while (!count[len] || (1 << (max_codelen - len)) > room)
+        {
+            len++;
+        }
+        count[len]--;
+        count[len - 1]++;
+        kraft += 1 << (max_codelen - len);
+    }
+
+    i = 0;
+    for (int len = max_codelen; len != 0; len--)
+    {
+        for (int k = 0; k != count[len]; k++)
+        {
+            codelen[keys[i++] & 0xFF] = (uint8_t)len;
+        }
+    }
+}
+
+
+
+// Huff_MakeCodes()
+//
+// Assigns the canonical codes Huff_MakeLut() decodes: shorter codes first,
+// then by symbol. The codes are stored bit reversed.
+void Huff_MakeCodes(HuffCode *hc)
+{
+    uint32_t next_code[HUFF_MAX_CODE_LEN + 1];
+    int count[HUFF_MAX_CODE_LEN + 1];
+
+    memset(count, 0, sizeof(count));
+    for (int sym = 0; sym != 256; sym++)
+    {
+        count[hc->codelen[sym]]++;
+    }
+    hc->num_symbols = 256 - count[0];
+    next_code[1] = 0;
+    for (int len = 2; len <= HUFF_MAX_CODE_LEN; len++)
+    {
+        next_code[len] = (next_code[len - 1] + count[len - 1]) << 1;
+    }
+
+    for (int sym = 0; sym != 256; sym++)
+    {
+        int len = hc->codelen[sym];
+        uint32_t code = len ? next_code[len]++ : 0;
+        uint32_t rev = 0;
+        for (int i = 0; i != len; i++)
+        {
+            rev |= ((code >> i) & 1) << (len - 1 - i);
+        }
+        hc->code[sym] = (uint16_t)rev;
+    }
+}
+
+
+
+// Huff_ForcedBits()
+//
+// The number of low bits, 0 to 3, that Rice codes the code length
+// differences |values| in the fewest bits, or -1 if none keeps the unary
+// parts within the 20 >> bits Huff_ReadCodeLengthsOld() takes.
+static int Huff_ForcedBits(const uint8_t *values, int n)
+{
+    int best = -1;
+    int best_bits = 0x7FFFFFFF;
+
+    for (int k = 0; k != 4; k++)
+    {
+        int bits = n * (k + 1);
+        int q = 0;
+        for (int i = 0; i != n; i++)
+        {
+            bits += values[i] >> k;
+            q = Max(q, values[i] >> k);
+        }
+        if (q <= (20 >> k) && bits < best_bits)
+        {
+            best = k;
+            best_bits = bits;
+        }
+    }
+    return best;
+}
+
+
+
+// Huff_WriteGamma()
+//
+// The gamma code Huff_ReadCodeLengthsOld() reads for run lengths, |v| >= 2.
+static void Huff_WriteGamma(BitWriter *bw, uint32_t v)
+{
+    int n = 32 - CountLeadingZeros(v);
+    BitWriter_Write(bw, v, 2 * n - 2);
+}
+
+
+
+// Huff_WriteCodeLengthsDense()
+//
+// Runs of used and unused symbols, each code length coded as a difference
+// from a running average, Rice coded with the best number of low bits.
+// Returns the number of bits, or -1 if the differences are too large.
+static int Huff_WriteCodeLengthsDense(uint8_t *dst, const uint8_t *codelen)
+{
+    BitWriter bw;
+    uint8_t values[256];
+    int num_values = 0;
+    int avg_bits_x4 = 32;
+    int sym = 0;
+
+    for (sym = 0; sym != 256; sym++)
+    {
+        if (codelen[sym])
+        {
+            int d = codelen[sym] - ((avg_bits_x4 + 2) >> 2);
+            values[num_values++] = (uint8_t)((d >= 0) ? 2 * d : -2 * d - 1);
+            avg_bits_x4 = codelen[sym] + ((3 * avg_bits_x4 + 2) >> 2);
+        }
+    }
+    int forced_bits = Huff_ForcedBits(values, num_values);
+    if (forced_bits < 0)
+    {
+        return -1;
+    }
+
+    BitWriter_Init(&bw, dst);
+    BitWriter_Write(&bw, 0, 1);  // old format
+    BitWriter_Write(&bw, 1, 1);  // dense
+    BitWriter_Write(&bw, forced_bits, 2);
+    BitWriter_Write(&bw, codelen[0] != 0, 1);
+    const uint8_t *v = values;
+    sym = 0;
+    while (sym < 256)
+    {
+        int n;
+        if (codelen[sym] == 0)
+        {
+            for (n = 0; sym + n < 256 && codelen[sym + n] == 0; n++)
+            {
+            }
+            Huff_WriteGamma(&bw, n + 1);
+            sym += n;
+            if (sym >= 256)
+            {
+                break;
+            }
+        }
+        for (n = 0; sym + n < 256 && codelen[sym + n] != 0; n++)
+        {
+        }
+        Huff_WriteGamma(&bw, n + 1);
+        for (; n; n--, sym++, v++)
+        {
+            int lz = *v >> forced_bits;
+            BitWriter_Write(&bw, (1 << forced_bits) | (*v & ((1 << forced_bits) - 1)), lz + forced_bits + 1);
+        }
+    }
+    int bits = (int)BitWriter_BitCount(&bw, dst);
+    BitWriter_Flush(&bw);
+    return bits;
+}
+
+
+
+// Huff_WriteCodeLengthsSparse()
+//
+// Each used symbol with its code length. Returns the number of bits.
+static int Huff_WriteCodeLengthsSparse(uint8_t *dst, const uint8_t *codelen, int num_symbols)
+{
+    BitWriter bw;
+    int max_codelen = 0;
+
+    for (int sym = 0; sym != 256; sym++)
+    {
+        max_codelen = codelen[sym] > max_codelen ? codelen[sym] : max_codelen;
+    }
+    int codelen_bits = (max_codelen > 1) ? 32 - CountLeadingZeros(max_codelen - 1) : 0;
+
+    BitWriter_Init(&bw, dst);
+    BitWriter_Write(&bw, 0, 1);  // old format
+    BitWriter_Write(&bw, 0, 1);  // sparse
+    BitWriter_Write(&bw, num_symbols, 8);
+    BitWriter_Write(&bw, codelen_bits, 3);
+    for (int sym = 0; sym != 256; sym++)
+    {
+        if (codelen[sym])
+        {
+            BitWriter_Write(&bw, sym, 8);
+            BitWriter_Write(&bw, codelen[sym] - 1, codelen_bits);
+        }
+    }
+    int bits = (int)BitWriter_BitCount(&bw, dst);
+    BitWriter_Flush(&bw);
+    return bits;
+}
+
+
+
+// Huff_WriteCodeLengthsOld()
+//
+// Writes the code lengths of |hc| in the format Huff_ReadCodeLengthsOld()
+// reads, the smaller of the sparse and dense forms. Returns the number of
+// bytes, at most 1024.
+int Huff_WriteCodeLengthsOld(uint8_t *dst, const HuffCode *hc)
+{
+    uint8_t buf[1024];
+    int best_bits = 0x7FFFFFFF;
+
+    if (hc->num_symbols < 256)
+    {
+        best_bits = Huff_WriteCodeLengthsSparse(dst, hc->codelen, hc->num_symbols);
+    }
+    int bits = Huff_WriteCodeLengthsDense(buf, hc->codelen);
+    if (bits >= 0 && bits < best_bits)
+    {
+        best_bits = bits;
+        memcpy(dst, buf, (bits + 7) >> 3);
+    }
+    return (best_bits + 7) >> 3;
+}
+
+
+
+// Huff_MakeRanges()
+//
+// The |n| used symbols |syms|, in increasing order, the way
+// Huff_ConvertToRanges() reads them: the gap before the first range if there
+// is one, then the size of each range and the gap after it, the last range
+// being what is left. Each is a Rice coded bit count in |range_bits| and
+// that many extra bits in |range_extra|; gaps are at least 1 and have one
+// more extra bit than sizes. Returns how many there are, the fluff.
+static int Huff_MakeRanges(const uint8_t *syms, int n, uint8_t *range_bits, uint32_t *range_extra)
+{
+    int fluff = 0;
+    int end = 0;
+
+    for (int i = 0; i != n; )
+    {
+        int start = syms[i];
+        int gap = start - end;
+        if (gap)
+        {
+            int bits = 31 - CountLeadingZeros(gap + 1) - 1;
+            range_bits[fluff] = (uint8_t)bits;
+            range_extra[fluff++] = gap + 1 - (2 << bits);
+        }
+        for (end = start + 1, i++; i != n && syms[i] == end; i++)
+        {
+            end++;
+        }
+        if (i != n)
+        {
+            int bits = 31 - CountLeadingZeros(end - start);
+            range_bits[fluff] = (uint8_t)bits;
+            range_extra[fluff++] = end - start - (1 << bits);
+        }
+    }
+    return fluff;
+}
+
+
+
+// Huff_WriteFluff()
+//
+// The fluff of |n| used symbols in truncated binary, below
+// 2 * min(257 - n, n). BitReader_ReadFluff() reads nothing for 256 symbols.
+static void Huff_WriteFluff(BitWriter *bw, int n, int fluff)
+{
+    if (n != 256)
+    {
+        int x = 2 * (int)Min(257 - n, n);
+        int y = 32 - CountLeadingZeros(x - 1);
+        int z = (1 << y) - x;
+        if (fluff < z)
+        {
+            BitWriter_Write(bw, fluff, y - 1);
+        }
+        else
+        {
+            BitWriter_Write(bw, fluff + z, y);
+        }
+    }
+}
+
+
+
+// Huff_WriteRangeExtras()
+//
+// The extra bits of the ranges from Huff_MakeRanges(), the first being a gap
+// when the first used symbol isn't 0.
+static void Huff_WriteRangeExtras(BitWriter *bw, const uint8_t *range_bits, const uint32_t *range_extra,
+                                  int fluff, int first_sym)
+{
+    for (int i = 0, gap = (first_sym != 0); i != fluff; i++, gap ^= 1)
+    {
+        BitWriter_Write(bw, range_extra[i], range_bits[i] + gap);
+    }
+}
+
+
+
+// Huff_WriteCodeLengthsNew()
+//
+// The format Huff_ReadCodeLengthsNew() reads: the code lengths of the used
+// symbols as differences from a running average, Rice coded with the best
+// number of low bits, then the used symbols as ranges. Returns the number of
+// bits, or -1 if the differences are too large.
+static int Huff_WriteCodeLengthsNew(uint8_t *dst, const HuffCode *hc)
+{
+    BitWriter bw;
+    uint8_t deltas[256];
+    uint8_t syms[256];
+    uint8_t range_bits[512];
+    uint32_t range_extra[512];
+    int n = 0;
+
+    // Differences the way Huff_ReadCodeLengthsNew() adds them back, in byte
+    // arithmetic
+    uint32_t running_sum = 0x1e;
+    for (int sym = 0; sym != 256; sym++)
+    {
+        if (!hc->codelen[sym])
+        {
+            continue;
+        }
+        int d = (int8_t)(hc->codelen[sym] - (uint8_t)((running_sum >> 2) + 1));
+        deltas[n] = (uint8_t)((d >= 0) ? 2 * d : -2 * d - 1);
+        syms[n++] = (uint8_t)sym;
+        running_sum += d;
+    }
+    int fluff = Huff_MakeRanges(syms, n, range_bits, range_extra);
+
+    int forced_bits = Huff_ForcedBits(deltas, n);
+    if (forced_bits < 0)
+    {
+        return -1;
+    }
+
+    BitWriter_Init(&bw, dst);
+    BitWriter_Write(&bw, 1, 1);  // not old format
+    BitWriter_Write(&bw, 0, 1);  // new format
+    BitWriter_Write(&bw, forced_bits, 2);
+    BitWriter_Write(&bw, n - 1, 8);
+    Huff_WriteFluff(&bw, n, fluff);
+
+    // All the unary parts, then the low bits of the differences, then the
+    // extra bits of the ranges
+    for (int i = 0; i != n + fluff; i++)
+    {
+        int q = (i < n) ? deltas[i] >> forced_bits : range_bits[i - n];
+        BitWriter_Write(&bw, 1, q + 1);
+    }
+    for (int i = 0; i != n; i++)
+    {
+        BitWriter_Write(&bw, deltas[i] & ((1 << forced_bits) - 1), forced_bits);
+    }
+    Huff_WriteRangeExtras(&bw, range_bits, range_extra, fluff, syms[0]);
+    int bits = (int)BitWriter_BitCount(&bw, dst);
+    BitWriter_Flush(&bw);
+    return bits;
+}
+
+
+
+// Huff_WriteCodeLengths()
+//
+// Writes the code lengths of |hc| in whichever of the old and new formats is
+// smaller. Returns the number of bytes, at most HUFF_MAX_CODE_LENGTHS_SIZE.
+int Huff_WriteCodeLengths(uint8_t *dst, const HuffCode *hc)
+{
+    uint8_t buf[HUFF_MAX_CODE_LENGTHS_SIZE];
+    int size = Huff_WriteCodeLengthsOld(dst, hc);
+    int bits = Huff_WriteCodeLengthsNew(buf, hc);
+
+    if (bits >= 0 && (bits + 7) >> 3 < size)
+    {
+        size = (bits + 7) >> 3;
+        memcpy(dst, buf, size);
+    }
+    return size;
+}
+
+
+
+// Huff_WriteStreamsCore()
+//
+// Huffman codes |src| into the three streams Kraken_DecodeBytesCore() reads:
+// symbol i goes to the forward stream at the start, the backward stream at
+// the end and the forward stream in the middle, in turn. Writes the size of
+// the first stream and the streams. |tmp| needs room for
+// HUFF_STREAMS_TMP_SIZE(src_size) bytes. Returns the size, or -1 if the
+// first stream is too large for its 16 bit size.
+static __forceinline int Huff_WriteStreamsCore(uint8_t *dst, const uint8_t *src, int src_size, const HuffCode *hc,
+                                               uint8_t *tmp)
+{
+    const uint16_t *code = hc->code;
+    const uint8_t *codelen = hc->codelen;
+    int stream_room = HUFF_STREAM_SIZE_BOUND((src_size + 2) / 3);
+    HuffWriter wa;
+    HuffWriter wb;
+    HuffWriter wc;
+    int i = 0;
+
+    HuffWriter_Init(&wa, tmp);
+    HuffWriter_Init(&wb, tmp + stream_room);
+    HuffWriter_Init(&wc, tmp + 2 * stream_room);
+
+    // Five codes of up to 11 bits per stream between stores
+    for (; i + 15 <= src_size; i += 15)
+    {
+        for (int k = 0; k != 15; k += 3)
+        {
+            HuffWriter_Add(&wa, code[src[i + k + 0]], codelen[src[i + k + 0]]);
+            HuffWriter_Add(&wb, code[src[i + k + 1]], codelen[src[i + k + 1]]);
+            HuffWriter_Add(&wc, code[src[i + k + 2]], codelen[src[i + k + 2]]);
+        }
+        HuffWriter_Spill(&wa);
+        HuffWriter_Spill(&wb);
+        HuffWriter_Spill(&wc);
+    }
+    for (; i + 3 <= src_size; i += 3)
+    {
+        HuffWriter_Write(&wa, code[src[i + 0]], codelen[src[i + 0]]);
+        HuffWriter_Write(&wb, code[src[i + 1]], codelen[src[i + 1]]);
+        HuffWriter_Write(&wc, code[src[i + 2]], codelen[src[i + 2]]);
+    }
+    if (i < src_size)
+    {
+        HuffWriter_Write(&wa, code[src[i]], codelen[src[i]]);
+    }
+    if (i + 1 < src_size)
+    {
+        HuffWriter_Write(&wb, code[src[i + 1]], codelen[src[i + 1]]);
+    }
+    int size_a = (int)(HuffWriter_Flush(&wa) - tmp);
+    int size_b = (int)(HuffWriter_Flush(&wb) - (tmp + stream_room));
+    int size_c = (int)(HuffWriter_Flush(&wc) - (tmp + 2 * stream_room));
+    if (size_a > 0xFFFF)
+    {
+        return -1;
+    }
+
+    uint8_t *p = dst;
+    *(uint16_t *)p = (uint16_t)size_a;
+    p += 2;
+    memcpy(p, tmp, size_a);
+    p += size_a;
+    memcpy(p, tmp + 2 * stream_room, size_c);
+    p += size_c;
+    CopyReversed(p, tmp + stream_room, size_b);
+    return (int)(p - dst) + size_b;
+}
+
+
+
+// Huff_WriteStreamsBMI2()
+//
+// Huff_WriteStreamsCore() with the BMI2 shifts, which take the shift count
+// from any register instead of queueing the three streams up on cl.
+static __attribute__((target("bmi2"), flatten))
+int Huff_WriteStreamsBMI2(uint8_t *dst, const uint8_t *src, int src_size, const HuffCode *hc, uint8_t *tmp)
+{
+    return Huff_WriteStreamsCore(dst, src, src_size, hc, tmp);
+}
+
+
+
+// Huff_WriteStreams()
+static int Huff_WriteStreams(uint8_t *dst, const uint8_t *src, int src_size, const HuffCode *hc, uint8_t *tmp)
+{
+    if (CpuFeatures() & kCpuFeature_BMI2)
+    {
+        return Huff_WriteStreamsBMI2(dst, src, src_size, hc, tmp);
+    }
+    return Huff_WriteStreamsCore(dst, src, src_size, hc, tmp);
+}
+
+
+
+// Kraken_EntropyHeaderSize()
+//
+// The size of the array header for |size| bytes that decode to |src_size|.
+// Short headers hold 10 bit sizes.
+static int Kraken_EntropyHeaderSize(int src_size, int size, bool long_header)
+{
+    return (!long_header && size < 0x400 && src_size - size - 1 < 0x400) ? 3 : 5;
+}
+
+
+
+// Kraken_WriteEntropyHeader()
+//
+// Puts the array header of chunk |type| in front of the |size| bytes that
+// were written at |dst| + ENCODE_BYTES_MAX_HEADER. Returns the size with the
+// header, or -1 if that isn't smaller than storing the array.
+static int Kraken_WriteEntropyHeader(uint8_t *dst, int type, int src_size, int size, bool long_header)
+{
+    int stored_size = src_size + ((src_size < 0x1000 && !long_header) ? 2 : 3);
+    int hdr_size = Kraken_EntropyHeaderSize(src_size, size, long_header);
+    if (size + hdr_size >= stored_size || size >= src_size || size > 0x3FFFF)
+    {
+        return -1;
+    }
+
+    if (hdr_size == 3)
+    {
+        uint32_t bits = 0x800000 | (type << 20) | ((src_size - size - 1) << 10) | size;
+        dst[0] = (uint8_t)(bits >> 16);
+        dst[1] = (uint8_t)(bits >> 8);
+        dst[2] = (uint8_t)bits;
+        memmove(dst + 3, dst + ENCODE_BYTES_MAX_HEADER, size);
+    }
+    else
+    {
+        uint32_t bits = ((uint32_t)(src_size - 1) << 18) | size;
+        dst[0] = (uint8_t)((type << 4) | ((src_size - 1) >> 14));
+        dst[1] = (uint8_t)(bits >> 24);
+        dst[2] = (uint8_t)(bits >> 16);
+        dst[3] = (uint8_t)(bits >> 8);
+        dst[4] = (uint8_t)bits;
+    }
+    return hdr_size + size;
+}
+
+
+
+// Huff_EncodeBytes()
+//
+// Huffman codes |src| with the array header in front, in the three stream
+// layout of Kraken_DecodeBytes_Type12(), or in its six stream layout, which
+// codes each half as three streams, for arrays where the first of three
+// streams could outgrow its 16 bit size. |histo| holds the counts of
+// Huff_CountSymbols(). Returns the size, or -1 if that wouldn't be smaller
+// than storing the array.
+int Huff_EncodeBytes(uint8_t *dst, const uint8_t *src, int src_size, const uint32_t *histo, bool long_header)
+{
+    HuffCode hc;
+    uint8_t hdr[HUFF_MAX_CODE_LENGTHS_SIZE];
+    size_t total_bits = 0;
+
+    Huff_BuildCodeLengths(histo, hc.codelen, HUFF_MAX_CODE_LEN);
+    Huff_MakeCodes(&hc);
+    for (int i = 0; i != 256; i++)
+    {
+        total_bits += (size_t)histo[i] * hc.codelen[i];
+    }
+
+    // Give up early if even the largest the output can be isn't smaller,
+    // which also keeps it in |dst|. The streams are each padded to whole
+    // bytes and preceded by their sizes.
+    bool six_streams = HUFF_STREAM_SIZE_BOUND((src_size + 2) / 3) > 0xFFFF;
+    int hdr_size = Huff_WriteCodeLengths(hdr, &hc);
+    int size = hdr_size + (int)((total_bits + 7) >> 3) + (six_streams ? 7 + 5 : 2 + 2);
+    int stored_size = src_size + ((src_size < 0x1000 && !long_header) ? 2 : 3);
+    if (size + 3 >= stored_size || size >= src_size)
+    {
+        return -1;
+    }
+
+    uint8_t *tmp = new uint8_t[HUFF_STREAMS_TMP_SIZE(src_size)];
+    uint8_t *body = dst + ENCODE_BYTES_MAX_HEADER;
+    uint8_t *p = body;
+    memcpy(p, hdr, hdr_size);
+    p += hdr_size;
+    if (!six_streams)
+    {
+        int n = Huff_WriteStreams(p, src, src_size, &hc, tmp);
+        p = (n < 0) ? NULL : p + n;
+    }
+    else
+    {
+        // The size of the first half, then the halves, the first rounded up
+        uint8_t *first = p + 3;
+        int half = (src_size + 1) >> 1;
+        int n = Huff_WriteStreams(first, src, half, &hc, tmp);
+        int m = (n < 0) ? -1 : Huff_WriteStreams(first + n, src + half, src_size - half, &hc, tmp);
+        if (m >= 0)
+        {
+            p[0] = (uint8_t)n;
+            p[1] = (uint8_t)(n >> 8);
+            p[2] = (uint8_t)(n >> 16);
+        }
+        p = (m < 0) ? NULL : first + n + m;
+    }
+    delete[] tmp;
+    if (!p)
+    {
+        return -1;
+    }
+
+    return Kraken_WriteEntropyHeader(dst, six_streams ? 4 : 2, src_size, (int)(p - body), long_header);
+}
+
+
+
+// Tans_NormalizeWeights()
+//
+// Scales the counts in |histo| of the |n| used symbols |syms| to weights
+// that add up to 1 << |L_bits|, each at least 1. Symbols too rare for a slot
+// of their own get one and the others share the rest in proportion to their
+// counts. The slots the rounding leaves over, or takes too many, are then
+// settled one at a time where that costs the fewest bits.
+void Tans_NormalizeWeights(const uint32_t *histo, int total, const uint8_t *syms, int n, int L_bits,
+                           uint32_t *weight)
+{
+    int L = 1 << L_bits;
+    int room = L;
+    uint32_t rest = total;
+
+    for (int i = 0; i != n; i++)
+    {
+        if ((uint64_t)histo[syms[i]] << L_bits < (uint64_t)total)
+        {
+            room--;
+            rest -= histo[syms[i]];
+        }
+    }
+
+    int sum = 0;
+    for (int i = 0; i != n; i++)
+    {
+        uint64_t count = histo[syms[i]];
+        uint32_t w = 1;
+        if (count << L_bits >= (uint64_t)total)
+        {
+            w = (uint32_t)((count * room + rest / 2) / rest);
+            w += (w == 0);
+        }
+        weight[syms[i]] = w;
+        sum += w;
+    }
+
+    // What a slot more saves or a slot less costs, in bits, as the gain of
+    // taking the step
+    float gain[256];
+    int step = (sum < L) ? 1 : -1;
+    for (int i = 0; i != n; i++)
+    {
+        uint32_t w = weight[syms[i]];
+        gain[i] = (step > 0) ? histo[syms[i]] * log2f((w + 1) / (float)w) :
+                  (w > 1) ? -(histo[syms[i]] * log2f(w / (float)(w - 1))) : -1e30f;
+    }
+    for (; sum != L; sum += step)
+    {
+        int best = 0;
+        for (int i = 1; i != n; i++)
+        {
+            if (gain[i] > gain[best])
+            {
+                best = i;
+            }
+        }
+        uint32_t w = weight[syms[best]] += step;
+        gain[best] = (step > 0) ? histo[syms[best]] * log2f((w + 1) / (float)w) :
+                     (w > 1) ? -(histo[syms[best]] * log2f(w / (float)(w - 1))) : -1e30f;
+    }
+}
+
+
+
+// Tans_WriteTableSparse()
+//
+// The form of Tans_DecodeTable() for 2 to 9 symbols: all but the heaviest
+// symbol in increasing order of weight, each weight as the increase over
+// the one before, then the heaviest, which gets what is left.
+static void Tans_WriteTableSparse(BitWriter *bw, const uint32_t *weight, const uint8_t *syms, int n, int L_bits)
+{
+    uint32_t keys[9];
+    uint32_t deltas = 0;
+
+    for (int i = 0; i != n; i++)
+    {
+        keys[i] = (weight[syms[i]] << 8) | syms[i];
+    }
+    Huff_SortKeys(keys, n);
+    for (int i = 0; i != n - 1; i++)
+    {
+        deltas |= (keys[i] >> 8) - ((i > 0) ? keys[i - 1] >> 8 : 0);
+    }
+    int delta_bits = 32 - CountLeadingZeros(deltas);
+
+    BitWriter_Write(bw, 0, 1);
+    BitWriter_Write(bw, n - 2, 3);
+    BitWriter_Write(bw, delta_bits, BSR(L_bits) + 1);
+    for (int i = 0; i != n - 1; i++)
+    {
+        BitWriter_Write(bw, keys[i] & 0xFF, 8);
+        BitWriter_Write(bw, (keys[i] >> 8) - ((i > 0) ? keys[i - 1] >> 8 : 0), delta_bits);
+    }
+    BitWriter_Write(bw, keys[n - 1] & 0xFF, 8);
+}
+
+
+
+// Tans_WriteTableGolomb()
+//
+// The other form of Tans_DecodeTable(): the weights of the used symbols as
+// differences from a running average, Exp-Golomb coded with the best number
+// of low bits, and the used symbols as ranges. The unary parts come first,
+// then the extra bits of the ranges, then those of the weights.
+static void Tans_WriteTableGolomb(BitWriter *bw, const uint32_t *weight, const uint8_t *syms, int n)
+{
+    uint32_t values[256];
+    uint8_t range_bits[512];
+    uint32_t range_extra[512];
+    int average = 6;
+
+    // Weights less 1 close to the average are folded around it, the way
+    // Tans_DecodeTable() unfolds them
+    for (int i = 0; i != n; i++)
+    {
+        int v = weight[syms[i]] - 1;
+        int average_div4 = average >> 2;
+        int limit = 2 * average_div4;
+        if (v <= limit)
+        {
+            int d = v - average_div4;
+            values[i] = (d >= 0) ? 2 * d : -2 * d - 1;
+        }
+        else
+        {
+            values[i] = v;
+        }
+        average += ((v < limit) ? v : limit) - average_div4;
+    }
+
+    // v + (1 << Q) takes 2 * q + 1 + Q bits, q its bits above Q
+    int Q = 0;
+    int best_bits = 0x7FFFFFFF;
+    for (int k = 0; k != 8; k++)
+    {
+        int bits = n * (k + 1);
+        for (int i = 0; i != n; i++)
+        {
+            bits += 2 * (BSR(values[i] + (1 << k)) - k);
+        }
+        if (bits < best_bits)
+        {
+            Q = k;
+            best_bits = bits;
+        }
+    }
+    int fluff = Huff_MakeRanges(syms, n, range_bits, range_extra);
+
+    BitWriter_Write(bw, 1, 1);
+    BitWriter_Write(bw, Q, 3);
+    BitWriter_Write(bw, n - 1, 8);
+    Huff_WriteFluff(bw, n, fluff);
+    for (int i = 0; i != n; i++)
+    {
+        BitWriter_Write(bw, 1, BSR(values[i] + (1 << Q)) - Q + 1);
+    }
+    for (int i = 0; i != fluff; i++)
+    {
+        BitWriter_Write(bw, 1, range_bits[i] + 1);
+    }
+    Huff_WriteRangeExtras(bw, range_bits, range_extra, fluff, syms[0]);
+    for (int i = 0; i != n; i++)
+    {
+        int nextra = BSR(values[i] + (1 << Q));
+        BitWriter_Write(bw, values[i] + (1 << Q) - (1 << nextra), nextra);
+    }
+}
+
+
+
+// Tans_WriteTable()
+//
+// Writes the bit Krak_DecodeTans() reserves, the table size and the smaller
+// form of the table of the |n| used symbols |syms|. Returns the number of
+// bytes, at most TANS_MAX_TABLE_SIZE.
+int Tans_WriteTable(uint8_t *dst, const uint32_t *weight, const uint8_t *syms, int n, int L_bits)
+{
+    BitWriter bw;
+
+    BitWriter_Init(&bw, dst);
+    BitWriter_Write(&bw, 0, 1);
+    BitWriter_Write(&bw, L_bits - TANS_MIN_L_BITS, 2);
+    Tans_WriteTableGolomb(&bw, weight, syms, n);
+    int size = (int)(BitWriter_Flush(&bw) - dst);
+
+    if (n <= 9)
+    {
+        uint8_t buf[32];
+        BitWriter_Init(&bw, buf);
+        BitWriter_Write(&bw, 0, 1);
+        BitWriter_Write(&bw, L_bits - TANS_MIN_L_BITS, 2);
+        Tans_WriteTableSparse(&bw, weight, syms, n, L_bits);
+        int sparse_size = (int)(BitWriter_Flush(&bw) - buf);
+        if (sparse_size < size)
+        {
+            memcpy(dst, buf, sparse_size);
+            size = sparse_size;
+        }
+    }
+    return size;
+}
+
+
+
+// Tans_MakeEncoder()
+//
+// Builds the decoding table of the weights with Tans_InitLut(), in the
+// order Tans_DecodeTable() gives it the symbols, and inverts it.
+void Tans_MakeEncoder(TansEncoder *te, const uint32_t *weight, const uint8_t *syms, int n, int L_bits)
+{
+    TansData tans_data;
+    TansLutEnt lut[1 << TANS_MAX_L_BITS];
+    int L = 1 << L_bits;
+    int pos = 0;
+
+    tans_data.A_used = 0;
+    tans_data.B_used = 0;
+    for (int i = 0; i != n; i++)
+    {
+        int sym = syms[i];
+        uint32_t w = weight[sym];
+        if (w == 1)
+        {
+            tans_data.A[tans_data.A_used++] = (uint8_t)sym;
+        }
+        else
+        {
+            tans_data.B[tans_data.B_used++] = (sym << 16) + w;
+        }
+
+        // Z bits from X >= w << Z up, Z - 1 below
+        int bits = L_bits - BSR(w);
+        te->sym[sym].delta_bits = (bits << 16) - (w << bits);
+        te->sym[sym].next = pos - w;
+        pos += w;
+    }
+    Tans_InitLut(&tans_data, L_bits, lut);
+
+    // The slots of a symbol take states from [0, L) in runs of 1 << bits_x
+    // starting at w; X >> bits_x of the run is which of its slots it is
+    for (int x = 0; x != L; x++)
+    {
+        const TansLutEnt *e = &lut[x];
+        te->next_state[te->sym[e->symbol].next + ((e->w + L) >> e->bits_x)] = (uint16_t)(x + L);
+    }
+    te->L_bits = L_bits;
+}
+
+
+
+// Tans_EncodeStreamsCore()
+//
+// Codes |src| into the two streams Tans_Decode() reads, from the last symbol
+// to the first. Symbol i is decoded with state i % 5, from the forward
+// stream when i / 5 is even and from the backward stream when it's odd; the
+// last five bytes are the states the decoder ends in. Writes the forward
+// stream and the backward stream reversed, and returns their size. |tmp|
+// needs room for 2 * TANS_STREAM_ROOM(src_size) bytes.
+static __forceinline int Tans_EncodeStreamsCore(uint8_t *dst, const uint8_t *src, int src_size,
+                                                const TansEncoder *te, uint8_t *tmp)
+{
+    int L_bits = te->L_bits;
+    uint32_t L = 1 << L_bits;
+    int m = src_size - 5;
+    uint32_t x0 = src[m] + L, x1 = src[m + 1] + L, x2 = src[m + 2] + L;
+    uint32_t x3 = src[m + 3] + L, x4 = src[m + 4] + L;
+    RevWriter f, b;
+
+    RevWriter_Init(&f, tmp + TANS_STREAM_ROOM(src_size) - 8);
+    RevWriter_Init(&b, tmp + 2 * TANS_STREAM_ROOM(src_size) - 8);
+
+    // Puts the low bits of the state before symbol i in front of its stream,
+    // as many as the decoder's state takes
+#define TANS_ENCODE(w, x, i)                                        \
+    {                                                               \
+        const TansEncSym *e = &te->sym[src[i]];                     \
+        uint32_t nb = (x + e->delta_bits) >> 16;                    \
+        RevWriter_Add(&w, x & ((1 << nb) - 1), nb);                 \
+        x = te->next_state[e->next + (x >> nb)];                    \
+    }
+
+    // The last block of ten symbols may be partial
+    int i = m - m % 10;
+    int n = m - i;
+    if (n > 5)
+    {
+        switch (n - 5)
+        {
+            case 4: TANS_ENCODE(b, x3, i + 8);  // fall through
+            case 3: TANS_ENCODE(b, x2, i + 7);  // fall through
+            case 2: TANS_ENCODE(b, x1, i + 6);  // fall through
+            case 1: TANS_ENCODE(b, x0, i + 5);
+        }
+        n = 5;
+    }
+    switch (n)
+    {
+        case 5: TANS_ENCODE(f, x4, i + 4);  // fall through
+        case 4: TANS_ENCODE(f, x3, i + 3);  // fall through
+        case 3: TANS_ENCODE(f, x2, i + 2);  // fall through
+        case 2: TANS_ENCODE(f, x1, i + 1);  // fall through
+        case 1: TANS_ENCODE(f, x0, i);
+    }
+    RevWriter_Spill(&f);
+    RevWriter_Spill(&b);
+
+    // Five codes of up to 11 bits per stream between stores
+    while ((i -= 10) >= 0)
+    {
+        TANS_ENCODE(b, x4, i + 9);
+        TANS_ENCODE(b, x3, i + 8);
+        TANS_ENCODE(b, x2, i + 7);
+        TANS_ENCODE(b, x1, i + 6);
+        TANS_ENCODE(b, x0, i + 5);
+        RevWriter_Spill(&b);
+        TANS_ENCODE(f, x4, i + 4);
+        TANS_ENCODE(f, x3, i + 3);
+        TANS_ENCODE(f, x2, i + 2);
+        TANS_ENCODE(f, x1, i + 1);
+        TANS_ENCODE(f, x0, i);
+        RevWriter_Spill(&f);
+    }
+#undef TANS_ENCODE
+
+    // The states the decoder starts in, the first read last
+    RevWriter_Add(&f, x4 - L, L_bits);
+    RevWriter_Add(&f, x2 - L, L_bits);
+    RevWriter_Add(&f, x0 - L, L_bits);
+    RevWriter_Add(&b, x3 - L, L_bits);
+    RevWriter_Add(&b, x1 - L, L_bits);
+
+    uint8_t *start_f = RevWriter_Finish(&f);
+    uint8_t *start_b = RevWriter_Finish(&b);
+    size_t size_f = f.end - start_f;
+    size_t size_b = b.end - start_b;
+    memcpy(dst, start_f, size_f);
+    CopyReversed(dst + size_f, start_b, size_b);
+    return (int)(size_f + size_b);
+}
+
+
+
+// Tans_EncodeStreamsBMI2()
+static __attribute__((target("bmi2"), flatten))
+int Tans_EncodeStreamsBMI2(uint8_t *dst, const uint8_t *src, int src_size, const TansEncoder *te, uint8_t *tmp)
+{
+    return Tans_EncodeStreamsCore(dst, src, src_size, te, tmp);
+}
+
+
+
+// Tans_EncodeStreams()
+static int Tans_EncodeStreams(uint8_t *dst, const uint8_t *src, int src_size, const TansEncoder *te, uint8_t *tmp)
+{
+    if (CpuFeatures() & kCpuFeature_BMI2)
+    {
+        return Tans_EncodeStreamsBMI2(dst, src, src_size, te, tmp);
+    }
+    return Tans_EncodeStreamsCore(dst, src, src_size, te, tmp);
+}
+
+
+
+// Tans_EncodeBytes()
+//
+// tANS codes |src| with the array header in front, with the table size that
+// gives the fewest bits. |histo| holds the counts of Huff_CountSymbols().
+// Returns the size, or -1 without touching |dst| if that wouldn't be smaller
+// than |limit|.
+int Tans_EncodeBytes(uint8_t *dst, const uint8_t *src, int src_size, const uint32_t *histo, bool long_header, int limit)
+{
+    uint8_t syms[256];
+    uint32_t weight[256];
+    uint8_t table[TANS_MAX_TABLE_SIZE];
+    double entropy = 0;
+    int n = 0;
+
+    for (int i = 0; i != 256; i++)
+    {
+        if (histo[i])
+        {
+            syms[n++] = (uint8_t)i;
+            entropy += histo[i] * log2((double)src_size / histo[i]);
+        }
+    }
+    if (n < 2 || src_size < 8 || entropy / 8 + 3 >= limit)
+    {
+        return -1;
+    }
+
+    int best_L_bits = 0;
+    double best_bits = 8.0 * limit;
+    for (int L_bits = TANS_MIN_L_BITS; L_bits <= TANS_MAX_L_BITS; L_bits++)
+    {
+        Tans_NormalizeWeights(histo, src_size, syms, n, L_bits, weight);
+        double bits = 8 * Tans_WriteTable(table, weight, syms, n, L_bits) + 2 * 8 + 3 * 8;
+        for (int i = 0; i != n; i++)
+        {
+            bits += histo[syms[i]] * (L_bits - log2((double)weight[syms[i]]));
+        }
+        if (bits < best_bits)
+        {
+            best_L_bits = L_bits;
+            best_bits = bits;
+        }
+    }
+    if (!best_L_bits)
+    {
+        return -1;
+    }
+
+    TansEncoder te;
+    Tans_NormalizeWeights(histo, src_size, syms, n, best_L_bits, weight);
+    Tans_MakeEncoder(&te, weight, syms, n, best_L_bits);
+
+    uint8_t *tmp = new uint8_t[2 * TANS_STREAM_ROOM(src_size) + TANS_MAX_TABLE_SIZE + 2 * TANS_STREAM_SIZE_BOUND(src_size)];
+    uint8_t *body = tmp + 2 * TANS_STREAM_ROOM(src_size);
+    int size = Tans_WriteTable(body, weight, syms, n, best_L_bits);
+    size += Tans_EncodeStreams(body + size, src, src_size, &te, tmp);
+
+    // The decoder starts with eight bytes of table and states
+    int total = Kraken_EntropyHeaderSize(src_size, size, long_header) + size;
+    if (size < 8 || total >= limit)
+    {
+        delete[] tmp;
+        return -1;
+    }
+    memcpy(dst + ENCODE_BYTES_MAX_HEADER, body, size);
+    delete[] tmp;
+    return Kraken_WriteEntropyHeader(dst, 1, src_size, size, long_header);
+}
+
+
+
+// Kraken_WriteStoredBytes()
+int Kraken_WriteStoredBytes(uint8_t *dst, const uint8_t *src, int src_size, bool long_header)
+{
+    uint8_t *p = dst;
+
+    if (src_size < 0x1000 && !long_header)
+    {
+        *p++ = (uint8_t)(0x80 | (src_size >> 8));
+        *p++ = (uint8_t)src_size;
+    }
+    else
+    {
+        *p++ = (uint8_t)(src_size >> 16);
+        *p++ = (uint8_t)(src_size >> 8);
+        *p++ = (uint8_t)src_size;
+    }
+    memcpy(p, src, src_size);
+    return (int)(p - dst) + src_size;
+}
+
+
+
+// Kraken_DecodeTime()
+//
+// Roughly how many microseconds Kraken_DecodeBytes() takes for an array of
+// chunk |type| that decodes to |src_size| bytes, as measured on a desktop
+// core. |units| is the table size for tANS and the number of commands for
+// RLE. The parts of a split array are counted on their own.
+static double Kraken_DecodeTime(int type, int src_size, int units)
+{
+    // Fixed, per byte and per unit costs in nanoseconds
+    static const float kDecodeTime[6][3] = {
+        { 0.0f, 0.02f, 0.0f },      // stored, often used in place
+        { 700.0f, 1.37f, 0.1f },    // tANS
+        { 750.0f, 1.21f, 0.0f },    // Huffman, three streams
+        { 50.0f, 0.02f, 3.0f },     // RLE
+        { 800.0f, 1.21f, 0.0f },    // Huffman, six streams
+        { 20.0f, 0.0f, 0.0f },      // split
+    };
+    const float *t = kDecodeTime[type];
+    return (t[0] + t[1] * src_size + t[2] * units) * 1e-3;
+}
+
+
+
+// Kraken_EstimateCost()
+//
+// The cost Kraken_EncodeBytes() can be expected to reach for an array with
+// the |total| symbol counts in |histo|, from their entropy and a rough size
+// for the Huffman code lengths.
+static double Kraken_EstimateCost(const uint32_t *histo, int total, int space_speed)
+{
+    double bits = 0;
+    int n = 0;
+
+    for (int i = 0; i != 256; i++)
+    {
+        if (histo[i])
+        {
+            bits += histo[i] * log2((double)total / histo[i]);
+            n++;
+        }
+    }
+    double coded = bits / 8 + n * 0.5 + 10 + space_speed * Kraken_DecodeTime(2, total, 0);
+    double stored = total + 3;
+    return (coded < stored) ? coded : stored;
+}
+
+
+
+// Rle_AddCommands()
+//
+// Adds the commands that copy |lits| bytes and then repeat the current byte
+// |run| times, in the order Krak_DecodeRLE() reads them and with the last
+// byte of each first. Returns the new end of |cmds|.
+static uint8_t *Rle_AddCommands(uint8_t *cmds, int lits, int run)
+{
+    // Copies of a multiple of 64 bytes
+    while (lits >= 64)
+    {
+        int k = (lits >> 6 < 0x700) ? lits >> 6 : 0x700;
+        uint32_t v = k + 0x1FF;
+        *cmds++ = (uint8_t)(v >> 8);
+        *cmds++ = (uint8_t)v;
+        lits -= k << 6;
+    }
+
+    // The rest of the copy and a run below 128, in one byte if both are short
+    int r = run & 127;
+    if (lits <= 15 && r >= 3 && r <= 15)
+    {
+        *cmds++ = (uint8_t)(r << 4 | (15 - lits));
+    }
+    else if (lits || r)
+    {
+        uint32_t v = (r << 6 | lits) + 0x1000;
+        *cmds++ = (uint8_t)(v >> 8);
+        *cmds++ = (uint8_t)v;
+    }
+
+    // Runs of a multiple of 128 bytes
+    run -= r;
+    while (run)
+    {
+        int k = (run >> 7 < 0x700) ? run >> 7 : 0x700;
+        uint32_t v = k + 0x8FF;
+        *cmds++ = (uint8_t)(v >> 8);
+        *cmds++ = (uint8_t)v;
+        run -= k << 7;
+    }
+    return cmds;
+}
+
+
+
+// Rle_RunStarts()
+//
+// A bit for each of the 16 positions from |p| where three equal bytes
+// start. Reads 18 bytes.
+static __forceinline uint32_t Rle_RunStarts(const uint8_t *p)
+{
+    __m128i a = _mm_loadu_si128((const __m128i *)p);
+    __m128i b = _mm_loadu_si128((const __m128i *)(p + 1));
+    __m128i c = _mm_loadu_si128((const __m128i *)(p + 2));
+    return _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, b), _mm_cmpeq_epi8(a, c)));
+}
+
+
+
+// Rle_CountRunBytes()
+//
+// How many positions of |src| start three equal bytes.
+static int Rle_CountRunBytes(const uint8_t *src, int src_size)
+{
+    int n = 0, i = 0;
+    for (; i + 18 <= src_size; i += 16)
+    {
+        n += __builtin_popcount(Rle_RunStarts(src + i));
+    }
+    for (; i + 2 < src_size; i++)
+    {
+        n += (src[i] == src[i + 1]) & (src[i] == src[i + 2]);
+    }
+    return n;
+}
+
+
+
+// Rle_FindRun()
+//
+// The first position from |pos| where three equal bytes start, or
+// |src_size| if there is none.
+static int Rle_FindRun(const uint8_t *src, int pos, int src_size)
+{
+    for (; pos + 18 <= src_size; pos += 16)
+    {
+        uint32_t m = Rle_RunStarts(src + pos);
+        if (m)
+        {
+            return pos + __builtin_ctz(m);
+        }
+    }
+    for (; pos + 2 < src_size; pos++)
+    {
+        if (src[pos] == src[pos + 1] && src[pos] == src[pos + 2])
+        {
+            return pos;
+        }
+    }
+    return src_size;
+}
+
+
+
+// Rle_RunEnd()
+//
+// The end of the run of the byte at |pos|.
+static int Rle_RunEnd(const uint8_t *src, int pos, int src_size)
+{
+    uint8_t b = src[pos];
+    __m128i v = _mm_set1_epi8((char)b);
+    for (; pos + 16 <= src_size; pos += 16)
+    {
+        uint32_t m = ~_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(src + pos)), v)) & 0xFFFF;
+        if (m)
+        {
+            return pos + __builtin_ctz(m);
+        }
+    }
+    while (pos < src_size && src[pos] == b)
+    {
+        pos++;
+    }
+    return pos;
+}
+
+
+
+// Rle_EncodeBytes()
+//
+// Codes |src| as the copies and runs of Krak_DecodeRLE(), with the copied
+// bytes entropy coded unless |flags| has kEncodeBytes_NoScratch. Writes it
+// with the array header and returns the size if it costs less than |*cost|,
+// which is then updated, otherwise returns -1 without touching |dst|.
+static int Rle_EncodeBytes(uint8_t *dst, const uint8_t *src, int src_size, int flags, int space_speed,
+                           double *cost)
+{
+    bool long_header = (flags & kEncodeBytes_LongHeader) != 0;
+
+    // A single run is just its byte
+    if (!memcmp(src, src + 1, src_size - 1))
+    {
+        double time = Kraken_DecodeTime(3, src_size, 0);
+        int hdr_size = Kraken_EntropyHeaderSize(src_size, 1, long_header);
+        if (hdr_size + 1 + space_speed * time >= *cost)
+        {
+            return -1;
+        }
+        dst[ENCODE_BYTES_MAX_HEADER] = src[0];
+        *cost = hdr_size + 1 + space_speed * time;
+        return Kraken_WriteEntropyHeader(dst, 3, src_size, 1, long_header);
+    }
+
+    uint8_t *tmp = new uint8_t[3 * src_size + 2 * ENCODE_BYTES_MAX_HEADER + 64];
+    uint8_t *data = tmp;
+    uint8_t *cmds = tmp + src_size;
+    uint8_t *body = cmds + src_size + 32;
+    uint8_t *d = data, *c = cmds;
+    int rle_byte = 0, num_cmds = 0;
+    int lit_start = 0;
+
+    // Runs of 3 are worth a command, but changing the byte takes two more
+    for (int pos = Rle_FindRun(src, 0, src_size); pos < src_size;)
+    {
+        int b = src[pos];
+        int end = Rle_RunEnd(src, pos, src_size);
+        if (end - pos >= ((b == rle_byte) ? 3 : 5))
+        {
+            if (b != rle_byte)
+            {
+                *c++ = 1;
+                *d++ = (uint8_t)b;
+                rle_byte = b;
+                num_cmds++;
+            }
+            memcpy(d, src + lit_start, pos - lit_start);
+            d += pos - lit_start;
+            uint8_t *c_start = c;
+            c = Rle_AddCommands(c, pos - lit_start, end - pos);
+            num_cmds += (int)(c - c_start + 1) >> 1;
+            lit_start = end;
+            if (c - cmds + (d - data) >= src_size)
+            {
+                break;
+            }
+        }
+        pos = Rle_FindRun(src, end, src_size);
+    }
+    memcpy(d, src + lit_start, src_size - lit_start);
+    d += src_size - lit_start;
+    c = Rle_AddCommands(c, src_size - lit_start, 0);
+
+    int data_size = (int)(d - data);
+    int cmds_size = (int)(c - cmds);
+    int size = -1;
+    double time = Kraken_DecodeTime(3, src_size, num_cmds);
+
+    // What the entropy coded part adds to the cost besides its size
+    double nested_time = 0;
+
+    if (data_size + cmds_size < src_size)
+    {
+        uint8_t *p = body + ENCODE_BYTES_MAX_HEADER;
+        uint32_t histo[256];
+        int n = 0;
+
+        // The copied bytes are only entropy coded when that is estimated to
+        // make the runs cost less than |*cost|
+        if (!(flags & kEncodeBytes_NoScratch) && data_size >= 32)
+        {
+            Huff_CountSymbols(data, data_size, histo);
+        }
+        if (!(flags & kEncodeBytes_NoScratch) && data_size >= 32 &&
+            Kraken_EstimateCost(histo, data_size, space_speed) + cmds_size + space_speed * time < *cost)
+        {
+            double nested_cost;
+            int nested_flags = (flags & kEncodeBytes_Fast) | kEncodeBytes_NoRle | kEncodeBytes_NoSplit;
+            n = Kraken_EncodeBytes(p, data, data_size, nested_flags, space_speed, &nested_cost);
+            nested_time = nested_cost - n;
+            if (((p[0] >> 4) & 7) == 0 || n > data_size)
+            {
+                n = 0;
+                nested_time = 0;
+            }
+        }
+
+        // Without an entropy coded part the body starts with a 0
+        if (n == 0)
+        {
+            p[0] = 0;
+            memcpy(p + 1, data, data_size);
+            n = 1 + data_size;
+        }
+        CopyReversed(p + n, cmds, cmds_size);
+        size = n + cmds_size;
+        if (size + Kraken_EntropyHeaderSize(src_size, size, long_header) + space_speed * time + nested_time >= *cost)
+        {
+            size = -1;
+        }
+    }
+    if (size >= 0)
+    {
+        size = Kraken_WriteEntropyHeader(body, 3, src_size, size, long_header);
+    }
+    if (size >= 0)
+    {
+        memcpy(dst, body, size);
+        *cost = size + space_speed * time + nested_time;
+    }
+    delete[] tmp;
+    return size;
+}
+
+
+
+// Split_MergedCost()
+//
+// The estimated cost of two neighbouring parts of |size| bytes together,
+// with the counts of the first at |histo| and of the second after them.
+static double Split_MergedCost(const uint32_t *histo, int size, int space_speed)
+{
+    uint32_t sum[256];
+    for (int i = 0; i != 256; i++)
+    {
+        sum[i] = histo[i] + histo[256 + i];
+    }
+    return Kraken_EstimateCost(sum, size, space_speed);
+}
+
+
+
+// Split_EncodeBytes()
+//
+// Codes |src| as parts with statistics of their own, which
+// Krak_DecodeRecursive() reads one after the other. The parts start out as blocks of
+// SPLIT_BLOCK_SIZE bytes, and the neighbours whose merge is estimated to
+// save the most are merged until no merge saves anything. The parts are
+// only coded if they are estimated to save a 128th over the whole array,
+// with the counts |histo|. Writes the array with its header and returns the
+// size if it costs less than |*cost|, which is then updated, otherwise
+// returns -1 without touching |dst|.
+static int Split_EncodeBytes(uint8_t *dst, const uint8_t *src, int src_size, const uint32_t *histo, int flags,
+                             int space_speed, double *cost)
+{
+    bool long_header = (flags & kEncodeBytes_LongHeader) != 0;
+    int num_parts = (src_size + SPLIT_BLOCK_SIZE - 1) / SPLIT_BLOCK_SIZE;
+    uint32_t *block_histo = new uint32_t[num_parts * 256];
+    int start[SPLIT_MAX_PARTS + 1];
+    double part_cost[SPLIT_MAX_PARTS];
+    double merged_cost[SPLIT_MAX_PARTS];
+
+    for (int i = 0; i != num_parts; i++)
+    {
+        start[i] = i * SPLIT_BLOCK_SIZE;
+    }
+    start[num_parts] = src_size;
+    for (int i = 0; i != num_parts; i++)
+    {
+        Huff_CountSymbols(src + start[i], start[i + 1] - start[i], block_histo + i * 256);
+        part_cost[i] = Kraken_EstimateCost(block_histo + i * 256, start[i + 1] - start[i], space_speed);
+    }
+
+    for (int i = 0; i + 1 < num_parts; i++)
+    {
+        merged_cost[i] = Split_MergedCost(block_histo + i * 256, start[i + 2] - start[i], space_speed);
+    }
+    while (num_parts > 1)
+    {
+        int best = -1;
+        double best_gain = 0;
+        for (int i = 0; i + 1 < num_parts; i++)
+        {
+            double gain = part_cost[i] + part_cost[i + 1] - merged_cost[i];
+            if (gain >= best_gain)
+            {
+                best = i;
+                best_gain = gain;
+            }
+        }
+        if (best < 0)
+        {
+            break;
+        }
+        for (int k = 0; k != 256; k++)
+        {
+            block_histo[best * 256 + k] += block_histo[best * 256 + 256 + k];
+        }
+        part_cost[best] = merged_cost[best];
+        num_parts--;
+        for (int i = best + 1; i != num_parts; i++)
+        {
+            memcpy(block_histo + i * 256, block_histo + i * 256 + 256, 256 * sizeof(uint32_t));
+            start[i] = start[i + 1];
+            part_cost[i] = part_cost[i + 1];
+            merged_cost[i] = merged_cost[i + 1];
+        }
+        start[num_parts] = src_size;
+        for (int i = (best > 0) ? best - 1 : 0; i <= best && i + 1 < num_parts; i++)
+        {
+            merged_cost[i] = Split_MergedCost(block_histo + i * 256, start[i + 2] - start[i], space_speed);
+        }
+    }
+    delete[] block_histo;
+
+    double whole_cost = Kraken_EstimateCost(histo, src_size, space_speed);
+    double parts_cost = 1;
+    for (int i = 0; i != num_parts; i++)
+    {
+        parts_cost += part_cost[i];
+    }
+    if (num_parts == 1 || parts_cost > whole_cost - whole_cost / 128)
+    {
+        return -1;
+    }
+
+    // The number of parts, then each part as an array of its own, coded
+    // without the slower searches
+    int part_flags = (flags & kEncodeBytes_NoScratch) | kEncodeBytes_Fast | kEncodeBytes_NoSplit;
+    uint8_t *tmp = new uint8_t[src_size + (num_parts + 1) * ENCODE_BYTES_MAX_HEADER + 1];
+    uint8_t *body = tmp + ENCODE_BYTES_MAX_HEADER;
+    uint8_t *p = body + 1;
+    double total_cost = 1 + space_speed * Kraken_DecodeTime(5, src_size, num_parts);
+    body[0] = (uint8_t)num_parts;
+    for (int i = 0; i != num_parts; i++)
+    {
+        double c;
+        p += Kraken_EncodeBytes(p, src + start[i], start[i + 1] - start[i], part_flags, space_speed, &c);
+        total_cost += c;
+    }
+
+    int size = (int)(p - body);
+    total_cost += Kraken_EntropyHeaderSize(src_size, size, long_header);
+    size = (total_cost < *cost) ? Kraken_WriteEntropyHeader(tmp, 5, src_size, size, long_header) : -1;
+    if (size >= 0)
+    {
+        memcpy(dst, tmp, size);
+        *cost = total_cost;
+    }
+    delete[] tmp;
+    return size;
+}
+
+
+
+// Kraken_EncodeBytes()
+//
+// Writes |src| as an array Kraken_DecodeBytes() reads, in the mode that
+// costs the least: stored, Huffman or tANS coded, as runs, or split in parts
+// coded on their own. The cost of a mode is its size plus its estimated
+// decode time in microseconds times |space_speed|, the bytes that a
+// microsecond is worth, so that a higher |space_speed| favours the modes
+// that decode faster. Sets |*cost| if |cost| isn't NULL. |dst| needs room
+// for |src_size| + ENCODE_BYTES_MAX_HEADER bytes and |src_size| is below
+// 0x40000.
+int Kraken_EncodeBytes(uint8_t *dst, const uint8_t *src, int src_size, int flags, int space_speed, double *cost)
+{
+    bool long_header = (flags & kEncodeBytes_LongHeader) != 0;
+    int stored_size = src_size + ((src_size < 0x1000 && !long_header) ? 2 : 3);
+    double best_cost = stored_size + space_speed * Kraken_DecodeTime(0, src_size, 0);
+    int best_size = -1;
+
+    if (src_size >= 32)
+    {
+        uint32_t histo[256];
+        Huff_CountSymbols(src, src_size, histo);
+        int n = Huff_EncodeBytes(dst, src, src_size, histo, long_header);
+        if (n >= 0)
+        {
+            double c = n + space_speed * Kraken_DecodeTime((dst[0] >> 4) & 7, src_size, 0);
+            if (c < best_cost)
+            {
+                best_cost = c;
+                best_size = n;
+            }
+        }
+
+        // The time is taken with the largest table, the size limit is what
+        // would still cost less. Fast encodes only take the time to tANS
+        // code arrays that shrink by a 64th.
+        if (!(flags & kEncodeBytes_NoScratch))
+        {
+            double time = space_speed * Kraken_DecodeTime(1, src_size, 1 << TANS_MAX_L_BITS);
+            int limit = (int)ceil(best_cost - time);
+            if (flags & kEncodeBytes_Fast)
+            {
+                int size = (best_size >= 0) ? best_size : stored_size;
+                limit = (limit < size - (size >> 6)) ? limit : size - (size >> 6);
+            }
+            int m = (limit > 0) ? Tans_EncodeBytes(dst, src, src_size, histo, long_header, limit) : -1;
+            if (m >= 0)
+            {
+                best_cost = m + time;
+                best_size = m;
+            }
+        }
+
+        // Runs are only looked for when the array holds a few
+        if (!(flags & kEncodeBytes_NoRle) && Rle_CountRunBytes(src, src_size) >= src_size >> 4)
+        {
+            int m = Rle_EncodeBytes(dst, src, src_size, flags, space_speed, &best_cost);
+            if (m >= 0)
+            {
+                best_size = m;
+            }
+        }
+
+        if (!(flags & (kEncodeBytes_NoSplit | kEncodeBytes_Fast)) && src_size >= SPLIT_MIN_SIZE)
+        {
+            int m = Split_EncodeBytes(dst, src, src_size, histo, flags, space_speed, &best_cost);
+            if (m >= 0)
+            {
+                best_size = m;
+            }
+        }
+    }
+
+    if (best_size < 0)
+    {
+        best_size = Kraken_WriteStoredBytes(dst, src, src_size, long_header);
+    }
+    if (cost)
+    {
+        *cost = best_cost;
+    }
+    return best_size;
+}
@@ -0,0 +1,121 @@
+/*
+------------------------------------------------------------------------------
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+------------------------------------------------------------------------------
+*/
+
+#include "stdafx.h"
+#include "bitwriter.h"
+
+
+// Longest Huffman code Huff_MakeLut() takes
+#define HUFF_MAX_CODE_LEN 11
+
+// Largest code length header Huff_WriteCodeLengths() writes
+#define HUFF_MAX_CODE_LENGTHS_SIZE 2048
+
+// Room for a stream of |n| symbols, with the 8 bytes HuffWriter_Spill() may
+// write past it, and for the three streams of |n| symbols
+#define HUFF_STREAM_SIZE_BOUND(n) (((n) * HUFF_MAX_CODE_LEN + 7) / 8 + 8)
+#define HUFF_STREAMS_TMP_SIZE(n) (3 * HUFF_STREAM_SIZE_BOUND(((n) + 2) / 3))
+
+// Table sizes Krak_DecodeTans() takes, L = 1 << L_bits
+#define TANS_MIN_L_BITS 8
+#define TANS_MAX_L_BITS 11
+
+// Largest table Tans_WriteTable() writes
+#define TANS_MAX_TABLE_SIZE 2048
+
+// Largest either tANS stream of |n| symbols can be, and the room to write it
+// with a RevWriter
+#define TANS_STREAM_SIZE_BOUND(n) ((((n) / 2 + 8) * TANS_MAX_L_BITS + 7) / 8)
+#define TANS_STREAM_ROOM(n) (TANS_STREAM_SIZE_BOUND(n) + 24)
+
+// Kraken_EncodeBytes() flags
+enum {
+    // Always use the 3 or 5 byte header. Needed where the decoder reads the
+    // top bit of the first byte as a flag, as for the literal and offset
+    // arrays of an LZ table and for a chunk that is only entropy coded.
+    kEncodeBytes_LongHeader = 1 << 0,
+    // Use no decoder scratch beyond the array itself: no tANS table and no
+    // entropy coded RLE commands. The Mermaid decoder gives its arrays only
+    // twice the chunk size of scratch.
+    kEncodeBytes_NoScratch = 1 << 1,
+    // Never code the array as runs, or split it in parts. Parts and the
+    // commands of runs are arrays of their own, which aren't split again.
+    kEncodeBytes_NoRle = 1 << 2,
+    kEncodeBytes_NoSplit = 1 << 3,
+    // Spend less time on the modes that are slow to encode: tANS only where
+    // it saves a lot, and no parts
+    kEncodeBytes_Fast = 1 << 4,
+};
+
+// What Kraken_EncodeBytes() takes a microsecond of decode time to be worth,
+// in bytes, unless told otherwise
+#define ENCODE_BYTES_DEFAULT_SPACE_SPEED 16
+
+// Split arrays start out as blocks of this size, at most 64 for the largest
+// array. Smaller arrays aren't split.
+#define SPLIT_BLOCK_SIZE 0x1000
+#define SPLIT_MAX_PARTS 64
+#define SPLIT_MIN_SIZE (4 * SPLIT_BLOCK_SIZE)
+
+// Largest array header Kraken_EncodeBytes() writes. The output never needs
+// more than the input size plus this.
+#define ENCODE_BYTES_MAX_HEADER 5
+
+
+// A Huffman code, |codelen| is 0 for unused symbols
+struct HuffCode {
+    uint8_t codelen[256];
+    // codes with the first bit in the lowest bit, as written by HuffWriter
+    uint16_t code[256];
+    int num_symbols;
+};
+
+
+
+// How Tans_EncodeStreams() codes a symbol of weight f from an encoder state
+// X in [L, 2L), the decoder state plus L. The low bits of X go out, as many
+// as (X + |delta_bits|) >> 16, which leaves X >> bits in [f, 2f); entry
+// |next| + (X >> bits) of |next_state| is the slot that becomes the new
+// state.
+struct TansEncSym {
+    uint32_t delta_bits;
+    int next;
+};
+
+struct TansEncoder {
+    TansEncSym sym[256];
+    uint16_t next_state[1 << TANS_MAX_L_BITS];
+    int L_bits;
+};
+
+
+
+// Prototypes
+void Huff_CountSymbols(const uint8_t *src, size_t src_size, uint32_t *histo);
+void Huff_BuildCodeLengths(const uint32_t *histo, uint8_t *codelen, int max_codelen);
+void Huff_MakeCodes(HuffCode *hc);
+int Huff_WriteCodeLengthsOld(uint8_t *dst, const HuffCode *hc);
+int Huff_WriteCodeLengths(uint8_t *dst, const HuffCode *hc);
+int Huff_EncodeBytes(uint8_t *dst, const uint8_t *src, int src_size, const uint32_t *histo, bool long_header);
+void Tans_NormalizeWeights(const uint32_t *histo, int total, const uint8_t *syms, int n, int L_bits,
+                           uint32_t *weight);
+int Tans_WriteTable(uint8_t *dst, const uint32_t *weight, const uint8_t *syms, int n, int L_bits);
+void Tans_MakeEncoder(TansEncoder *te, const uint32_t *weight, const uint8_t *syms, int n, int L_bits);
+int Tans_EncodeBytes(uint8_t *dst, const uint8_t *src, int src_size, const uint32_t *histo, bool long_header, int limit);
+int Kraken_WriteStoredBytes(uint8_t *dst, const uint8_t *src, int src_size, bool long_header);
+int Kraken_EncodeBytes(uint8_t *dst, const uint8_t *src, int src_size, int flags, int space_speed,
+                       double *cost = NULL);
@@ -18,6 +18,8 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "huff.h"
 #include "kraken.h"
 #include "utilities.h"
+#include "matchcopy.h"
+#include "lzengine.h"
 #include "lzna.h"
 #include "bitknit.h"
 #include "mermaid.h"
@@ -605,8 +607,10 @@ int Kraken_DecodeMultiArray(const uint8_t *src, const uint8_t *src_end,
  
     if (Q & 0x8000)
     {
+        // The indexes are split in place below, so a stored array must be
+        // copied out of the source
         int size_out;
-        int n = Kraken_DecodeBytes(&interval_indexes, src, src_end, &size_out, num_indexes, false, scratch_cur, scratch_end);
+        int n = Kraken_DecodeBytes(&interval_indexes, src, src_end, &size_out, num_indexes, true, scratch_cur, scratch_end);
         if (n < 0 || size_out != num_indexes)
         {
             return -1;
@@ -680,6 +684,10 @@ int Kraken_DecodeMultiArray(const uint8_t *src, const uint8_t *src_end,
     int i;
     for (i = 0; i + 2 <= num_lens; i += 2)
     {
+        if (OOZLIN_FUZZ_SAFE && (f > src_end || b < src_org))
+        {
+            return -1;
+        }
         bits_f |= bswap_32(*(uint32_t*)f) >> (24 - bitpos_f);
         f += (bitpos_f + 7) >> 3;
 
@@ -1282,6 +1290,11 @@ bool Tans_Decode(TansDecoderParams *params)
     {
         for (;;)
         {
+            // the pointers run ahead of the consumed bits by up to 3 bytes each
+            if (OOZLIN_FUZZ_SAFE && ptr_f > ptr_b + 8)
+            {
+                return false;
+            }
             TANS_FORWARD_BITS();
             TANS_FORWARD_ROUND(state_0);
             TANS_FORWARD_ROUND(state_1);
@@ -1636,10 +1649,29 @@ int Kraken_DecodeBytes(byte **output, const byte *src, const byte *src_end,
 
 
 // CombineScaledOffsetArrays()
+//
+// offs_stream[i] = scale * offs_stream[i] - low_bits[i], four at a time. SSE2
+// has no 32-bit mullo, so the even and odd lanes are multiplied separately
+// and the low halves of the products are merged back.
 void CombineScaledOffsetArrays(int *offs_stream, size_t offs_stream_size,
                                int scale, const uint8_t *low_bits)
 {
-    for (size_t i = 0; i != offs_stream_size; i++)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i vscale = _mm_set1_epi32(scale);
+    size_t i = 0;
+
+    for (; i + 4 <= offs_stream_size; i += 4)
+    {
+        __m128i offs = _mm_loadu_si128((const __m128i *)&offs_stream[i]);
+        __m128i even = _mm_mul_epu32(offs, vscale);
+        __m128i odd = _mm_mul_epu32(_mm_srli_epi64(offs, 32), vscale);
+        __m128i prod = _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                                          _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+        __m128i low = _mm_cvtsi32_si128(*(const int32_t *)&low_bits[i]);
+        low = _mm_unpacklo_epi16(_mm_unpacklo_epi8(low, zero), zero);
+        _mm_storeu_si128((__m128i *)&offs_stream[i], _mm_sub_epi32(prod, low));
+    }
+    for (; i != offs_stream_size; i++)
     {
         offs_stream[i] = scale * offs_stream[i] - low_bits[i];
     }
@@ -1775,11 +1807,47 @@ bool Kraken_UnpackOffsets(const byte *src, const byte *src_end,
         return false;
     }
 
-    for (i = 0; i < packed_litlen_stream_size; i++)
+    // Runs of 16 lengths without a 255 escape are widened straight to 32 bit
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i three = _mm_set1_epi32(3);
+    const __m128i escape = _mm_set1_epi8((char)255);
+    for (i = 0; i + 16 <= packed_litlen_stream_size; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)&packed_litlen_stream[i]);
+        uint32_t escapes = _mm_movemask_epi8(_mm_cmpeq_epi8(v, escape));
+        if (escapes)
+        {
+            if (OOZLIN_FUZZ_SAFE && u32_len_stream_end - u32_len_stream < __builtin_popcount(escapes))
+            {
+                return false;
+            }
+            for (int j = i; j != i + 16; j++)
+            {
+                uint32_t u = packed_litlen_stream[j];
+                if (u == 255)
+                {
+                    u = *u32_len_stream++ + 255;
+                }
+                len_stream[j] = u + 3;
+            }
+            continue;
+        }
+        __m128i lo = _mm_unpacklo_epi8(v, zero);
+        __m128i hi = _mm_unpackhi_epi8(v, zero);
+        _mm_storeu_si128((__m128i *)&len_stream[i + 0], _mm_add_epi32(_mm_unpacklo_epi16(lo, zero), three));
+        _mm_storeu_si128((__m128i *)&len_stream[i + 4], _mm_add_epi32(_mm_unpackhi_epi16(lo, zero), three));
+        _mm_storeu_si128((__m128i *)&len_stream[i + 8], _mm_add_epi32(_mm_unpacklo_epi16(hi, zero), three));
+        _mm_storeu_si128((__m128i *)&len_stream[i + 12], _mm_add_epi32(_mm_unpackhi_epi16(hi, zero), three));
+    }
+    for (; i < packed_litlen_stream_size; i++)
     {
         uint32_t v = packed_litlen_stream[i];
         if (v == 255)
         {
+            if (OOZLIN_FUZZ_SAFE && u32_len_stream == u32_len_stream_end)
+            {
+                return false;
+            }
             v = *u32_len_stream++ + 255;
         }
         len_stream[i] = v + 3;
@@ -1817,6 +1885,10 @@ bool Kraken_ReadLzTable(int mode,
 
     if (offset == 0)
     {
+        if (dst_size < 8)
+        {
+            return false;  // the first 8 bytes are stored
+        }
         COPY_64(dst, src);
         dst += 8;
         src += 8;
@@ -1954,285 +2026,96 @@ bool Kraken_ReadLzTable(int mode,
 
 
 
-// Kraken_ProcessLzRuns_Type0()
-//
-// Note: may access memory out of bounds on invalid input.
-bool Kraken_ProcessLzRuns_Type0(KrakenLzTable *lzt, byte *dst, byte *dst_end, byte *dst_start)
-{
-    const byte *cmd_stream = lzt->cmd_stream;
-    const byte *cmd_stream_end = cmd_stream + lzt->cmd_stream_size;
-    const int *len_stream = lzt->len_stream;
-    const int *len_stream_end = lzt->len_stream + lzt->len_stream_size;
-    const byte *lit_stream = lzt->lit_stream;
-    const byte *lit_stream_end = lzt->lit_stream + lzt->lit_stream_size;
-    const int *offs_stream = lzt->offs_stream;
-    const int *offs_stream_end = lzt->offs_stream + lzt->offs_stream_size;
-    const byte *copyfrom;
-    uint32_t final_len;
-    int32_t offset;
-    int32_t recent_offs[7];
-    int32_t last_offset;
-
-    recent_offs[3] = -8;
-    recent_offs[4] = -8;
-    recent_offs[5] = -8;
-    last_offset = -8;
-
-    while (cmd_stream < cmd_stream_end)
-    {
-        uint32_t f = *cmd_stream++;
-        uint32_t litlen = f & 3;
-        uint32_t offs_index = f >> 6;
-        uint32_t matchlen = (f >> 2) & 0xF;
-
-        // use cmov
-        uint32_t next_long_length = *len_stream;
-        const int *next_len_stream = len_stream + 1;
-
-        len_stream = (litlen == 3) ? next_len_stream : len_stream;
-        litlen = (litlen == 3) ? next_long_length : litlen;
-        recent_offs[6] = *offs_stream;
-
-        COPY_64_ADD(dst, lit_stream, &dst[last_offset]);
-        if (litlen > 8)
-        {
-            COPY_64_ADD(dst + 8, lit_stream + 8, &dst[last_offset + 8]);
-            if (litlen > 16)
-            {
-                COPY_64_ADD(dst + 16, lit_stream + 16, &dst[last_offset + 16]);
-                if (litlen > 24)
-                {
-                    do {
-                        COPY_64_ADD(dst + 24, lit_stream + 24, &dst[last_offset + 24]);
-                        litlen -= 8;
-                        dst += 8;
-                        lit_stream += 8;
-                    } while (litlen > 24);
-                }
-            }
-        }
-        dst += litlen;
-        lit_stream += litlen;
-
-        offset = recent_offs[offs_index + 3];
-        recent_offs[offs_index + 3] = recent_offs[offs_index + 2];
-        recent_offs[offs_index + 2] = recent_offs[offs_index + 1];
-        recent_offs[offs_index + 1] = recent_offs[offs_index + 0];
-        recent_offs[3] = offset;
-        last_offset = offset;
+// Command format of Kraken for LzEngine_Process(). A command byte holds a
+// literal length code in bits 0-1, a match length in bits 2-5 and a recent
+// offset index in bits 6-7, where index 3 takes an explicit offset.
+struct KrakenLzFormat {
 
-        offs_stream = (int*)((intptr_t)offs_stream + ((offs_index + 1) & 4));
+    enum { kRecentOffsets = 3, kMatchZoneTail = 0, kExactLiterals = 1 };
 
-        if ((uintptr_t)offset < (uintptr_t)(dst_start - dst))
-        {
-            return false; // offset out of bounds
-        }
-
-        copyfrom = dst + offset;
-        if (matchlen != 15)
-        {
-            COPY_64(dst, copyfrom);
-            COPY_64(dst + 8, copyfrom + 8);
-            dst += matchlen + 2;
-        }
-        else
-        {
-            matchlen = 14 + *len_stream++; // why is the value not 16 here, the above case copies up to 16 bytes.
-            if ((uintptr_t)matchlen >(uintptr_t)(dst_end - dst))
-            {
-                return false; // copy length out of bounds
-            }
-            COPY_64(dst, copyfrom);
-            COPY_64(dst + 8, copyfrom + 8);
-            COPY_64(dst + 16, copyfrom + 16);
-            do {
-                COPY_64(dst + 24, copyfrom + 24);
-                matchlen -= 8;
-                dst += 8;
-                copyfrom += 8;
-            } while (matchlen > 24);
-            dst += matchlen;
-        }
-    }
-
-    // check for incorrect input
-    if (offs_stream != offs_stream_end || len_stream != len_stream_end)
+    static __forceinline uint32_t LiteralCode(uint32_t cmd)
     {
-        return false;
+        return cmd & 3;
     }
 
-    final_len = dst_end - dst;
-    if (final_len != lit_stream_end - lit_stream)
+    static __forceinline size_t OffsetIndex(uint32_t cmd)
     {
-        return false;
+        return cmd >> 6;
     }
 
-    if (final_len >= 8)
+    template<bool kExact>
+    static __forceinline bool CopyMatch(uint32_t cmd, byte *&dst, const byte *copyfrom, const int *&len_stream,
+                                        const int *&len_stream_end, byte *dst_end)
     {
-        do {
-            COPY_64_ADD(dst, lit_stream, &dst[last_offset]);
-            dst += 8, lit_stream += 8, final_len -= 8;
-        } while (final_len >= 8);
-    }
-    if (final_len > 0)
-    {
-        do {
-            *dst = *lit_stream++ + dst[last_offset];
-        } while (dst++, --final_len);
-    }
-    return true;
-}
-
-
-
-// Kraken_ProcessLzRuns_Type1()
-//
-// Note: may access memory out of bounds on invalid input.
-bool Kraken_ProcessLzRuns_Type1(KrakenLzTable *lzt, byte *dst, byte *dst_end, byte *dst_start)
-{
-    const byte *cmd_stream = lzt->cmd_stream; 
-    const byte *cmd_stream_end = cmd_stream + lzt->cmd_stream_size;
-    const int *len_stream = lzt->len_stream;
-    const int *len_stream_end = lzt->len_stream + lzt->len_stream_size;
-    const byte *lit_stream = lzt->lit_stream;
-    const byte *lit_stream_end = lzt->lit_stream + lzt->lit_stream_size;
-    const int *offs_stream = lzt->offs_stream;
-    const int *offs_stream_end = lzt->offs_stream + lzt->offs_stream_size;
-    const byte *copyfrom;
-    uint32_t final_len;
-    int32_t offset;
-    int32_t recent_offs[7];
-
-    recent_offs[3] = -8;
-    recent_offs[4] = -8;
-    recent_offs[5] = -8;
-
-    while (cmd_stream < cmd_stream_end)
-    {
-        uint32_t f = *cmd_stream++;
-        uint32_t litlen = f & 3;
-        uint32_t offs_index = f >> 6;
-        uint32_t matchlen = (f >> 2) & 0xF;
-  
-        // use cmov
-        uint32_t next_long_length = *len_stream;
-        const int *next_len_stream = len_stream + 1;
-
-        len_stream = (litlen == 3) ? next_len_stream : len_stream; 
-        litlen = (litlen == 3) ? next_long_length : litlen;
-        recent_offs[6] = *offs_stream;
+        uint32_t matchlen = (cmd >> 2) & 0xF;
 
-        COPY_64(dst, lit_stream);
-        if (litlen > 8)
+        if (matchlen != 15)
         {
-            COPY_64(dst + 8, lit_stream + 8);
-            if (litlen > 16)
+            if (kExact)
             {
-                COPY_64(dst + 16, lit_stream + 16);
-                if (litlen > 24)
-                {
-                    do {
-                        COPY_64(dst + 24, lit_stream + 24);
-                        litlen -= 8;
-                        dst += 8;
-                        lit_stream += 8;
-                    } while (litlen > 24);
-                }
+                return LzCopyMatchExact(dst, copyfrom, matchlen + 2, dst_end);
             }
-        }
-        dst += litlen;
-        lit_stream += litlen;
-
-        offset = recent_offs[offs_index + 3];
-        recent_offs[offs_index + 3] = recent_offs[offs_index + 2];
-        recent_offs[offs_index + 2] = recent_offs[offs_index + 1];
-        recent_offs[offs_index + 1] = recent_offs[offs_index + 0];
-        recent_offs[3] = offset;
-    
-        offs_stream = (int*)((intptr_t)offs_stream + ((offs_index + 1) & 4));
-
-        if ((uintptr_t)offset < (uintptr_t)(dst_start - dst))
-        {
-            return false; // offset out of bounds
-        }
-
-        copyfrom = dst + offset;
-        if (matchlen != 15)
-        {
             COPY_64(dst, copyfrom);
             COPY_64(dst + 8, copyfrom + 8);
             dst += matchlen + 2;
+            return true;
         }
-        else
+
+        matchlen = 14 + *len_stream++; // why is the value not 16 here, the above case copies up to 16 bytes.
+        if (kExact || (uintptr_t)matchlen > (uintptr_t)(dst_end - LZ_COPY_OVERRUN - dst))
         {
-            matchlen = 14 + *len_stream++; // why is the value not 16 here, the above case copies up to 16 bytes.
-            if ((uintptr_t)matchlen > (uintptr_t)(dst_end - dst))
-            {
-                return false; // copy length out of bounds
-            }
-            COPY_64(dst, copyfrom);
-            COPY_64(dst + 8, copyfrom + 8);
-            COPY_64(dst + 16, copyfrom + 16);
-            do {
-                COPY_64(dst + 24, copyfrom + 24);
-                matchlen -= 8;
-                dst += 8;
-                copyfrom += 8;
-            } while (matchlen > 24);
-            dst += matchlen;
+            // fails if out of bounds
+            return LzCopyMatchExact(dst, copyfrom, matchlen, dst_end);
         }
+        COPY_64(dst, copyfrom);
+        COPY_64(dst + 8, copyfrom + 8);
+        COPY_64(dst + 16, copyfrom + 16);
+        do {
+            COPY_64(dst + 24, copyfrom + 24);
+            matchlen -= 8;
+            dst += 8;
+            copyfrom += 8;
+        } while (matchlen > 24);
+        dst += matchlen;
+        return true;
     }
+};
 
-    // check for incorrect input
-    if (offs_stream != offs_stream_end || len_stream != len_stream_end)
-    {
-        return false;
-    }
 
-    final_len = dst_end - dst;
-    if (final_len != lit_stream_end - lit_stream)
-    {
-        return false;
-    }
 
-    if (final_len >= 64)
-    {
-        do {
-            COPY_64_BYTES(dst, lit_stream);
-            dst += 64, lit_stream += 64, final_len -= 64;
-        } while (final_len >= 64);
-    }
-    if (final_len >= 8)
-    {
-        do {
-            COPY_64(dst, lit_stream);
-            dst += 8, lit_stream += 8, final_len -= 8;
-        } while (final_len >= 8);
-    }
-    if (final_len > 0)
-    {
-        do {
-            *dst++ = *lit_stream++;
-        } while (--final_len);
-    }
-    return true;
+// Kraken_ProcessLz()
+//
+// Note: may access memory out of bounds on invalid input.
+template<typename Literals>
+bool Kraken_ProcessLz(KrakenLzTable *lzt, byte *dst, byte *dst_end, byte *dst_start, bool nontemporal)
+{
+    LzCommandStreams streams;
+    Literals lits(lzt->lit_stream, lzt->lit_stream + lzt->lit_stream_size);
+
+    streams.cmd_stream = lzt->cmd_stream;
+    streams.cmd_stream_end = lzt->cmd_stream + lzt->cmd_stream_size;
+    streams.len_stream = lzt->len_stream;
+    streams.len_stream_end = lzt->len_stream + lzt->len_stream_size;
+    streams.offs_stream = lzt->offs_stream;
+    streams.offs_stream_end = lzt->offs_stream + lzt->offs_stream_size;
+    return LzEngine_Process<KrakenLzFormat, LzBounds>(streams, lits, dst, dst_end, dst_start, nontemporal);
 }
 
 
 
 // Kraken_ProcessLzRuns()
-bool Kraken_ProcessLzRuns(int mode, byte *dst, int dst_size, int offset, KrakenLzTable *lztable)
+bool Kraken_ProcessLzRuns(int mode, byte *dst, int dst_size, int offset, KrakenLzTable *lztable, bool nontemporal)
 {
     byte *dst_end = dst + dst_size;
 
     if (mode == 1)
     {
-        return Kraken_ProcessLzRuns_Type1(lztable, dst + (offset == 0 ? 8 : 0), dst_end, dst - offset);
+        return Kraken_ProcessLz<LzLiteralsRaw>(lztable, dst + (offset == 0 ? 8 : 0), dst_end, dst - offset, nontemporal);
     }
 
     if (mode == 0)
     {
-        return Kraken_ProcessLzRuns_Type0(lztable, dst + (offset == 0 ? 8 : 0), dst_end, dst - offset);
+        return Kraken_ProcessLz<LzLiteralsDelta>(lztable, dst + (offset == 0 ? 8 : 0), dst_end, dst - offset, nontemporal);
     }
 
     return false;
@@ -2246,7 +2129,7 @@ bool Kraken_ProcessLzRuns(int mode, byte *dst, int dst_size, int offset, KrakenL
 // internally that are compressed separately but with a shared history.
 int Kraken_DecodeQuantum(byte *dst, byte *dst_end, byte *dst_start,
                          const byte *src, const byte *src_end,
-                         byte *scratch, byte *scratch_end)
+                         byte *scratch, byte *scratch_end, bool nontemporal)
 {
     const byte *src_in = src;
     int mode;
@@ -2299,7 +2182,7 @@ int Kraken_DecodeQuantum(byte *dst, byte *dst_end, byte *dst_start,
                 {
                     return -1;
                 }
-                if (!Kraken_ProcessLzRuns(mode, dst, dst_count, dst - dst_start, (KrakenLzTable*)scratch))
+                if (!Kraken_ProcessLzRuns(mode, dst, dst_count, dst - dst_start, (KrakenLzTable*)scratch, nontemporal))
                 {
                     return -1;
                 }
@@ -2308,6 +2191,10 @@ int Kraken_DecodeQuantum(byte *dst, byte *dst_end, byte *dst_start,
             {
                 return -1;
             }
+            else if (nontemporal && dst_count >= NONTEMPORAL_MIN_SIZE)
+            {
+                CopyNonTemporal(dst, src, dst_count);
+            }
             else
             {
                 memmove(dst, src, dst_count);
@@ -2322,21 +2209,60 @@ int Kraken_DecodeQuantum(byte *dst, byte *dst_end, byte *dst_start,
 
 
 // Kraken_CopyWholeMatch()
-void Kraken_CopyWholeMatch(byte *dst, uint32_t offset, size_t length)
+//
+// Repeats the |offset| bytes before |dst| over |length| bytes. A short period
+// is first expanded to 16 bytes, after that every step copies a whole number
+// of periods from behind, so each copy is a plain non overlapping memcpy that
+// doubles the amount of pattern available. With |nontemporal| large copies
+// bypass the cache.
+void Kraken_CopyWholeMatch(byte *dst, uint32_t offset, size_t length, bool nontemporal)
 {
-    size_t i = 0;
-    byte *src = dst - offset;
+    size_t done = 0;
+
+    if (offset < 16)
+    {
+        if (length < 16)
+        {
+            for (; done < length; done++)
+            {
+                dst[done] = dst[done - offset];
+            }
+            return;
+        }
+        CopyMatch(dst, offset, 16);
+        done = 16;
+    }
 
-    if (offset >= 8)
+    while (done < length)
     {
-        for (; i + 8 <= length; i += 8)
+        size_t dist = (done / offset + 1) * offset;
+        size_t n = Min(dist, length - done);
+        if (nontemporal && n >= NONTEMPORAL_MIN_SIZE)
+        {
+            CopyNonTemporal(dst + done, dst + done - dist, n);
+        }
+        else
         {
-            *(uint64_t*)(dst + i) = *(uint64_t*)(src + i);
+            memcpy(dst + done, dst + done - dist, n);
         }
-    } 
-    for (; i < length; i++)
+        done += n;
+    }
+}
+
+
+
+// Kraken_CopyStored()
+//
+// Copies an uncompressed quantum to the output.
+static void Kraken_CopyStored(byte *dst, const byte *src, size_t length, bool nontemporal)
+{
+    if (nontemporal && length >= NONTEMPORAL_MIN_SIZE)
+    {
+        CopyNonTemporal(dst, src, length);
+    }
+    else
     {
-        dst[i] = src[i];
+        memmove(dst, src, length);
     }
 }
 
@@ -2358,7 +2284,13 @@ bool Kraken_DecodeStep(struct KrakenDecoder *dec, byte *dst_start, int offset,
         {
             return false;
         }
+        if (dec->hdr.restart_decoder)
+        {
+            dec->restart_offset = offset;
+        }
     }
+    dst_start += dec->restart_offset;
+    offset -= dec->restart_offset;
 
     bool is_kraken_decoder = (dec->hdr.decoder_type == 6 || dec->hdr.decoder_type == 10 || dec->hdr.decoder_type == 12);
 
@@ -2371,7 +2303,7 @@ bool Kraken_DecodeStep(struct KrakenDecoder *dec, byte *dst_start, int offset,
             dec->src_used = dec->dst_used = 0;
              return true;
         }
-        memmove(dst_start + offset, src, dst_bytes_left);
+        Kraken_CopyStored(dst_start + offset, src, dst_bytes_left, dec->nontemporal);
         dec->src_used = (src - src_in) + dst_bytes_left;
         dec->dst_used = dst_bytes_left;
         return true;
@@ -2411,7 +2343,11 @@ bool Kraken_DecodeStep(struct KrakenDecoder *dec, byte *dst_start, int offset,
             {
                 return false;
             }
-            Kraken_CopyWholeMatch(dst_start + offset, qhdr.whole_match_distance, dst_bytes_left);
+            Kraken_CopyWholeMatch(dst_start + offset, qhdr.whole_match_distance, dst_bytes_left, dec->nontemporal);
+        }
+        else if (dec->nontemporal && dst_bytes_left >= NONTEMPORAL_MIN_SIZE)
+        {
+            FillNonTemporal(dst_start + offset, qhdr.checksum, dst_bytes_left);
         }
         else
         {
@@ -2430,7 +2366,7 @@ bool Kraken_DecodeStep(struct KrakenDecoder *dec, byte *dst_start, int offset,
 
     if (qhdr.compressed_size == dst_bytes_left)
     {
-        memmove(dst_start + offset, src, dst_bytes_left);
+        Kraken_CopyStored(dst_start + offset, src, dst_bytes_left, dec->nontemporal);
         dec->src_used = (src - src_in) + dst_bytes_left;
         dec->dst_used = dst_bytes_left;
         return true;
@@ -2440,7 +2376,7 @@ bool Kraken_DecodeStep(struct KrakenDecoder *dec, byte *dst_start, int offset,
     {
         n = Kraken_DecodeQuantum(dst_start + offset, dst_start + offset + dst_bytes_left,
                                  dst_start, src, src + qhdr.compressed_size,
-                                 dec->scratch, dec->scratch + dec->scratch_size);
+                                 dec->scratch, dec->scratch + dec->scratch_size, dec->nontemporal);
     }
     else if (dec->hdr.decoder_type == 5)
     {
@@ -2475,7 +2411,7 @@ bool Kraken_DecodeStep(struct KrakenDecoder *dec, byte *dst_start, int offset,
     {
         n = Leviathan_DecodeQuantum(dst_start + offset, dst_start + offset + dst_bytes_left,
                                     dst_start, src, src + qhdr.compressed_size,
-                                    dec->scratch, dec->scratch + dec->scratch_size);
+                                    dec->scratch, dec->scratch + dec->scratch_size, dec->nontemporal);
     }
     else
     {
@@ -2495,11 +2431,20 @@ bool Kraken_DecodeStep(struct KrakenDecoder *dec, byte *dst_start, int offset,
 
 
 // Kraken_Decompress()
-int Kraken_Decompress(const byte *src, size_t src_len, byte *dst, size_t dst_len)
+//
+// With |nontemporal|, output that isn't needed as match source right away is
+// written with streaming stores. Meant for outputs much larger than the cache
+// that are consumed by someone else later.
+//
+// Nothing is written past |dst| + |dst_len|, so |dst| can be the final
+// destination, such as a mapped file or a slot in a larger buffer.
+int Kraken_Decompress(const byte *src, size_t src_len, byte *dst, size_t dst_len, bool nontemporal)
 {
     KrakenDecoder *dec = Kraken_Create();
     int offset = 0;
 
+    dec->nontemporal = nontemporal;
+
     while (dst_len != 0)
     {
         if (!Kraken_DecodeStep(dec, dst, offset, dst_len, src, src_len))
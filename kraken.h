@@ -151,6 +151,15 @@ typedef struct KrakenDecoder {
     size_t scratch_size;
 
     KrakenHeader hdr;
+
+    // Output offset of the last block that restarted the decoder. It is
+    // decoded as the start of the output: its first 8 bytes are stored and
+    // no match reaches before it.
+    int restart_offset;
+
+    // Write stored/memset quanta, whole matches and long literal tails with
+    // streaming stores, for huge outputs that aren't read back soon.
+    bool nontemporal;
 } KrakenDecoder;
 
 
@@ -190,14 +199,14 @@ bool Kraken_ReadLzTable(int mode,
                         const byte *src, const byte *src_end,
                         byte *dst, int dst_size, int offset,
                         byte *scratch, byte *scratch_end, KrakenLzTable *lztable);
-bool Kraken_ProcessLzRuns_Type0(KrakenLzTable *lzt, byte *dst, byte *dst_end, byte *dst_start);
-bool Kraken_ProcessLzRuns_Type1(KrakenLzTable *lzt, byte *dst, byte *dst_end, byte *dst_start);
-bool Kraken_ProcessLzRuns(int mode, byte *dst, int dst_size, int offset, KrakenLzTable *lztable);
+template<typename Literals>
+bool Kraken_ProcessLz(KrakenLzTable *lzt, byte *dst, byte *dst_end, byte *dst_start, bool nontemporal);
+bool Kraken_ProcessLzRuns(int mode, byte *dst, int dst_size, int offset, KrakenLzTable *lztable, bool nontemporal = false);
 int Kraken_DecodeQuantum(byte *dst, byte *dst_end, byte *dst_start,
                          const byte *src, const byte *src_end,
-                         byte *scratch, byte *scratch_end);
-void Kraken_CopyWholeMatch(byte *dst, uint32_t offset, size_t length);
+                         byte *scratch, byte *scratch_end, bool nontemporal = false);
+void Kraken_CopyWholeMatch(byte *dst, uint32_t offset, size_t length, bool nontemporal = false);
 bool Kraken_DecodeStep(struct KrakenDecoder *dec, byte *dst_start, int offset,
                        size_t dst_bytes_left_in, const byte *src, size_t src_bytes_left);
-int Kraken_Decompress(const byte *src, size_t src_len, byte *dst, size_t dst_len);
+int Kraken_Decompress(const byte *src, size_t src_len, byte *dst, size_t dst_len, bool nontemporal = false);
 
@@ -451,8 +451,8 @@ bool DecodeGolombRiceLengths(uint8_t *dst, size_t size, BitReader2 *br)
 
 
 
-// DecodeGolombRiceBits()
-bool DecodeGolombRiceBits(uint8_t *dst, uint size, uint bitcount, BitReader2 *br)
+// DecodeGolombRiceBitsTable()
+static bool DecodeGolombRiceBitsTable(uint8_t *dst, uint size, uint bitcount, BitReader2 *br)
 {
     if (bitcount == 0)
     {
@@ -525,4 +525,60 @@ bool DecodeGolombRiceBits(uint8_t *dst, uint size, uint bitcount, BitReader2 *br
 
 
 
+// DecodeGolombRiceBitsBMI2()
+//
+// Spreads the bits of 8 symbols into the 8 bytes of a uint64_t with a single
+// pdep per step.
+static __attribute__((target("bmi2")))
+bool DecodeGolombRiceBitsBMI2(uint8_t *dst, uint size, uint bitcount, BitReader2 *br)
+{
+    static const uint64_t kSpreadMask[4] = {
+        0, 0x0101010101010101ull, 0x0303030303030303ull, 0x0707070707070707ull
+    };
+
+    if (bitcount == 0)
+    {
+        return true;
+    }
+    uint8_t *dst_end = dst + size;
+    const uint8_t *p = br->p;
+    int bitpos = br->bitpos;
+
+    uint bits_required = bitpos + bitcount * size;
+    uint bytes_required = (bits_required + 7) >> 3;
+    if (bytes_required > br->p_end - p)
+    {
+        return false;
+    }
 
+    br->p = p + (bits_required >> 3);
+    br->bitpos = bits_required & 7;
+
+    uint64_t bak = *(uint64_t*)dst_end;
+
+    assert(bitcount <= 3);
+    uint64_t spread = kSpreadMask[bitcount];
+    uint shift = 32 - bitcount * 8 - bitpos;
+    uint32_t bits_mask = (1u << (bitcount * 8)) - 1;
+    do {
+        uint64_t bits = (bswap_32(*(uint32_t*)p) >> shift) & bits_mask;
+        p += bitcount;
+        *(uint64_t*)dst = (*(uint64_t*)dst << bitcount) + bswap_64(_pdep_u64(bits, spread));
+        dst += 8;
+    } while (dst < dst_end);
+
+    *(uint64_t*)dst_end = bak;
+    return true;
+}
+
+
+
+// DecodeGolombRiceBits()
+bool DecodeGolombRiceBits(uint8_t *dst, uint size, uint bitcount, BitReader2 *br)
+{
+    if (CpuFeatures() & kCpuFeature_BMI2)
+    {
+        return DecodeGolombRiceBitsBMI2(dst, size, bitcount, br);
+    }
+    return DecodeGolombRiceBitsTable(dst, size, bitcount, br);
+}
@@ -0,0 +1,620 @@
+/*
+------------------------------------------------------------------------------
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+------------------------------------------------------------------------------
+*/
+
+#include "kraken_enc.h"
+#include "entropy_enc.h"
+#include "matchfinder.h"
+#include "mermaid_enc.h"
+#include "leviathan_enc.h"
+#include "utilities.h"
+#include "kraken.h"
+
+
+// Kraken offsets are at least 8
+#define KRAKEN_MIN_OFFSET 8
+
+
+// Match finder and parser settings of a compression level
+struct KrakenLevelParams {
+    int finder;
+    int hash_bits;
+    int window_bits;
+    int max_chain;
+    int nice_len;
+
+    // How many times in a row a match may be given up for a better one at
+    // the next position
+    int lazy;
+
+    // Step faster over data without matches
+    bool skip;
+};
+
+
+static const KrakenLevelParams kKrakenLevels[9] = {
+    { kMatchFinder_Hash,  16, 19,   1,  32, 0, true },
+    { kMatchFinder_Hash,  17, 20,   2,  32, 0, true },
+    { kMatchFinder_Hash,  17, 21,   4,  48, 1, false },
+    { kMatchFinder_Chain, 18, 22,   8,  64, 1, false },
+    { kMatchFinder_Chain, 18, 22,  12,  96, 1, false },
+    { kMatchFinder_Chain, 19, 23,  16, 128, 2, false },
+    { kMatchFinder_Tree,  20, 23,   8, 128, 2, false },
+    { kMatchFinder_Tree,  20, 24,  16, 192, 2, false },
+    { kMatchFinder_Tree,  20, 24,  48, 512, 2, false },
+};
+
+
+// A match candidate
+struct KrakenMatch {
+    size_t len;
+    uint32_t dist;
+    int score;
+};
+
+
+// Encoder state. The arrays hold one chunk the way Kraken_ReadLzTable()
+// reads it, before entropy coding.
+struct KrakenEncoder {
+    const uint8_t *src;
+    size_t src_size;
+    const KrakenLevelParams *params;
+    MatchFinder mf;
+
+    // How Kraken_EncodeBytes() codes the arrays: the bytes a microsecond of
+    // decode time is worth, and kEncodeBytes_Fast at the lower levels
+    int space_speed;
+    int entropy_flags;
+
+    // Literals, as is and as the difference to the byte at the last offset
+    uint8_t *lits;
+    uint8_t *delta_lits;
+    int lits_size;
+
+    uint8_t *cmds;
+    int cmds_size;
+
+    // Explicit offsets, with the code of each in |packed_offs|
+    uint32_t *offs;
+    uint8_t *packed_offs;
+    int offs_size;
+
+    // Lengths that don't fit in a command, 255 in |packed_lens| takes the
+    // next entry of |long_lens|
+    uint8_t *packed_lens;
+    int lens_size;
+    uint32_t *long_lens;
+    int long_lens_size;
+
+    // Recent offsets, most recent first
+    uint32_t recent[3];
+
+    // The output of one chunk, and room for arrays that are tried on the side
+    uint8_t *lz_buf;
+    uint8_t *tmp_buf;
+};
+
+
+
+// Kraken_CompressBound()
+size_t Kraken_CompressBound(size_t src_size)
+{
+    return src_size + (src_size / KRAKEN_QUANTUM_SIZE + 1) * KRAKEN_COMPRESS_QUANTUM_OVERHEAD;
+}
+
+
+
+// Kraken_HasEncoder()
+//
+// Whether Kraken_Compress() supports |compressor|.
+bool Kraken_HasEncoder(int compressor)
+{
+    return compressor == kCompressor_Kraken || compressor == kCompressor_Mermaid ||
+           compressor == kCompressor_Selkie || compressor == kCompressor_Leviathan;
+}
+
+
+
+// Kraken_DistanceCode()
+//
+// The packed offset byte for |dist|, as BitReader_ReadDistance() reads it.
+uint8_t Kraken_DistanceCode(uint32_t dist)
+{
+    if (dist < (1 << 23) - 248)
+    {
+        uint32_t t = dist + 248;
+        int n = 31 - CountLeadingZeros(t) - 4;
+        return (uint8_t)(((n - 4) << 4) | (t & 0xF));
+    }
+    int n = 31 - CountLeadingZeros((dist - 8322816) >> 12);
+    return (uint8_t)(0xF0 + n - 4);
+}
+
+
+
+// Kraken_WriteDistanceBits()
+//
+// The extra bits of |dist| after its packed offset byte.
+static void Kraken_WriteDistanceBits(BitWriter *bw, uint32_t dist)
+{
+    if (dist < (1 << 23) - 248)
+    {
+        uint32_t t = dist + 248;
+        int n = 31 - CountLeadingZeros(t) - 4;
+        BitWriter_Write(bw, (t >> 4) & ((1 << n) - 1), n);
+    }
+    else
+    {
+        uint32_t t = dist - 8322816;
+        int n = 31 - CountLeadingZeros(t >> 12);
+        BitWriter_Write(bw, (t >> 12) & ((1 << n) - 1), n);
+        BitWriter_Write(bw, t & 0xFFF, 12);
+    }
+}
+
+
+
+// Kraken_WriteLzBits()
+//
+// Writes the extra bits of the explicit offsets and the long lengths, as
+// Kraken_UnpackOffsets() reads them. They alternate between a forward
+// stream and one that is read backwards from the end, which starts with the
+// number of long lengths. |tmp| holds the backward stream until it is
+// reversed in place.
+int Kraken_WriteLzBits(uint8_t *dst, uint8_t *tmp, const uint32_t *offs, int offs_size,
+                       const uint32_t *long_lens, int long_lens_size)
+{
+    BitWriter fwd;
+    BitWriter bwd;
+    BitWriter_Init(&fwd, dst);
+    BitWriter_Init(&bwd, tmp);
+
+    uint32_t count = long_lens_size + 1;
+    BitWriter_Write(&bwd, count, 2 * (32 - CountLeadingZeros(count)) - 1);
+    for (int i = 0; i != offs_size; i++)
+    {
+        Kraken_WriteDistanceBits((i & 1) ? &bwd : &fwd, offs[i]);
+    }
+    for (int i = 0; i != long_lens_size; i++)
+    {
+        uint32_t v = long_lens[i] + 64;
+        BitWriter_Write((i & 1) ? &bwd : &fwd, v, 2 * (32 - CountLeadingZeros(v)) - 7);
+    }
+    uint8_t *p = BitWriter_Flush(&fwd);
+    uint8_t *bwd_end = BitWriter_Flush(&bwd);
+    CopyReversed(p, tmp, bwd_end - tmp);
+    return (int)(p + (bwd_end - tmp) - dst);
+}
+
+
+
+// Kraken_MatchScore()
+//
+// Rough number of bits a match saves over coding its bytes as literals.
+static __forceinline int Kraken_MatchScore(size_t len, uint32_t dist, bool recent)
+{
+    return (int)len * 6 - (recent ? 6 : 8 + 32 - CountLeadingZeros(dist));
+}
+
+
+
+// Kraken_FindMatch()
+//
+// Finds the best scoring match at |pos|, at a recent offset or from the match
+// finder. A score of 0 means there is none worth taking. A recent match of
+// nice_len or more is taken without searching.
+static void Kraken_FindMatch(KrakenEncoder *enc, size_t pos, size_t end, KrakenMatch *m)
+{
+    uint32_t dist;
+    int index;
+
+    m->len = 0;
+    m->score = 0;
+    size_t len = MatchFinder_FindRecent(&enc->mf, pos, end, enc->recent, 3, &index);
+    if (len)
+    {
+        m->len = len;
+        m->dist = enc->recent[index];
+        m->score = Kraken_MatchScore(len, m->dist, true);
+        if (len >= (size_t)enc->params->nice_len)
+        {
+            return;
+        }
+    }
+
+    len = MatchFinder_FindMatch(&enc->mf, pos, end, KRAKEN_MIN_OFFSET, &dist);
+    if (len)
+    {
+        int score = Kraken_MatchScore(len, dist, false);
+        if (score > m->score)
+        {
+            m->len = len;
+            m->dist = dist;
+            m->score = score;
+        }
+    }
+}
+
+
+
+// Kraken_PushLength()
+static void Kraken_PushLength(KrakenEncoder *enc, uint32_t v)
+{
+    if (v < 255)
+    {
+        enc->packed_lens[enc->lens_size++] = (uint8_t)v;
+    }
+    else
+    {
+        enc->packed_lens[enc->lens_size++] = 255;
+        enc->long_lens[enc->long_lens_size++] = v - 255;
+    }
+}
+
+
+
+// Kraken_EmitLiterals()
+//
+// Adds |n| literals from |pos|, the delta literals relative to the last
+// match offset.
+static void Kraken_EmitLiterals(KrakenEncoder *enc, size_t pos, size_t n)
+{
+    const uint8_t *src = enc->src + pos;
+    uint8_t *lits = enc->lits + enc->lits_size;
+    uint8_t *delta_lits = enc->delta_lits + enc->lits_size;
+    uint32_t last_dist = enc->recent[0];
+
+    for (size_t i = 0; i != n; i++)
+    {
+        lits[i] = src[i];
+        delta_lits[i] = src[i] - src[i - last_dist];
+    }
+    enc->lits_size += (int)n;
+}
+
+
+
+// Kraken_EmitCommand()
+//
+// Adds |litlen| literals from |pos| followed by a match, updating the recent
+// offsets the way LzRecentOffsets does.
+static void Kraken_EmitCommand(KrakenEncoder *enc, size_t pos, size_t litlen, size_t matchlen, uint32_t dist)
+{
+    uint32_t *recent = enc->recent;
+    uint32_t lit_code = litlen < 3 ? (uint32_t)litlen : 3;
+    uint32_t len_code = matchlen - 2 < 15 ? (uint32_t)matchlen - 2 : 15;
+    uint32_t offs_index;
+
+    Kraken_EmitLiterals(enc, pos, litlen);
+    if (lit_code == 3)
+    {
+        Kraken_PushLength(enc, (uint32_t)litlen - 3);
+    }
+
+    if (dist == recent[0])
+    {
+        offs_index = 0;
+    }
+    else if (dist == recent[1])
+    {
+        offs_index = 1;
+        recent[1] = recent[0];
+    }
+    else
+    {
+        offs_index = (dist == recent[2]) ? 2 : 3;
+        recent[2] = recent[1];
+        recent[1] = recent[0];
+        if (offs_index == 3)
+        {
+            enc->offs[enc->offs_size] = dist;
+            enc->packed_offs[enc->offs_size++] = Kraken_DistanceCode(dist);
+        }
+    }
+    recent[0] = dist;
+
+    if (len_code == 15)
+    {
+        Kraken_PushLength(enc, (uint32_t)matchlen - 17);
+    }
+    enc->cmds[enc->cmds_size++] = (uint8_t)(lit_code | len_code << 2 | offs_index << 6);
+}
+
+
+
+// Kraken_ParseChunk()
+//
+// Greedy or lazy parse of the bytes from |start| to |end|, into the arrays
+// of |enc|. The recent offsets start over with each chunk.
+static void Kraken_ParseChunk(KrakenEncoder *enc, size_t start, size_t end)
+{
+    const KrakenLevelParams *params = enc->params;
+    size_t pos = start;
+    size_t lit_start = start;
+    KrakenMatch m;
+    KrakenMatch next;
+
+    enc->lits_size = 0;
+    enc->cmds_size = 0;
+    enc->offs_size = 0;
+    enc->lens_size = 0;
+    enc->long_lens_size = 0;
+    enc->recent[0] = enc->recent[1] = enc->recent[2] = KRAKEN_MIN_OFFSET;
+
+    while (pos + MATCHFINDER_MIN_MATCH <= end)
+    {
+        Kraken_FindMatch(enc, pos, end, &m);
+        if (m.score <= 0)
+        {
+            pos += params->skip ? 1 + ((pos - lit_start) >> 6) : 1;
+            continue;
+        }
+
+        // A better match one byte on is worth a literal
+        for (int i = 0; i < params->lazy && pos + MATCHFINDER_MIN_MATCH < end; i++)
+        {
+            Kraken_FindMatch(enc, pos + 1, end, &next);
+            if (next.score <= m.score + 4)
+            {
+                break;
+            }
+            m = next;
+            pos++;
+        }
+
+        Kraken_EmitCommand(enc, lit_start, pos - lit_start, m.len, m.dist);
+        pos += m.len;
+        lit_start = pos;
+    }
+    Kraken_EmitLiterals(enc, lit_start, end - lit_start);
+}
+
+
+
+// Kraken_WriteLzTable()
+//
+// Writes the arrays of the parsed chunk as Kraken_ReadLzTable() reads them.
+// |start| is the start of the chunk, the first 8 bytes of the input are
+// stored in front. Returns the size and sets the literal |mode|.
+static int Kraken_WriteLzTable(KrakenEncoder *enc, size_t start, uint8_t *dst, int *mode)
+{
+    uint8_t *p = dst;
+
+    if (start == 0)
+    {
+        memcpy(p, enc->src, 8);
+        p += 8;
+    }
+
+    double raw_cost, delta_cost;
+    int flags = enc->entropy_flags;
+    int raw_size = Kraken_EncodeBytes(p, enc->lits, enc->lits_size, flags | kEncodeBytes_LongHeader,
+                                      enc->space_speed, &raw_cost);
+    int delta_size = Kraken_EncodeBytes(enc->tmp_buf, enc->delta_lits, enc->lits_size, flags | kEncodeBytes_LongHeader,
+                                        enc->space_speed, &delta_cost);
+    if (delta_cost < raw_cost)
+    {
+        memcpy(p, enc->tmp_buf, delta_size);
+        p += delta_size;
+        *mode = 0;
+    }
+    else
+    {
+        p += raw_size;
+        *mode = 1;
+    }
+    p += Kraken_EncodeBytes(p, enc->cmds, enc->cmds_size, flags, enc->space_speed);
+    p += Kraken_EncodeBytes(p, enc->packed_offs, enc->offs_size, flags | kEncodeBytes_LongHeader, enc->space_speed);
+    p += Kraken_EncodeBytes(p, enc->packed_lens, enc->lens_size, flags, enc->space_speed);
+
+    p += Kraken_WriteLzBits(p, enc->tmp_buf, enc->offs, enc->offs_size, enc->long_lens, enc->long_lens_size);
+    return (int)(p - dst);
+}
+
+
+
+// Kraken_EncodeChunk()
+//
+// Writes the chunk from |start| to |end| with its 3 byte header.
+static int Kraken_EncodeChunk(KrakenEncoder *enc, size_t start, size_t end, uint8_t *dst)
+{
+    int size = (int)(end - start);
+    int lz_size = 0;
+    int mode = 0;
+
+    if (size >= 32)
+    {
+        Kraken_ParseChunk(enc, start == 0 ? 8 : start, end);
+        lz_size = Kraken_WriteLzTable(enc, start, enc->lz_buf, &mode);
+    }
+    return Kraken_WriteChunk(dst, enc->src + start, size, enc->lz_buf, lz_size, mode, enc->tmp_buf, true,
+                             enc->space_speed, enc->entropy_flags);
+}
+
+
+
+// Kraken_EncodeQuantum()
+static int Kraken_EncodeQuantum(void *ctx, size_t start, size_t end, uint8_t *dst)
+{
+    KrakenEncoder *enc = (KrakenEncoder *)ctx;
+    uint8_t *p = dst;
+
+    for (size_t chunk = start; chunk < end; chunk += KRAKEN_CHUNK_SIZE)
+    {
+        p += Kraken_EncodeChunk(enc, chunk, Min(chunk + KRAKEN_CHUNK_SIZE, end), p);
+    }
+    return (int)(p - dst);
+}
+
+
+
+// Kraken_WriteChunk()
+//
+// Writes a chunk of |src_size| bytes with its 3 byte header, as the LZ table
+// |lz| of |lz_size| bytes, as one entropy coded array if |entropy| or
+// stored, whichever is smallest. A |lz_size| of 0 means there is no LZ
+// table. |tmp| needs room for the entropy coded array, which is coded with
+// |space_speed| and |flags| as Kraken_EncodeBytes() takes them.
+int Kraken_WriteChunk(uint8_t *dst, const uint8_t *src, int src_size, const uint8_t *lz, int lz_size,
+                      int mode, uint8_t *tmp, bool entropy, int space_speed, int flags)
+{
+    int best_size = src_size;
+    uint32_t hdr = 0x800000 | src_size;
+    const uint8_t *best = src;
+
+    if (lz_size >= 13 && lz_size < best_size)
+    {
+        best_size = lz_size;
+        best = lz;
+        hdr = 0x800000 | mode << 19 | lz_size;
+    }
+
+    // Without the top bit of the header the chunk is a single array. A
+    // stored array would not be copied to the output, so that's left to the
+    // stored chunk.
+    if (entropy && src_size >= 32)
+    {
+        int entropy_size = Kraken_EncodeBytes(tmp, src, src_size, flags | kEncodeBytes_LongHeader, space_speed);
+        if (((tmp[0] >> 4) & 7) != 0 && entropy_size < best_size + 3)
+        {
+            memcpy(dst, tmp, entropy_size);
+            return entropy_size;
+        }
+    }
+
+    dst[0] = (uint8_t)(hdr >> 16);
+    dst[1] = (uint8_t)(hdr >> 8);
+    dst[2] = (uint8_t)hdr;
+    memcpy(dst + 3, best, best_size);
+    return 3 + best_size;
+}
+
+
+
+// Kraken_WriteBlocks()
+//
+// Writes |src| as blocks of |decoder_type|, one per 256k quantum. Each
+// quantum is a memset, the chunks |encode_quantum| writes or, if those
+// don't come out smaller, an uncompressed block.
+int Kraken_WriteBlocks(const byte *src, size_t src_size, byte *dst, int decoder_type,
+                       KrakenQuantumEncoder *encode_quantum, void *enc)
+{
+    uint8_t *p = dst;
+
+    for (size_t start = 0; start < src_size; start += KRAKEN_QUANTUM_SIZE)
+    {
+        size_t end = Min(start + KRAKEN_QUANTUM_SIZE, src_size);
+        size_t size = end - start;
+        uint8_t *q = p + 2;
+
+        // block header: restart on the first block
+        p[0] = (start == 0) ? 0x8C : 0x0C;
+        p[1] = (uint8_t)decoder_type;
+
+        if (size == 1 || !memcmp(src + start, src + start + 1, size - 1))
+        {
+            q[0] = 0x07;
+            q[1] = 0xFF;
+            q[2] = 0xFF;
+            q[3] = src[start];
+            p = q + 4;
+            continue;
+        }
+
+        size_t compressed_size = encode_quantum(enc, start, end, q + 3);
+        if (compressed_size >= size)
+        {
+            p[0] |= 0x40;
+            memcpy(q, src + start, size);
+            p = q + size;
+            continue;
+        }
+        q[0] = (uint8_t)((compressed_size - 1) >> 16);
+        q[1] = (uint8_t)((compressed_size - 1) >> 8);
+        q[2] = (uint8_t)(compressed_size - 1);
+        p = q + 3 + compressed_size;
+    }
+    return (int)(p - dst);
+}
+
+
+
+// Kraken_Compress()
+//
+// Compresses |src| with the native encoder for |compressor| at |level| 1 to
+// 9, lower and higher levels are clamped. The arrays are coded with
+// |space_speed| as Kraken_EncodeBytes() takes it, the bytes a microsecond of
+// decode time is worth. The match finders take at most |max_memory| bytes
+// together, or as much as the level asks for if 0, and search less the
+// less they get. |dst| needs Kraken_CompressBound() bytes. Returns
+// the compressed size, or -1 if there is no native encoder for |compressor|,
+// |src_size| is over KRAKEN_MAX_COMPRESS_SIZE or memory runs out.
+int Kraken_Compress(int compressor, const byte *src, size_t src_size, byte *dst, int level, int space_speed,
+                    size_t max_memory)
+{
+    KrakenEncoder enc;
+
+    if (!Kraken_HasEncoder(compressor) || src_size > KRAKEN_MAX_COMPRESS_SIZE)
+    {
+        return -1;
+    }
+
+    level = level < 1 ? 1 : level > 9 ? 9 : level;
+    if (compressor == kCompressor_Mermaid || compressor == kCompressor_Selkie)
+    {
+        return Mermaid_Compress(src, src_size, dst, level, space_speed, max_memory, compressor == kCompressor_Selkie);
+    }
+    if (compressor == kCompressor_Leviathan)
+    {
+        return Leviathan_Compress(src, src_size, dst, level, space_speed, max_memory, 0);
+    }
+
+    enc.src = src;
+    enc.src_size = src_size;
+    enc.params = &kKrakenLevels[level - 1];
+    enc.space_speed = space_speed;
+    enc.entropy_flags = (level <= 3) ? kEncodeBytes_Fast : 0;
+    if (!MatchFinder_Init(&enc.mf, src, src_size, enc.params->finder, enc.params->hash_bits,
+                          enc.params->window_bits, enc.params->max_chain, enc.params->nice_len, max_memory))
+    {
+        return -1;
+    }
+
+    // A command covers at least 2 bytes and a long length at least 3
+    enc.lits = new uint8_t[KRAKEN_CHUNK_SIZE];
+    enc.delta_lits = new uint8_t[KRAKEN_CHUNK_SIZE];
+    enc.cmds = new uint8_t[KRAKEN_CHUNK_SIZE / 2];
+    enc.offs = new uint32_t[KRAKEN_CHUNK_SIZE / MATCHFINDER_MIN_MATCH];
+    enc.packed_offs = new uint8_t[KRAKEN_CHUNK_SIZE / MATCHFINDER_MIN_MATCH];
+    enc.packed_lens = new uint8_t[KRAKEN_CHUNK_SIZE / 3 * 2];
+    enc.long_lens = new uint32_t[KRAKEN_CHUNK_SIZE / 255];
+    enc.lz_buf = new uint8_t[KRAKEN_CHUNK_SIZE * 4];
+    enc.tmp_buf = new uint8_t[KRAKEN_CHUNK_SIZE * 2];
+
+    int n = Kraken_WriteBlocks(src, src_size, dst, 6, Kraken_EncodeQuantum, &enc);
+
+    delete[] enc.lits;
+    delete[] enc.delta_lits;
+    delete[] enc.cmds;
+    delete[] enc.offs;
+    delete[] enc.packed_offs;
+    delete[] enc.packed_lens;
+    delete[] enc.long_lens;
+    delete[] enc.lz_buf;
+    delete[] enc.tmp_buf;
+    MatchFinder_Free(&enc.mf);
+    return n;
+}
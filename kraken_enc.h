@@ -0,0 +1,53 @@
+/*
+------------------------------------------------------------------------------
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+------------------------------------------------------------------------------
+*/
+
+#include "stdafx.h"
+
+
+// Kraken, Mermaid and Leviathan streams are made of 256k quanta, each split
+// into 128k chunks
+#define KRAKEN_QUANTUM_SIZE 0x40000
+#define KRAKEN_CHUNK_SIZE 0x20000
+
+// Kraken_Compress() output never exceeds the input size by more than this
+// per 256k quantum, plus the same again. A quantum that goes in an
+// uncompressed block takes 2 bytes more, but its chunks are written first.
+#define KRAKEN_COMPRESS_QUANTUM_OVERHEAD 16
+
+// Largest input the native encoders take. The compressed size is returned
+// as an int, with room left for the overhead, and the match finders keep
+// positions in 32 bits.
+#define KRAKEN_MAX_COMPRESS_SIZE 0x7F000000
+
+
+// Writes the chunks of the quantum from |start| to |end| of the input to
+// |dst|, without the quantum header, and returns their size
+typedef int KrakenQuantumEncoder(void *enc, size_t start, size_t end, uint8_t *dst);
+
+
+// Prototypes
+size_t Kraken_CompressBound(size_t src_size);
+bool Kraken_HasEncoder(int compressor);
+int Kraken_Compress(int compressor, const byte *src, size_t src_size, byte *dst, int level, int space_speed,
+                    size_t max_memory);
+uint8_t Kraken_DistanceCode(uint32_t dist);
+int Kraken_WriteLzBits(uint8_t *dst, uint8_t *tmp, const uint32_t *offs, int offs_size,
+                       const uint32_t *long_lens, int long_lens_size);
+int Kraken_WriteChunk(uint8_t *dst, const uint8_t *src, int src_size, const uint8_t *lz, int lz_size,
+                      int mode, uint8_t *tmp, bool entropy, int space_speed, int flags);
+int Kraken_WriteBlocks(const byte *src, size_t src_size, byte *dst, int decoder_type,
+                       KrakenQuantumEncoder *encode_quantum, void *enc);
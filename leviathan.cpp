@@ -18,172 +18,48 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "stdafx.h"
 #include "leviathan.h"
 #include "kraken.h"
+#include "utilities.h"
+#include "lzengine.h"
 
 
 // complex struct
-struct LeviathanModeRaw {
+struct LeviathanModeLamSub {
 
-    const uint8_t *lit_stream;
+    const uint8_t *lit_stream, *lam_lit_stream;
+    const uint8_t *lit_stream_end, *lam_lit_stream_end;
 
-    finline LeviathanModeRaw(LeviathanLzTable *lzt, uint8_t *dst_start) : lit_stream(lzt->lit_stream[0])
+    finline LeviathanModeLamSub(LeviathanLzTable *lzt, uint8_t *dst_start)
+        : lit_stream(lzt->lit_stream[0]), lam_lit_stream(lzt->lit_stream[1]),
+          lit_stream_end(lzt->lit_stream[0] + lzt->lit_stream_size[0]),
+          lam_lit_stream_end(lzt->lit_stream[1] + lzt->lit_stream_size[1])
     {
     }
 
-    finline bool CopyLiterals(uint32_t cmd, uint8_t *&dst, const int *&len_stream, uint8_t *match_zone_end, size_t last_offset)
+    // The first literal of a run comes from the lam stream
+    finline bool HasLiterals(const uint8_t *dst, size_t n)
     {
-        uint32_t litlen = (cmd >> 3) & 3;
-        // use cmov
-        uint32_t len_stream_value = *len_stream & 0xffffff;
-        const int *next_len_stream = len_stream + 1;
-        len_stream = (litlen == 3) ? next_len_stream : len_stream;
-        litlen = (litlen == 3) ? len_stream_value : litlen;
-        COPY_64(dst, lit_stream);
-        if (litlen > 8)
-        {
-            COPY_64(dst + 8, lit_stream + 8);
-            if (litlen > 16)
-            {
-                COPY_64(dst + 16, lit_stream + 16);
-                if (litlen > 24)
-                {
-                    if (litlen > match_zone_end - dst)
-                    {
-                        return false;  // out of bounds
-                    }
-                    do
-                    {
-                        COPY_64(dst + 24, lit_stream + 24);
-                        litlen -= 8, dst += 8, lit_stream += 8;
-                    } while (litlen > 24);
-                }
-            }
-        }
-        dst += litlen;
-        lit_stream += litlen;
-        return true;
+        return n == 0 || (lam_lit_stream < lam_lit_stream_end && n - 1 <= (size_t)(lit_stream_end - lit_stream));
     }
 
-    finline void CopyFinalLiterals(uint32_t final_len, uint8_t *&dst, size_t last_offset)
+    template<typename Bounds, bool kExact>
+    finline bool CopyLiterals(uint32_t lit_code, uint8_t *&dst, const int *&len_stream,
+                              uint8_t *match_zone_end, uint8_t *copy_end, size_t last_offset)
     {
-        if (final_len >= 64)
-        {
-            do
-            {
-                COPY_64_BYTES(dst, lit_stream);
-                dst += 64, lit_stream += 64, final_len -= 64;
-            } while (final_len >= 64);
-        }
-        if (final_len >= 8)
-        {
-            do
-            {
-                COPY_64(dst, lit_stream);
-                dst += 8, lit_stream += 8, final_len -= 8;
-            } while (final_len >= 8);
-        }
-        if (final_len > 0)
+        if (!lit_code)
         {
-            do
-            {
-                *dst++ = *lit_stream++;
-            } while (--final_len);
+            return true;
         }
-    }
-};
 
+        uint32_t litlen = LzReadLiteralLength(lit_code, len_stream);
 
-
-// complex struct
-struct LeviathanModeSub {
-
-    const uint8_t *lit_stream;
-
-    finline LeviathanModeSub(LeviathanLzTable *lzt, uint8_t *dst_start) : lit_stream(lzt->lit_stream[0])
-    {
-    }
-
-    finline bool CopyLiterals(uint32_t cmd, uint8_t *&dst, const int *&len_stream, uint8_t *match_zone_end, size_t last_offset)
-    {
-        uint32_t litlen = (cmd >> 3) & 3;
-        // use cmov
-        uint32_t len_stream_value = *len_stream & 0xffffff;
-        const int *next_len_stream = len_stream + 1;
-        len_stream = (litlen == 3) ? next_len_stream : len_stream;
-        litlen = (litlen == 3) ? len_stream_value : litlen;
-        COPY_64_ADD(dst, lit_stream, &dst[last_offset]);
-        if (litlen > 8)
-        {
-            COPY_64_ADD(dst + 8, lit_stream + 8, &dst[last_offset + 8]);
-            if (litlen > 16)
-            {
-                COPY_64_ADD(dst + 16, lit_stream + 16, &dst[last_offset + 16]);
-                if (litlen > 24)
-                {
-                    if (litlen > match_zone_end - dst)
-                    {
-                        return false;  // out of bounds
-                    }
-                    do
-                    {
-                        COPY_64_ADD(dst + 24, lit_stream + 24, &dst[last_offset + 24]);
-                        litlen -= 8, dst += 8, lit_stream += 8;
-                    } while (litlen > 24);
-                }
-            }
-        }
-        dst += litlen;
-        lit_stream += litlen;
-        return true;
-    }
-
-    finline void CopyFinalLiterals(uint32_t final_len, uint8_t *&dst, size_t last_offset)
-    {
-        if (final_len >= 8)
+        if (Bounds::kChecked && !HasLiterals(dst, litlen))
         {
-            do
-            {
-                COPY_64_ADD(dst, lit_stream, &dst[last_offset]);
-                dst += 8, lit_stream += 8, final_len -= 8;
-            } while (final_len >= 8);
+            return false;
         }
-        if (final_len > 0)
+        if (kExact && litlen > match_zone_end - dst)
         {
-            do
-            {
-                *dst = *lit_stream++ + dst[last_offset];
-            } while (dst++, --final_len);
+            return false;  // out of bounds, with the lam literal
         }
-    }
-};
-
-
-
-// complex struct
-struct LeviathanModeLamSub {
-
-    const uint8_t *lit_stream, *lam_lit_stream;
-
-    finline LeviathanModeLamSub(LeviathanLzTable *lzt, uint8_t *dst_start)
-        : lit_stream(lzt->lit_stream[0]), lam_lit_stream(lzt->lit_stream[1])
-    {
-    }
-
-    finline bool CopyLiterals(uint32_t cmd, uint8_t *&dst, const int *&len_stream, uint8_t *match_zone_end, size_t last_offset)
-    {
-        uint32_t lit_cmd = cmd & 0x18;
-        if (!lit_cmd)
-        {
-            return true;
-        }
-
-        uint32_t litlen = lit_cmd >> 3;
-
-        // use cmov
-        uint32_t len_stream_value = *len_stream & 0xffffff;
-        const int *next_len_stream = len_stream + 1;
-        len_stream = (litlen == 3) ? next_len_stream : len_stream;
-        litlen = (litlen == 3) ? len_stream_value : litlen;
-
         if (litlen-- == 0)
         {
             return false; // lamsub mode requires one literal
@@ -191,52 +67,33 @@ struct LeviathanModeLamSub {
 
         dst[0] = *lam_lit_stream++ + dst[last_offset], dst++;
 
-        COPY_64_ADD(dst, lit_stream, &dst[last_offset]);
-        if (litlen > 8)
+        if (kExact || (litlen > 24 && litlen > copy_end - dst))
         {
-            COPY_64_ADD(dst + 8, lit_stream + 8, &dst[last_offset + 8]);
-            if (litlen > 16)
+            if (litlen > match_zone_end - dst)
             {
-                COPY_64_ADD(dst + 16, lit_stream + 16, &dst[last_offset + 16]);
-                if (litlen > 24)
-                {
-                    if (litlen > match_zone_end - dst)
-                    {
-                        return false;  // out of bounds
-                    }
-                    do
-                    {
-                        COPY_64_ADD(dst + 24, lit_stream + 24, &dst[last_offset + 24]);
-                        litlen -= 8, dst += 8, lit_stream += 8;
-                    } while (litlen > 24);
-                }
+                return false;  // out of bounds
             }
+            LzAddLiteralsExact(dst, lit_stream, last_offset, litlen);
+        }
+        else
+        {
+            LzAddLiterals(dst, lit_stream, last_offset, litlen);
         }
         dst += litlen;
         lit_stream += litlen;
         return true;
     }
 
-    finline void CopyFinalLiterals(uint32_t final_len, uint8_t *&dst, size_t last_offset)
+    template<typename Bounds>
+    finline bool CopyFinalLiterals(size_t final_len, uint8_t *&dst, size_t last_offset, bool nontemporal)
     {
         dst[0] = *lam_lit_stream++ + dst[last_offset], dst++;
         final_len -= 1;
 
-        if (final_len >= 8)
-        {
-            do
-            {
-                COPY_64_ADD(dst, lit_stream, &dst[last_offset]);
-                dst += 8, lit_stream += 8, final_len -= 8;
-            } while (final_len >= 8);
-        }
-        if (final_len > 0)
-        {
-            do
-            {
-                *dst = *lit_stream++ + dst[last_offset];
-            } while (dst++, --final_len);
-        }
+        LzAddLiteralsExact(dst, lit_stream, last_offset, final_len);
+        dst += final_len;
+        lit_stream += final_len;
+        return true;
     }
 };
 
@@ -247,36 +104,99 @@ struct LeviathanModeSubAnd3 {
 
     enum { NUM = 4, MASK = NUM - 1};
     const uint8_t *lit_stream[NUM];
+    const uint8_t *lit_stream_end[NUM];
 
     finline LeviathanModeSubAnd3(LeviathanLzTable *lzt, uint8_t *dst_start)
     {
         for (size_t i = 0; i != NUM; i++)
         {
-            lit_stream[i] = lzt->lit_stream[(-(intptr_t)dst_start + i) & MASK];
+            size_t k = (-(intptr_t)dst_start + i) & MASK;
+            lit_stream[i] = lzt->lit_stream[k];
+            lit_stream_end[i] = lzt->lit_stream[k] + lzt->lit_stream_size[k];
+        }
+    }
+
+    // Literal i of a run comes from the stream of dst + i
+    finline bool HasLiterals(const uint8_t *dst, size_t n)
+    {
+        for (size_t i = 0; i != NUM && i < n; i++)
+        {
+            size_t k = ((uintptr_t)dst + i) & MASK;
+            if ((n - i + MASK) / NUM > (size_t)(lit_stream_end[k] - lit_stream[k]))
+            {
+                return false;
+            }
         }
+        return true;
     }
-    finline bool CopyLiterals(uint32_t cmd, uint8_t *&dst, const int *&len_stream, uint8_t *match_zone_end, size_t last_offset)
+
+    // Decodes whole 16 byte blocks of a run and returns the bytes left. Every
+    // block takes 4 bytes from each stream, so all streams advance alike and
+    // a block is their bytes interleaved, starting at the stream of |dst|.
+    finline uint32_t AddLiterals16(uint8_t *&dst, uint32_t litlen, size_t last_offset)
     {
-        uint32_t lit_cmd = cmd & 0x18;
+        const uint8_t *s0 = lit_stream[((uintptr_t)dst + 0) & MASK];
+        const uint8_t *s1 = lit_stream[((uintptr_t)dst + 1) & MASK];
+        const uint8_t *s2 = lit_stream[((uintptr_t)dst + 2) & MASK];
+        const uint8_t *s3 = lit_stream[((uintptr_t)dst + 3) & MASK];
+        size_t n = 0;
+
+        do
+        {
+            __m128i t01 = _mm_unpacklo_epi8(_mm_cvtsi32_si128(*(const uint32_t *)(s0 + n)),
+                                            _mm_cvtsi32_si128(*(const uint32_t *)(s1 + n)));
+            __m128i t23 = _mm_unpacklo_epi8(_mm_cvtsi32_si128(*(const uint32_t *)(s2 + n)),
+                                            _mm_cvtsi32_si128(*(const uint32_t *)(s3 + n)));
+            __m128i lits = _mm_unpacklo_epi16(t01, t23);
+            _mm_storeu_si128((__m128i *)dst, _mm_add_epi8(lits, _mm_loadu_si128((const __m128i *)&dst[last_offset])));
+            dst += 16, litlen -= 16, n += 4;
+        } while (litlen >= 16);
 
-        if (lit_cmd == 0x18)
+        for (size_t i = 0; i != NUM; i++)
+        {
+            lit_stream[i] += n;
+        }
+        return litlen;
+    }
+
+    template<typename Bounds, bool kExact>
+    finline bool CopyLiterals(uint32_t lit_code, uint8_t *&dst, const int *&len_stream,
+                              uint8_t *match_zone_end, uint8_t *copy_end, size_t last_offset)
+    {
+        if (Bounds::kChecked && lit_code != 3 && !HasLiterals(dst, lit_code))
+        {
+            return false;
+        }
+        if (lit_code == 3)
         {
             uint32_t litlen = *len_stream++ & 0xffffff;
             if (litlen > match_zone_end - dst)
             {
                 return false;
             }
+            if (Bounds::kChecked && !HasLiterals(dst, litlen))
+            {
+                return false;
+            }
+            if (litlen >= 16 && last_offset <= (size_t)-16)
+            {
+                litlen = AddLiterals16(dst, litlen, last_offset);
+            }
             while (litlen)
             {
                 *dst = *lit_stream[(uintptr_t)dst & MASK]++ + dst[last_offset];
                 dst++, litlen--;
             }
         }
-        else if (lit_cmd)
+        else if (lit_code)
         {
+            if (kExact && lit_code > match_zone_end - dst)
+            {
+                return false;  // out of bounds
+            }
             *dst = *lit_stream[(uintptr_t)dst & MASK]++ + dst[last_offset];
             dst++;
-            if (lit_cmd == 0x10)
+            if (lit_code == 2)
             {
                 *dst = *lit_stream[(uintptr_t)dst & MASK]++ + dst[last_offset];
                 dst++;
@@ -285,8 +205,13 @@ struct LeviathanModeSubAnd3 {
         return true;
     }
 
-    finline void CopyFinalLiterals(uint32_t final_len, uint8_t *&dst, size_t last_offset)
+    template<typename Bounds>
+    finline bool CopyFinalLiterals(size_t final_len, uint8_t *&dst, size_t last_offset, bool nontemporal)
     {
+        if (final_len >= 16 && last_offset <= (size_t)-16)
+        {
+            final_len = AddLiterals16(dst, final_len, last_offset);
+        }
         if (final_len > 0)
         {
             do
@@ -294,6 +219,7 @@ struct LeviathanModeSubAnd3 {
                 *dst = *lit_stream[(uintptr_t)dst & MASK]++ + dst[last_offset];
             } while (dst++, --final_len);
         }
+        return true;
     }
 };
 
@@ -304,36 +230,66 @@ struct LeviathanModeSubAndF {
 
     enum { NUM = 16, MASK = NUM - 1};
     const uint8_t *lit_stream[NUM];
+    const uint8_t *lit_stream_end[NUM];
 
     finline LeviathanModeSubAndF(LeviathanLzTable *lzt, uint8_t *dst_start)
     {
         for(size_t i = 0; i != NUM; i++)
         {
-            lit_stream[i] = lzt->lit_stream[(-(intptr_t)dst_start + i) & MASK];
+            size_t k = (-(intptr_t)dst_start + i) & MASK;
+            lit_stream[i] = lzt->lit_stream[k];
+            lit_stream_end[i] = lzt->lit_stream[k] + lzt->lit_stream_size[k];
         }
     }
-    finline bool CopyLiterals(uint32_t cmd, uint8_t *&dst, const int *&len_stream, uint8_t *match_zone_end, size_t last_offset)
+
+    // Literal i of a run comes from the stream of dst + i
+    finline bool HasLiterals(const uint8_t *dst, size_t n)
     {
-        uint32_t lit_cmd = cmd & 0x18;
+        for (size_t i = 0; i != NUM && i < n; i++)
+        {
+            size_t k = ((uintptr_t)dst + i) & MASK;
+            if ((n - i + MASK) / NUM > (size_t)(lit_stream_end[k] - lit_stream[k]))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
 
-        if (lit_cmd == 0x18)
+    template<typename Bounds, bool kExact>
+    finline bool CopyLiterals(uint32_t lit_code, uint8_t *&dst, const int *&len_stream,
+                              uint8_t *match_zone_end, uint8_t *copy_end, size_t last_offset)
+    {
+        if (Bounds::kChecked && lit_code != 3 && !HasLiterals(dst, lit_code))
+        {
+            return false;
+        }
+        if (lit_code == 3)
         {
             uint32_t litlen = *len_stream++ & 0xffffff;
             if (litlen > match_zone_end - dst)
             {
                 return false;
             }
+            if (Bounds::kChecked && !HasLiterals(dst, litlen))
+            {
+                return false;
+            }
             while (litlen)
             {
                 *dst = *lit_stream[(uintptr_t)dst & MASK]++ + dst[last_offset];
                 dst++, litlen--;
             }
         }
-        else if (lit_cmd)
+        else if (lit_code)
         {
+            if (kExact && lit_code > match_zone_end - dst)
+            {
+                return false;  // out of bounds
+            }
             *dst = *lit_stream[(uintptr_t)dst & MASK]++ + dst[last_offset];
             dst++;
-            if (lit_cmd == 0x10) {
+            if (lit_code == 2) {
                 *dst = *lit_stream[(uintptr_t)dst & MASK]++ + dst[last_offset];
                 dst++;
             }
@@ -341,7 +297,8 @@ struct LeviathanModeSubAndF {
         return true;
     }
 
-    finline void CopyFinalLiterals(uint32_t final_len, uint8_t *&dst, size_t last_offset)
+    template<typename Bounds>
+    finline bool CopyFinalLiterals(size_t final_len, uint8_t *&dst, size_t last_offset, bool nontemporal)
     {
         if (final_len > 0)
         {
@@ -350,6 +307,7 @@ struct LeviathanModeSubAndF {
                 *dst = *lit_stream[(uintptr_t)dst & MASK]++ + dst[last_offset];
             } while (dst++, --final_len);
         }
+        return true;
     }
 };
 
@@ -359,6 +317,7 @@ struct LeviathanModeSubAndF {
 struct LeviathanModeO1 {
 
     const uint8_t *lit_streams[16];
+    const uint8_t *lit_streams_end[16];
     uint8_t next_lit[16];
 
     finline LeviathanModeO1(LeviathanLzTable *lzt, uint8_t *dst_start)
@@ -368,60 +327,143 @@ struct LeviathanModeO1 {
             uint8_t *p = lzt->lit_stream[i];
             next_lit[i] = *p;
             lit_streams[i] = p + 1;
+            // one past the stream, where the read ahead of its last literal ends
+            lit_streams_end[i] = p + lzt->lit_stream_size[i] + 1;
         }
     }
 
-    finline bool CopyLiterals(uint32_t cmd, uint8_t *&dst, const int *&len_stream, uint8_t *match_zone_end, size_t last_offset)
+    // The stream of each literal depends on the one before, so the fuzz safe
+    // build checks the streams as they are read instead
+    finline bool HasLiterals(const uint8_t *dst, size_t n)
     {
-        uint32_t lit_cmd = cmd & 0x18;
+        return true;
+    }
 
-        if (lit_cmd == 0x18)
+    template<typename Bounds>
+    finline bool ReadLiteral(uint8_t *&dst, uint &context)
+    {
+        size_t slot = context >> 4;
+        *dst++ = (context = next_lit[slot]);
+        next_lit[slot] = *lit_streams[slot]++;
+        return !Bounds::kChecked || lit_streams[slot] <= lit_streams_end[slot];
+    }
+
+    template<typename Bounds, bool kExact>
+    finline bool CopyLiterals(uint32_t lit_code, uint8_t *&dst, const int *&len_stream,
+                              uint8_t *match_zone_end, uint8_t *copy_end, size_t last_offset)
+    {
+        if (lit_code == 3)
         {
             uint32_t litlen = *len_stream++;
             if ((int32)litlen <= 0)
             {
                 return false;
             }
+            if ((Bounds::kChecked || kExact) && litlen > match_zone_end - dst)
+            {
+                return false;
+            }
             uint context = dst[-1];
             do
             {
-                size_t slot = context >> 4;
-                *dst++ = (context = next_lit[slot]);
-                next_lit[slot] = *lit_streams[slot]++;
+                if (!ReadLiteral<Bounds>(dst, context))
+                {
+                    return false;
+                }
             } while (--litlen);
         }
-        else if (lit_cmd)
+        else if (lit_code)
         {
             // either 1 or 2
+            if (kExact && lit_code > match_zone_end - dst)
+            {
+                return false;  // out of bounds
+            }
             uint context = dst[-1];
-            size_t slot = context >> 4;
-            *dst++ = (context = next_lit[slot]);
-            next_lit[slot] = *lit_streams[slot]++;
-            if (lit_cmd == 0x10)
+            if (!ReadLiteral<Bounds>(dst, context))
+            {
+                return false;
+            }
+            if (lit_code == 2 && !ReadLiteral<Bounds>(dst, context))
             {
-                slot = context >> 4;
-                *dst++ = (context = next_lit[slot]);
-                next_lit[slot] = *lit_streams[slot]++;
+                return false;
             }
         }
         return true;
     }
 
-    finline void CopyFinalLiterals(uint32_t final_len, uint8_t *&dst, size_t last_offset)
+    template<typename Bounds>
+    finline bool CopyFinalLiterals(size_t final_len, uint8_t *&dst, size_t last_offset, bool nontemporal)
     {
         uint context = dst[-1];
         while (final_len)
         {
-            size_t slot = context >> 4;
-            *dst++ = (context = next_lit[slot]);
-            next_lit[slot] = *lit_streams[slot]++;
+            if (!ReadLiteral<Bounds>(dst, context))
+            {
+                return false;
+            }
             final_len--;
         }
+        return true;
     }
 };
 
 
 
+// Leviathan_MergeMultiCmd()
+//
+// In multi command mode the command for chunk position p comes from stream
+// p & 7. The literal and match lengths are all known once the len stream is
+// unpacked, so walk the commands in decode order here and write them to
+// |out| as one linear stream. Leviathan_ProcessLz() then runs the same loop
+// as in single command mode.
+static bool Leviathan_MergeMultiCmd(LeviathanLzTable *lzt, uint32_t pos, uint8_t *out)
+{
+    const uint8_t *cmd_ptr[8];
+    const int *len_stream = lzt->len_stream;
+    const int *len_stream_end = len_stream + lzt->len_stream_size;
+
+    for (size_t i = 0; i != 8; i++)
+    {
+        cmd_ptr[i] = lzt->multi_cmd_ptr[i];
+    }
+
+    for (int i = 0; i != lzt->cmd_stream_size; i++)
+    {
+        size_t k = pos & 7;
+        if (cmd_ptr[k] >= lzt->multi_cmd_end[k])
+        {
+            return false;
+        }
+        uint32_t cmd = *cmd_ptr[k]++;
+        out[i] = cmd;
+
+        // Only the low bits of the lengths matter for the stream choice,
+        // Leviathan_ProcessLz() validates them. Written with selects since
+        // the long length flags are not predictable, on lengths read only
+        // while the len stream has any left.
+        uint32_t litlen = (cmd >> 3) & 3;
+        uint32_t matchlen = (cmd & 7) + 2;
+        ptrdiff_t lens_left = len_stream_end - len_stream;
+        if (lens_left < (litlen == 3) + (matchlen == 9))
+        {
+            return false;
+        }
+        uint32_t long_litlen = lens_left ? *len_stream : 0;
+        uint32_t long_matchlen = lens_left ? len_stream_end[-1] + 6 : 0;
+        len_stream += (litlen == 3);
+        len_stream_end -= (matchlen == 9);
+        litlen = (litlen == 3) ? long_litlen : litlen;
+        matchlen = (matchlen == 9) ? long_matchlen : matchlen;
+        pos += litlen + matchlen;
+    }
+
+    lzt->cmd_stream = out;
+    return true;
+}
+
+
+
 // Leviathan_ReadLzTable()
 bool Leviathan_ReadLzTable(int chunk_type, const byte *src, const byte *src_end,
                            byte *dst, int dst_size, int offset, byte *scratch,
@@ -445,6 +487,10 @@ bool Leviathan_ReadLzTable(int chunk_type, const byte *src, const byte *src_end,
 
     if (offset == 0)
     {
+        if (dst_size < 8)
+        {
+            return false;  // the first 8 bytes are stored
+        }
         COPY_64(dst, src);
         dst += 8;
         src += 8;
@@ -604,9 +650,10 @@ bool Leviathan_ReadLzTable(int chunk_type, const byte *src, const byte *src_end,
             lztable->multi_cmd_end[i] = lztable->multi_cmd_ptr[i] + multi_cmd_lens[i];
         }
 
+        // Room for the merged command stream
         lztable->cmd_stream = NULL;
         lztable->cmd_stream_size = decode_count;
-        scratch += decode_count;
+        scratch += 2 * decode_count;
     }
 
     if (dst_size > scratch_end - scratch)
@@ -615,204 +662,144 @@ bool Leviathan_ReadLzTable(int chunk_type, const byte *src, const byte *src_end,
     }
 
 
-    return Kraken_UnpackOffsets(src, src_end, packed_offs_stream, packed_offs_stream_extra,
-                                lztable->offs_stream_size, offs_scaling,
-                                packed_len_stream, lztable->len_stream_size,
-                                lztable->offs_stream, lztable->len_stream, 0, 0);
-}
-
-
+    if (!Kraken_UnpackOffsets(src, src_end, packed_offs_stream, packed_offs_stream_extra,
+                              lztable->offs_stream_size, offs_scaling,
+                              packed_len_stream, lztable->len_stream_size,
+                              lztable->offs_stream, lztable->len_stream, 0, 0))
+    {
+        return false;
+    }
 
-// Leviathan_ProcessLz()
-template<typename Mode, bool MultiCmd>
-bool Leviathan_ProcessLz(LeviathanLzTable *lzt, uint8_t *dst, uint8_t *dst_start,
-                         uint8_t *dst_end, uint8_t *window_base)
-{
-    const uint8_t *cmd_stream = lzt->cmd_stream;
-    const uint8_t *cmd_stream_end = cmd_stream + lzt->cmd_stream_size;
-    const int *len_stream = lzt->len_stream;
-    const int *len_stream_end = len_stream + lzt->len_stream_size;
+    if (lztable->cmd_stream == NULL)
+    {
+        return Leviathan_MergeMultiCmd(lztable, (offset == 0) ? 8 : 0, scratch - decode_count);
+    }
+    return true;
+}
 
-    const int *offs_stream = lzt->offs_stream;
-    const int *offs_stream_end = offs_stream + lzt->offs_stream_size;
-    const byte *copyfrom;
-    uint8_t *match_zone_end = (dst_end - dst_start >= 16) ? dst_end - 16 : dst_start;
 
-    int32_t recent_offs[16];
-    recent_offs[8] = recent_offs[9] = recent_offs[10] = recent_offs[11] = -8;
-    recent_offs[12] = recent_offs[13] = recent_offs[14] = -8;
 
-    size_t offset = -8;
+// Command format of Leviathan for LzEngine_Process(). A command byte holds a
+// match length in bits 0-2, a literal length code in bits 3-4 and a recent
+// offset index in bits 5-7, where index 7 takes an explicit offset. Long
+// match lengths are read from the back of the length stream.
+struct LeviathanLzFormat {
 
-    Mode mode(lzt, dst_start);
+    enum { kRecentOffsets = 7, kMatchZoneTail = 16, kExactLiterals = 0 };
 
-    uint32_t cmd_stream_left;
-    const uint8_t *multi_cmd_stream[8];
-    const uint8_t **cmd_stream_ptr;
+    static finline uint32_t LiteralCode(uint32_t cmd)
+    {
+        return (cmd >> 3) & 3;
+    }
 
-    if (MultiCmd)
+    static finline size_t OffsetIndex(uint32_t cmd)
     {
-        for (size_t i = 0; i != 8; i++)
-        {
-            multi_cmd_stream[i] = lzt->multi_cmd_ptr[(i - (uintptr_t)dst_start) & 7];
-        }
-        cmd_stream_left = lzt->cmd_stream_size;
-        cmd_stream_ptr = &multi_cmd_stream[(uintptr_t)dst & 7];
-        cmd_stream = *cmd_stream_ptr;
+        return cmd >> 5;
     }
 
-    for(;;)
+    template<bool kExact>
+    static finline bool CopyMatch(uint32_t cmd, uint8_t *&dst, const uint8_t *copyfrom, const int *&len_stream,
+                                  const int *&len_stream_end, uint8_t *dst_end)
     {
-        uint32_t cmd;
+        uint32_t matchlen = (cmd & 7) + 2;
 
-        if (!MultiCmd)
+        if (matchlen != 9)
         {
-            if (cmd_stream >= cmd_stream_end)
+            if (kExact)
             {
-                break;
+                return LzCopyMatchExact(dst, copyfrom, matchlen, dst_end);
             }
-            cmd = *cmd_stream++;
-        }
-        else
-        {
-            if (cmd_stream_left == 0)
-            {
-                break;
-            }
-            cmd_stream_left--;
-            cmd = *cmd_stream;
-            *cmd_stream_ptr = cmd_stream + 1;
-        }
-
-        uint32_t offs_index = cmd >> 5;
-        uint32_t matchlen = (cmd & 7) + 2;
-
-        recent_offs[15] = *offs_stream;
-
-        if (!mode.CopyLiterals(cmd, dst, len_stream, match_zone_end, offset))
-        {
-             return false;
+            COPY_64(dst, copyfrom);
+            dst += matchlen;
+            return true;
         }
 
-        offset = recent_offs[(size_t)offs_index + 8];
-
-        // Permute the recent offsets table
-        __m128i temp = _mm_loadu_si128((const __m128i *)&recent_offs[(size_t)offs_index + 4]);
-        _mm_storeu_si128((__m128i *)&recent_offs[(size_t)offs_index + 1], _mm_loadu_si128((const __m128i *)&recent_offs[offs_index]));
-        _mm_storeu_si128((__m128i *)&recent_offs[(size_t)offs_index + 5], temp);
-        recent_offs[8] = (int32)offset;
-        offs_stream += offs_index == 7;
-
-        if ((uintptr_t)offset < (uintptr_t)(window_base - dst))
+        if (len_stream >= len_stream_end)
         {
-             return false;  // offset out of bounds
+            return false;  // len stream empty
         }
-        copyfrom = dst + offset;
-
-        if (matchlen == 9)
+        matchlen = *--len_stream_end + 6;
+        if (kExact)
         {
-            if (len_stream >= len_stream_end)
-            {
-                return false;  // len stream empty
-            }
-            matchlen = *--len_stream_end + 6;
-            COPY_64(dst, copyfrom);
-            COPY_64(dst + 8, copyfrom + 8);
-            uint8_t *next_dst = dst + matchlen;
-            if (MultiCmd)
-            {
-                cmd_stream = *(cmd_stream_ptr = &multi_cmd_stream[(uintptr_t)next_dst & 7]);
-            }
-            if (matchlen > 16)
-            {
-                if (matchlen > (uintptr_t)(dst_end - 8 - dst))
-                {
-                    return false;  // no space in buf
-                }
-                COPY_64(dst + 16, copyfrom + 16);
-                do {
-                    COPY_64(dst + 24, copyfrom + 24);
-                    matchlen -= 8;
-                    dst += 8;
-                    copyfrom += 8;
-                } while (matchlen > 24);
-            }
-            dst = next_dst;
+            return LzCopyMatchExact(dst, copyfrom, matchlen, dst_end);
         }
-        else
+        COPY_64(dst, copyfrom);
+        COPY_64(dst + 8, copyfrom + 8);
+        uint8_t *next_dst = dst + matchlen;
+        if (matchlen > 16)
         {
-            COPY_64(dst, copyfrom);
-            dst += matchlen;
-            if (MultiCmd)
+            if ((uintptr_t)matchlen + 8 > (uintptr_t)(dst_end - dst))
             {
-                cmd_stream = *(cmd_stream_ptr = &multi_cmd_stream[(uintptr_t)dst & 7]);
+                return false;  // no space in buf
             }
-        }
+            COPY_64(dst + 16, copyfrom + 16);
+            do {
+                COPY_64(dst + 24, copyfrom + 24);
+                matchlen -= 8;
+                dst += 8;
+                copyfrom += 8;
+            } while (matchlen > 24);
+        }
+        dst = next_dst;
+        return true;
     }
+};
 
-    // check for incorrect input
-    if (offs_stream != offs_stream_end || len_stream != len_stream_end)
-    {
-        return false;
-    }
 
-    // copy final literals
-    if (dst < dst_end)
-    {
-        mode.CopyFinalLiterals(dst_end - dst, dst, offset);
-    }
-    else if (dst != dst_end)
-    {
-        return false;
-    }
-    return true;
+
+// Leviathan_ProcessLz()
+template<typename Mode>
+bool Leviathan_ProcessLz(LeviathanLzTable *lzt, Mode &mode, uint8_t *dst,
+                         uint8_t *dst_end, uint8_t *window_base, bool nontemporal)
+{
+    LzCommandStreams streams;
+
+    streams.cmd_stream = lzt->cmd_stream;
+    streams.cmd_stream_end = lzt->cmd_stream + lzt->cmd_stream_size;
+    streams.len_stream = lzt->len_stream;
+    streams.len_stream_end = lzt->len_stream + lzt->len_stream_size;
+    streams.offs_stream = lzt->offs_stream;
+    streams.offs_stream_end = lzt->offs_stream + lzt->offs_stream_size;
+    return LzEngine_Process<LeviathanLzFormat, LzBounds>(streams, mode, dst, dst_end, window_base, nontemporal);
 }
 
 
 
 // Leviathan_ProcessLzRuns()
-bool Leviathan_ProcessLzRuns(int chunk_type, byte *dst, int dst_size, int offset, LeviathanLzTable *lzt)
+bool Leviathan_ProcessLzRuns(int chunk_type, byte *dst, int dst_size, int offset, LeviathanLzTable *lzt, bool nontemporal)
 {
     uint8_t *dst_cur = dst + (offset == 0 ? 8 : 0);
     uint8_t *dst_end = dst + dst_size;
     uint8_t *dst_start = dst - offset;
+    const uint8_t *lit_stream = lzt->lit_stream[0];
+    const uint8_t *lit_stream_end = lit_stream + lzt->lit_stream_size[0];
 
-    if (lzt->cmd_stream != NULL)
-    {
-        // single cmd mode
-        switch (chunk_type) {
-        case 0:
-            return Leviathan_ProcessLz<LeviathanModeSub, false>(lzt, dst_cur, dst, dst_end, dst_start);
-        case 1:
-            return Leviathan_ProcessLz<LeviathanModeRaw, false>(lzt, dst_cur, dst, dst_end, dst_start);
-        case 2:
-            return Leviathan_ProcessLz<LeviathanModeLamSub, false>(lzt, dst_cur, dst, dst_end, dst_start);
-        case 3:
-            return Leviathan_ProcessLz<LeviathanModeSubAnd3, false>(lzt, dst_cur, dst, dst_end, dst_start);
-        case 4:
-            return Leviathan_ProcessLz<LeviathanModeO1, false>(lzt, dst_cur, dst, dst_end, dst_start);
-        case 5:
-            return Leviathan_ProcessLz<LeviathanModeSubAndF, false>(lzt, dst_cur, dst, dst_end, dst_start);
-        }
+    // multi cmd streams were merged into cmd_stream by Leviathan_ReadLzTable()
+    switch (chunk_type) {
+    case 0: {
+        LzLiteralsDelta mode(lit_stream, lit_stream_end);
+        return Leviathan_ProcessLz(lzt, mode, dst_cur, dst_end, dst_start, nontemporal);
+    }
+    case 1: {
+        LzLiteralsRaw mode(lit_stream, lit_stream_end);
+        return Leviathan_ProcessLz(lzt, mode, dst_cur, dst_end, dst_start, nontemporal);
+    }
+    case 2: {
+        LeviathanModeLamSub mode(lzt, dst);
+        return Leviathan_ProcessLz(lzt, mode, dst_cur, dst_end, dst_start, nontemporal);
+    }
+    case 3: {
+        LeviathanModeSubAnd3 mode(lzt, dst);
+        return Leviathan_ProcessLz(lzt, mode, dst_cur, dst_end, dst_start, nontemporal);
+    }
+    case 4: {
+        LeviathanModeO1 mode(lzt, dst);
+        return Leviathan_ProcessLz(lzt, mode, dst_cur, dst_end, dst_start, nontemporal);
+    }
+    case 5: {
+        LeviathanModeSubAndF mode(lzt, dst);
+        return Leviathan_ProcessLz(lzt, mode, dst_cur, dst_end, dst_start, nontemporal);
     }
-    else
-    {
-        // multi cmd mode
-        switch (chunk_type) {
-        case 0:
-            return Leviathan_ProcessLz<LeviathanModeSub, true>(lzt, dst_cur, dst, dst_end, dst_start);
-        case 1:
-            return Leviathan_ProcessLz<LeviathanModeRaw, true>(lzt, dst_cur, dst, dst_end, dst_start);
-        case 2:
-            return Leviathan_ProcessLz<LeviathanModeLamSub, true>(lzt, dst_cur, dst, dst_end, dst_start);
-        case 3:
-            return Leviathan_ProcessLz<LeviathanModeSubAnd3, true>(lzt, dst_cur, dst, dst_end, dst_start);
-        case 4:
-            return Leviathan_ProcessLz<LeviathanModeO1, true>(lzt, dst_cur, dst, dst_end, dst_start);
-        case 5:
-            return Leviathan_ProcessLz<LeviathanModeSubAndF, true>(lzt, dst_cur, dst, dst_end, dst_start);
-        }
-
     }
     return false;
 }
@@ -825,7 +812,7 @@ bool Leviathan_ProcessLzRuns(int chunk_type, byte *dst, int dst_size, int offset
 // internally that are compressed separately but with a shared history.
 int Leviathan_DecodeQuantum(byte *dst, byte *dst_end, byte *dst_start,
                             const byte *src, const byte *src_end,
-                            byte *scratch, byte *scratch_end)
+                            byte *scratch, byte *scratch_end, bool nontemporal)
 {
     const byte *src_in = src;
     int mode;
@@ -880,7 +867,7 @@ int Leviathan_DecodeQuantum(byte *dst, byte *dst_end, byte *dst_start,
                 {
                     return -1;
                 }
-                if (!Leviathan_ProcessLzRuns(mode, dst, dst_count, dst - dst_start, (LeviathanLzTable*)scratch))
+                if (!Leviathan_ProcessLzRuns(mode, dst, dst_count, dst - dst_start, (LeviathanLzTable*)scratch, nontemporal))
                 {
                     return -1;
                 }
@@ -889,6 +876,10 @@ int Leviathan_DecodeQuantum(byte *dst, byte *dst_end, byte *dst_start,
             {
                 return -1;
             }
+            else if (nontemporal && dst_count >= NONTEMPORAL_MIN_SIZE)
+            {
+                CopyNonTemporal(dst, src, dst_count);
+            }
             else
             {
                 memmove(dst, src, dst_count);
@@ -40,13 +40,13 @@ struct LeviathanLzTable {
 bool Leviathan_ReadLzTable(int chunk_type, const byte *src, const byte *src_end,
                            byte *dst, int dst_size, int offset, byte *scratch,
                            byte *scratch_end, LeviathanLzTable *lztable);
-template<typename Mode, bool MultiCmd>
-bool Leviathan_ProcessLz(LeviathanLzTable *lzt, uint8_t *dst, uint8_t *dst_start,
-                         uint8_t *dst_end, uint8_t *window_base);
-bool Leviathan_ProcessLzRuns(int chunk_type, byte *dst, int dst_size, int offset, LeviathanLzTable *lzt);
+template<typename Mode>
+bool Leviathan_ProcessLz(LeviathanLzTable *lzt, Mode &mode, uint8_t *dst,
+                         uint8_t *dst_end, uint8_t *window_base, bool nontemporal);
+bool Leviathan_ProcessLzRuns(int chunk_type, byte *dst, int dst_size, int offset, LeviathanLzTable *lzt, bool nontemporal = false);
 int Leviathan_DecodeQuantum(byte *dst, byte *dst_end, byte *dst_start,
                             const byte *src, const byte *src_end,
-                            byte *scratch, byte *scratch_end);
+                            byte *scratch, byte *scratch_end, bool nontemporal = false);
 
 
 
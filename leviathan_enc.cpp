@@ -0,0 +1,947 @@
+/*
+------------------------------------------------------------------------------
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+------------------------------------------------------------------------------
+*/
+
+#include "leviathan_enc.h"
+#include "leviathan.h"
+#include "kraken_enc.h"
+#include "entropy_enc.h"
+#include "matchfinder.h"
+#include "utilities.h"
+#include "kraken.h"
+#include <math.h>
+#include <atomic>
+#include <thread>
+
+
+// Leviathan offsets are at least 8, with 7 recent ones
+#define LEVIATHAN_MIN_OFFSET 8
+#define LEVIATHAN_RECENT_OFFSETS 7
+
+// The literals of a command end this many bytes before the end of the chunk
+// at the latest, LeviathanLzFormat::kMatchZoneTail
+#define LEVIATHAN_MATCH_ZONE_TAIL 16
+
+// Matches end this many bytes before the end of the chunk at the latest, the
+// wide copies of LeviathanLzFormat::CopyMatch() need the room
+#define LEVIATHAN_MATCH_END_TAIL 8
+
+// Match finder candidates kept per position for the parses of a chunk
+#define LEVIATHAN_MAX_MATCHES 4
+
+// The literal modes of Leviathan_ProcessLzRuns()
+enum {
+    kLeviathanLits_Sub = 0,
+    kLeviathanLits_Raw = 1,
+    kLeviathanLits_LamSub = 2,
+    kLeviathanLits_SubAnd3 = 3,
+    kLeviathanLits_O1 = 4,
+    kLeviathanLits_SubAndF = 5,
+    kLeviathanLits_Count = 6,
+};
+
+// Prices are in 1/16 bits
+#define LEVIATHAN_PRICE_SHIFT 4
+#define LEVIATHAN_INFINITE_COST 0xFFFFFFFF
+
+// The input is split into slices of this many quanta for the threads. Each
+// slice starts its match finder one window before it, so the output doesn't
+// depend on the number of threads.
+#define LEVIATHAN_SLICE_QUANTA 16
+
+// Room for the chunks of one quantum
+#define LEVIATHAN_QUANTUM_BUF_SIZE (KRAKEN_QUANTUM_SIZE + KRAKEN_COMPRESS_QUANTUM_OVERHEAD)
+
+
+// Match finder and parser settings of a compression level
+struct LeviathanLevelParams {
+    int finder;
+    int hash_bits;
+    int window_bits;
+    int max_chain;
+    int nice_len;
+
+    // Parses per chunk, each priced from the statistics of the one before
+    int passes;
+};
+
+
+static const LeviathanLevelParams kLeviathanLevels[9] = {
+    { kMatchFinder_Hash,        17, 20,   4,  32, 1 },
+    { kMatchFinder_Hash,        17, 21,   8,  48, 1 },
+    { kMatchFinder_Hash,        17, 22,  12,  64, 1 },
+    { kMatchFinder_Chain,       18, 22,  16,  96, 1 },
+    { kMatchFinder_Chain,       19, 23,  24, 128, 1 },
+    { kMatchFinder_Chain,       19, 23,  32, 128, 2 },
+    { kMatchFinder_Tree,        20, 24,  12, 192, 2 },
+    { kMatchFinder_Tree,        20, 24,  24, 256, 2 },
+    { kMatchFinder_SuffixArray, 20, 24,  48, 256, 3 },
+};
+
+
+// Estimated prices of the symbols of each array
+struct LeviathanPrices {
+    // Literals, as the difference to the byte at the last offset if |sub|
+    uint32_t lit[256];
+    bool sub;
+
+    uint32_t cmd[256];
+    uint32_t offs[256];
+    uint32_t len[256];
+};
+
+
+// A position of the parse: the cheapest way found to get there and the
+// recent offsets after it
+struct LeviathanNode {
+    uint32_t cost;
+
+    // The step that ends here, a literal if |len| is 0, else a match
+    uint32_t len;
+    uint32_t dist;
+
+    // Literals since the last match
+    uint32_t litrun;
+
+    uint32_t recent[LEVIATHAN_RECENT_OFFSETS];
+};
+
+
+// Encoder state of one thread. The arrays hold one chunk the way
+// Leviathan_ReadLzTable() reads it, before entropy coding.
+struct LeviathanEncoder {
+    const uint8_t *src;
+    size_t src_size;
+    const LeviathanLevelParams *params;
+    MatchFinder mf;
+
+    // Bytes a microsecond of decode time is worth, for Kraken_EncodeBytes()
+    int space_speed;
+    LeviathanPrices prices;
+
+    // The parse, and the match finder candidates of each position
+    LeviathanNode *nodes;
+    MatchFinderMatch *matches;
+    uint8_t *num_matches;
+
+    // Literals as is and as the difference to the byte at the last offset,
+    // with their position and whether they start a run
+    uint8_t *lits;
+    uint8_t *sub_lits;
+    uint32_t *lit_pos;
+    uint8_t *lit_first;
+    int lits_size;
+
+    uint8_t *cmds;
+    int cmds_size;
+
+    // Explicit offsets, with the code of each in |packed_offs|
+    uint32_t *offs;
+    uint8_t *packed_offs;
+    int offs_size;
+
+    // Long literal lengths in order, and long match lengths, which the
+    // decoder reads from the back of the same array
+    uint32_t *lit_lens;
+    int lit_lens_size;
+    uint32_t *match_lens;
+    int match_lens_size;
+    uint8_t *packed_lens;
+    int lens_size;
+    uint32_t *long_lens;
+    int long_lens_size;
+
+    // The output of one chunk, the literals of the best mode, and room for
+    // arrays that are tried on the side
+    uint8_t *lz_buf;
+    uint8_t *lit_buf;
+    uint8_t *split_buf;
+    uint8_t *tmp_buf;
+};
+
+
+// The work shared by the threads
+struct LeviathanCompressor {
+    const uint8_t *src;
+    size_t src_size;
+    const LeviathanLevelParams *params;
+    int space_speed;
+    size_t max_memory;
+
+    // The chunks of each quantum, LEVIATHAN_QUANTUM_BUF_SIZE bytes apart
+    uint8_t *quanta;
+    int *quantum_sizes;
+    size_t num_quanta;
+
+    std::atomic<size_t> next_slice;
+    std::atomic<bool> failed;
+};
+
+
+
+// Leviathan_SetPrices()
+//
+// Prices the symbols of |histo| by how often they occur. Symbols that
+// don't occur still get a price.
+static void Leviathan_SetPrices(uint32_t *prices, const uint32_t *histo)
+{
+    uint32_t total = 0;
+
+    for (int i = 0; i != 256; i++)
+    {
+        total += histo[i];
+    }
+    for (int i = 0; i != 256; i++)
+    {
+        double p = log2((total * 4.0 + 256) / (histo[i] * 4.0 + 1));
+        p = (p < 1.0) ? 1.0 : (p > 15.0) ? 15.0 : p;
+        prices[i] = (uint32_t)(p * (1 << LEVIATHAN_PRICE_SHIFT));
+    }
+}
+
+
+
+// Leviathan_ResetPrices()
+//
+// Prices for a chunk with no statistics before it.
+static void Leviathan_ResetPrices(LeviathanPrices *prices)
+{
+    uint32_t flat[256];
+
+    for (int i = 0; i != 256; i++)
+    {
+        flat[i] = 1;
+    }
+    Leviathan_SetPrices(prices->lit, flat);
+    Leviathan_SetPrices(prices->cmd, flat);
+    Leviathan_SetPrices(prices->offs, flat);
+    Leviathan_SetPrices(prices->len, flat);
+    prices->sub = true;
+}
+
+
+
+// Leviathan_UpdatePrices()
+//
+// Prices from the arrays of the last parse. |sub| says whether the literals
+// were best coded as differences.
+static void Leviathan_UpdatePrices(LeviathanEncoder *enc, bool sub)
+{
+    uint32_t histo[256];
+
+    memset(histo, 0, sizeof(histo));
+    const uint8_t *lits = sub ? enc->sub_lits : enc->lits;
+    for (int i = 0; i != enc->lits_size; i++)
+    {
+        histo[lits[i]]++;
+    }
+    Leviathan_SetPrices(enc->prices.lit, histo);
+    enc->prices.sub = sub;
+
+    memset(histo, 0, sizeof(histo));
+    for (int i = 0; i != enc->cmds_size; i++)
+    {
+        histo[enc->cmds[i]]++;
+    }
+    Leviathan_SetPrices(enc->prices.cmd, histo);
+
+    memset(histo, 0, sizeof(histo));
+    for (int i = 0; i != enc->offs_size; i++)
+    {
+        histo[enc->packed_offs[i]]++;
+    }
+    Leviathan_SetPrices(enc->prices.offs, histo);
+
+    memset(histo, 0, sizeof(histo));
+    for (int i = 0; i != enc->lens_size; i++)
+    {
+        histo[enc->packed_lens[i]]++;
+    }
+    Leviathan_SetPrices(enc->prices.len, histo);
+}
+
+
+
+// Leviathan_LengthPrice()
+//
+// Price of |v| in the length array, with the extra bits of a long one.
+static __forceinline uint32_t Leviathan_LengthPrice(const LeviathanPrices *prices, uint32_t v)
+{
+    if (v < 255)
+    {
+        return prices->len[v];
+    }
+    uint32_t bits = 2 * (32 - CountLeadingZeros(v - 255 + 64)) - 7;
+    return prices->len[255] + (bits << LEVIATHAN_PRICE_SHIFT);
+}
+
+
+
+// Leviathan_OffsetPrice()
+//
+// Price of an explicit offset, its packed code and extra bits.
+static __forceinline uint32_t Leviathan_OffsetPrice(const LeviathanPrices *prices, uint32_t dist)
+{
+    uint32_t bits;
+
+    if (dist < (1 << 23) - 248)
+    {
+        bits = 31 - CountLeadingZeros(dist + 248) - 4;
+    }
+    else
+    {
+        bits = 31 - CountLeadingZeros((dist - 8322816) >> 12) + 12;
+    }
+    return prices->offs[Kraken_DistanceCode(dist)] + (bits << LEVIATHAN_PRICE_SHIFT);
+}
+
+
+
+// Leviathan_Relax()
+//
+// Takes a match of |len| at |dist| from |cur| to |next| if that is cheaper.
+// The recent offset at |index| moves to the front, an explicit offset at
+// index 7 pushes out the oldest one.
+static __forceinline void Leviathan_Relax(const LeviathanNode *cur, LeviathanNode *next, uint32_t cost,
+                                          uint32_t len, uint32_t dist, int index)
+{
+    if (cost >= next->cost)
+    {
+        return;
+    }
+    next->cost = cost;
+    next->len = len;
+    next->dist = dist;
+    next->litrun = 0;
+    next->recent[0] = dist;
+    for (int k = 1; k <= index && k != LEVIATHAN_RECENT_OFFSETS; k++)
+    {
+        next->recent[k] = cur->recent[k - 1];
+    }
+    for (int k = index + 1; k < LEVIATHAN_RECENT_OFFSETS; k++)
+    {
+        next->recent[k] = cur->recent[k];
+    }
+}
+
+
+
+// Leviathan_FindMatches()
+//
+// Collects the match finder candidates of every position from |start| to
+// |end| that a command may start at, for all parses of the chunk. Positions
+// inside a match of nice_len or more are skipped.
+static void Leviathan_FindMatches(LeviathanEncoder *enc, size_t chunk_start, size_t start, size_t end)
+{
+    size_t skip_until = start;
+
+    for (size_t pos = start; pos + LEVIATHAN_MATCH_ZONE_TAIL <= end; pos++)
+    {
+        size_t i = pos - chunk_start;
+        MatchFinderMatch *matches = &enc->matches[i * LEVIATHAN_MAX_MATCHES];
+
+        enc->num_matches[i] = 0;
+        if (pos < skip_until)
+        {
+            continue;
+        }
+        int n = MatchFinder_FindMatches(&enc->mf, pos, end - LEVIATHAN_MATCH_END_TAIL, LEVIATHAN_MIN_OFFSET,
+                                        matches, LEVIATHAN_MAX_MATCHES);
+        enc->num_matches[i] = (uint8_t)n;
+        if (n && matches[n - 1].len >= (uint32_t)enc->params->nice_len)
+        {
+            skip_until = pos + matches[n - 1].len;
+        }
+    }
+}
+
+
+
+// Leviathan_ParseChunk()
+//
+// Finds the cheapest commands for the bytes from |start| to |end| under the
+// current prices, walking forward and keeping the best way to reach each
+// position. A match of nice_len or more is taken as is.
+static void Leviathan_ParseChunk(LeviathanEncoder *enc, size_t chunk_start, size_t start, size_t end)
+{
+    const uint8_t *src = enc->src;
+    const LeviathanPrices *prices = &enc->prices;
+    LeviathanNode *nodes = enc->nodes;
+    size_t n = end - chunk_start;
+    uint32_t nice_len = enc->params->nice_len;
+
+    for (size_t i = start - chunk_start; i <= n; i++)
+    {
+        nodes[i].cost = LEVIATHAN_INFINITE_COST;
+    }
+    LeviathanNode *first = &nodes[start - chunk_start];
+    first->cost = 0;
+    first->len = 0;
+    first->litrun = 0;
+    for (int k = 0; k != LEVIATHAN_RECENT_OFFSETS; k++)
+    {
+        first->recent[k] = LEVIATHAN_MIN_OFFSET;
+    }
+
+    for (size_t i = start - chunk_start; i < n; i++)
+    {
+        const LeviathanNode *cur = &nodes[i];
+        size_t pos = chunk_start + i;
+        uint8_t lit = prices->sub ? (uint8_t)(src[pos] - src[pos - cur->recent[0]]) : src[pos];
+
+        // The third literal in a row needs a length
+        uint32_t cost = cur->cost + prices->lit[lit] + (cur->litrun == 2 ? Leviathan_LengthPrice(prices, 0) : 0);
+        if (cost < nodes[i + 1].cost)
+        {
+            LeviathanNode *next = &nodes[i + 1];
+            next->cost = cost;
+            next->len = 0;
+            next->litrun = cur->litrun + 1;
+            memcpy(next->recent, cur->recent, sizeof(cur->recent));
+        }
+
+        if (i + LEVIATHAN_MATCH_ZONE_TAIL > n)
+        {
+            continue;
+        }
+
+        uint32_t lit_code = Min(cur->litrun, 3) << 3;
+        size_t longest = 0;
+
+        for (int r = 0; r != LEVIATHAN_RECENT_OFFSETS; r++)
+        {
+            uint32_t dist = cur->recent[r];
+            bool seen = false;
+            for (int k = 0; k != r; k++)
+            {
+                seen |= (cur->recent[k] == dist);
+            }
+            if (seen || dist > pos)
+            {
+                continue;
+            }
+            size_t len = MatchLength(src + pos, src + pos - dist, src + end - LEVIATHAN_MATCH_END_TAIL);
+            for (size_t l = 2; l <= len; l++)
+            {
+                cost = cur->cost + prices->cmd[lit_code | r << 5 | Min(l - 2, (size_t)7)] +
+                       (l >= 9 ? Leviathan_LengthPrice(prices, (uint32_t)l - 9) : 0);
+                Leviathan_Relax(cur, &nodes[i + l], cost, (uint32_t)l, dist, r);
+            }
+            longest = Max(longest, len);
+        }
+
+        const MatchFinderMatch *matches = &enc->matches[i * LEVIATHAN_MAX_MATCHES];
+        size_t l = 3;
+        for (int m = 0; m != enc->num_matches[i]; m++)
+        {
+            uint32_t dist = matches[m].dist;
+            bool seen = false;
+            for (int k = 0; k != LEVIATHAN_RECENT_OFFSETS; k++)
+            {
+                seen |= (cur->recent[k] == dist);
+            }
+            if (seen)
+            {
+                continue;
+            }
+            uint32_t offs_cost = cur->cost + Leviathan_OffsetPrice(prices, dist);
+            for (; l <= matches[m].len; l++)
+            {
+                cost = offs_cost + prices->cmd[lit_code | 7 << 5 | Min(l - 2, (size_t)7)] +
+                       (l >= 9 ? Leviathan_LengthPrice(prices, (uint32_t)l - 9) : 0);
+                Leviathan_Relax(cur, &nodes[i + l], cost, (uint32_t)l, dist, 7);
+            }
+            longest = Max(longest, (size_t)matches[m].len);
+        }
+
+        // Long matches are taken whole, the bytes they cover aren't parsed
+        if (longest >= nice_len)
+        {
+            i += longest - 1;
+        }
+    }
+}
+
+
+
+// Leviathan_EmitLiterals()
+//
+// Adds the |n| literals from |pos|, the differences relative to |last_dist|.
+static void Leviathan_EmitLiterals(LeviathanEncoder *enc, size_t pos, size_t n, uint32_t last_dist)
+{
+    const uint8_t *src = enc->src;
+    int k = enc->lits_size;
+
+    for (size_t i = 0; i != n; i++, k++)
+    {
+        enc->lits[k] = src[pos + i];
+        enc->sub_lits[k] = src[pos + i] - src[pos + i - last_dist];
+        enc->lit_pos[k] = (uint32_t)(pos + i);
+        enc->lit_first[k] = (i == 0);
+    }
+    enc->lits_size = k;
+}
+
+
+
+// Leviathan_EmitCommands()
+//
+// Turns the parse of the bytes from |start| to |end| into the arrays of
+// |enc|, replaying the recent offsets the way LzRecentOffsets does.
+static void Leviathan_EmitCommands(LeviathanEncoder *enc, size_t chunk_start, size_t start, size_t end)
+{
+    const LeviathanNode *nodes = enc->nodes;
+    uint32_t recent[LEVIATHAN_RECENT_OFFSETS];
+    uint32_t *match_ends = (uint32_t *)enc->split_buf;
+    int num_matches = 0;
+
+    // Walk back from the end, noting where each match ends
+    for (size_t i = end - chunk_start; i > start - chunk_start; )
+    {
+        if (nodes[i].len == 0)
+        {
+            i--;
+            continue;
+        }
+        match_ends[num_matches++] = (uint32_t)i;
+        i -= nodes[i].len;
+    }
+
+    enc->lits_size = 0;
+    enc->cmds_size = 0;
+    enc->offs_size = 0;
+    enc->lit_lens_size = 0;
+    enc->match_lens_size = 0;
+    for (int k = 0; k != LEVIATHAN_RECENT_OFFSETS; k++)
+    {
+        recent[k] = LEVIATHAN_MIN_OFFSET;
+    }
+
+    size_t lit_start = start;
+    while (num_matches)
+    {
+        const LeviathanNode *node = &nodes[match_ends[--num_matches]];
+        size_t pos = chunk_start + match_ends[num_matches] - node->len;
+        size_t litlen = pos - lit_start;
+        uint32_t dist = node->dist;
+        int index = 0;
+
+        Leviathan_EmitLiterals(enc, lit_start, litlen, recent[0]);
+        if (litlen >= 3)
+        {
+            enc->lit_lens[enc->lit_lens_size++] = (uint32_t)litlen - 3;
+        }
+
+        while (index != LEVIATHAN_RECENT_OFFSETS && recent[index] != dist)
+        {
+            index++;
+        }
+        for (int k = Min(index, LEVIATHAN_RECENT_OFFSETS - 1); k > 0; k--)
+        {
+            recent[k] = recent[k - 1];
+        }
+        if (index == LEVIATHAN_RECENT_OFFSETS)
+        {
+            enc->offs[enc->offs_size] = dist;
+            enc->packed_offs[enc->offs_size++] = Kraken_DistanceCode(dist);
+        }
+        if (node->len >= 9)
+        {
+            enc->match_lens[enc->match_lens_size++] = node->len - 9;
+        }
+        enc->cmds[enc->cmds_size++] = (uint8_t)(Min(node->len - 2, 7) | Min(litlen, 3) << 3 | index << 5);
+        recent[0] = dist;
+        lit_start = pos + node->len;
+    }
+    Leviathan_EmitLiterals(enc, lit_start, end - lit_start, recent[0]);
+
+    // The match lengths go at the back in reverse, lengths from 255 on take
+    // an entry of |long_lens|
+    enc->lens_size = 0;
+    enc->long_lens_size = 0;
+    for (int i = 0; i != enc->lit_lens_size + enc->match_lens_size; i++)
+    {
+        uint32_t v = (i < enc->lit_lens_size) ? enc->lit_lens[i] :
+                     enc->match_lens[enc->lit_lens_size + enc->match_lens_size - 1 - i];
+        if (v >= 255)
+        {
+            enc->long_lens[enc->long_lens_size++] = v - 255;
+            v = 255;
+        }
+        enc->packed_lens[enc->lens_size++] = (uint8_t)v;
+    }
+}
+
+
+
+// Leviathan_FitsScratch()
+//
+// Whether Leviathan_ReadLzTable() has room for the arrays of a chunk of
+// |size| bytes, in the scratch space Leviathan_DecodeQuantum() gives it.
+// Multi-stream literals are decoded into half of what is left.
+static bool Leviathan_FitsScratch(const LeviathanEncoder *enc, int size, bool multi_lits)
+{
+    int avail = (int)Min(3 * size + 32 + 0xd000, 0x6C000) - (int)sizeof(LeviathanLzTable);
+    int used = 5 * (enc->offs_size + enc->lens_size) + 32;
+
+    if (enc->offs_size > size / 3 || enc->lens_size > size / 5 || used > avail)
+    {
+        return false;
+    }
+    if (multi_lits && enc->lits_size > (avail - used - 0xc000) / 2)
+    {
+        return false;
+    }
+    used += enc->lits_size + enc->cmds_size;
+    return avail - used >= size;
+}
+
+
+
+// Leviathan_WriteLiterals()
+//
+// Writes the literals as |mode| codes them, the modes with several streams
+// as arrays for Kraken_DecodeMultiArray(). Returns the size and sets |*cost|
+// as Kraken_EncodeBytes() does.
+static int Leviathan_WriteLiterals(LeviathanEncoder *enc, size_t chunk_start, int mode, uint8_t *dst,
+                                   double *cost)
+{
+    const uint8_t *src = enc->src;
+    int n = enc->lits_size;
+    int num_streams;
+    int counts[16];
+    int starts[16];
+
+    if (mode == kLeviathanLits_Sub || mode == kLeviathanLits_Raw)
+    {
+        return Kraken_EncodeBytes(dst, mode == kLeviathanLits_Sub ? enc->sub_lits : enc->lits, n, 0,
+                                  enc->space_speed, cost);
+    }
+
+    // LamSub has the first literal of each run on its own, SubAnd3 and
+    // SubAndF one stream per position modulo 4 or 16 in the chunk, and O1
+    // one stream per top 4 bits of the byte before
+    num_streams = (mode == kLeviathanLits_LamSub) ? 2 : (mode == kLeviathanLits_SubAnd3) ? 4 : 16;
+    uint8_t *stream = enc->split_buf + KRAKEN_CHUNK_SIZE;
+    for (int i = 0; i != n; i++)
+    {
+        size_t pos = enc->lit_pos[i];
+        stream[i] = (mode == kLeviathanLits_LamSub) ? enc->lit_first[i] :
+                    (mode == kLeviathanLits_O1) ? src[pos - 1] >> 4 :
+                    (pos - chunk_start) & (num_streams - 1);
+    }
+
+    memset(counts, 0, sizeof(counts));
+    for (int i = 0; i != n; i++)
+    {
+        counts[stream[i]]++;
+    }
+    for (int s = 0, total = 0; s != num_streams; s++)
+    {
+        starts[s] = total;
+        total += counts[s];
+    }
+    const uint8_t *lits = (mode == kLeviathanLits_O1) ? enc->lits : enc->sub_lits;
+    for (int i = 0; i != n; i++)
+    {
+        enc->split_buf[starts[stream[i]]++] = lits[i];
+    }
+
+    uint8_t *p = dst;
+    *p++ = 0x80;
+    *cost = 1;
+    for (int s = 0; s != num_streams; s++)
+    {
+        double c;
+        p += Kraken_EncodeBytes(p, enc->split_buf + starts[s] - counts[s], counts[s], 0, enc->space_speed, &c);
+        *cost += c;
+    }
+    return (int)(p - dst);
+}
+
+
+
+// Leviathan_WriteLzTable()
+//
+// Writes the arrays of the parsed chunk as Leviathan_ReadLzTable() reads
+// them, with the literals in whichever mode costs the least. |start| is
+// the start of the chunk, the first 8 bytes of the input are stored in
+// front. Returns the size and sets the literal |mode|, or returns 0 if the
+// decoder would run out of scratch space.
+static int Leviathan_WriteLzTable(LeviathanEncoder *enc, size_t start, int size, uint8_t *dst, int *mode)
+{
+    uint8_t *p = dst;
+    int lits_size = 0;
+    double lits_cost = 1e30;
+
+    if (!Leviathan_FitsScratch(enc, size, false))
+    {
+        return 0;
+    }
+
+    if (start == 0)
+    {
+        memcpy(p, enc->src, 8);
+        p += 8;
+    }
+
+    // The top bit of the first byte of the offsets and of the commands
+    // selects other layouts
+    p += Kraken_EncodeBytes(p, enc->packed_offs, enc->offs_size, kEncodeBytes_LongHeader, enc->space_speed);
+    p += Kraken_EncodeBytes(p, enc->packed_lens, enc->lens_size, 0, enc->space_speed);
+
+    bool multi_fits = Leviathan_FitsScratch(enc, size, true);
+    for (int m = 0; m != kLeviathanLits_Count; m++)
+    {
+        if (m >= kLeviathanLits_LamSub && !multi_fits)
+        {
+            break;
+        }
+        double c;
+        int n = Leviathan_WriteLiterals(enc, start, m, enc->tmp_buf, &c);
+        if (c < lits_cost)
+        {
+            memcpy(enc->lit_buf, enc->tmp_buf, n);
+            lits_size = n;
+            lits_cost = c;
+            *mode = m;
+        }
+    }
+    memcpy(p, enc->lit_buf, lits_size);
+    p += lits_size;
+
+    p += Kraken_EncodeBytes(p, enc->cmds, enc->cmds_size, kEncodeBytes_LongHeader, enc->space_speed);
+    p += Kraken_WriteLzBits(p, enc->tmp_buf, enc->offs, enc->offs_size, enc->long_lens, enc->long_lens_size);
+    return (int)(p - dst);
+}
+
+
+
+// Leviathan_EncodeChunk()
+//
+// Writes the chunk from |start| to |end| with its 3 byte header. Each parse
+// after the first is priced from the arrays of the one before.
+static int Leviathan_EncodeChunk(LeviathanEncoder *enc, size_t start, size_t end, uint8_t *dst)
+{
+    int size = (int)(end - start);
+    int lz_size = 0;
+    int mode = 0;
+
+    if (size >= 32)
+    {
+        size_t parse_start = (start == 0) ? 8 : start;
+        Leviathan_FindMatches(enc, start, parse_start, end);
+        for (int pass = 0; pass != enc->params->passes; pass++)
+        {
+            if (pass)
+            {
+                Leviathan_UpdatePrices(enc, enc->prices.sub);
+            }
+            Leviathan_ParseChunk(enc, start, parse_start, end);
+            Leviathan_EmitCommands(enc, start, parse_start, end);
+        }
+        lz_size = Leviathan_WriteLzTable(enc, start, size, enc->lz_buf, &mode);
+        Leviathan_UpdatePrices(enc, mode != kLeviathanLits_Raw && mode != kLeviathanLits_O1);
+    }
+    return Kraken_WriteChunk(dst, enc->src + start, size, enc->lz_buf, lz_size, mode, enc->tmp_buf, true,
+                             enc->space_speed, 0);
+}
+
+
+
+// Leviathan_InitEncoder()
+static bool Leviathan_InitEncoder(LeviathanEncoder *enc, const LeviathanCompressor *c)
+{
+    enc->src = c->src;
+    enc->src_size = c->src_size;
+    enc->params = c->params;
+    enc->space_speed = c->space_speed;
+    if (!MatchFinder_Init(&enc->mf, c->src, c->src_size, enc->params->finder, enc->params->hash_bits,
+                          enc->params->window_bits, enc->params->max_chain, enc->params->nice_len, c->max_memory))
+    {
+        return false;
+    }
+
+    // A command covers at least 2 bytes, one with an explicit offset at least
+    // 3 and a long length at least 5
+    enc->nodes = new LeviathanNode[KRAKEN_CHUNK_SIZE + 1];
+    enc->matches = new MatchFinderMatch[KRAKEN_CHUNK_SIZE * LEVIATHAN_MAX_MATCHES];
+    enc->num_matches = new uint8_t[KRAKEN_CHUNK_SIZE];
+    enc->lits = new uint8_t[KRAKEN_CHUNK_SIZE];
+    enc->sub_lits = new uint8_t[KRAKEN_CHUNK_SIZE];
+    enc->lit_pos = new uint32_t[KRAKEN_CHUNK_SIZE];
+    enc->lit_first = new uint8_t[KRAKEN_CHUNK_SIZE];
+    enc->cmds = new uint8_t[KRAKEN_CHUNK_SIZE / 2];
+    enc->offs = new uint32_t[KRAKEN_CHUNK_SIZE / 3];
+    enc->packed_offs = new uint8_t[KRAKEN_CHUNK_SIZE / 3];
+    enc->lit_lens = new uint32_t[KRAKEN_CHUNK_SIZE / 5];
+    enc->match_lens = new uint32_t[KRAKEN_CHUNK_SIZE / 5];
+    enc->packed_lens = new uint8_t[KRAKEN_CHUNK_SIZE / 5 * 2];
+    enc->long_lens = new uint32_t[KRAKEN_CHUNK_SIZE / 255 * 2];
+    enc->lz_buf = new uint8_t[KRAKEN_CHUNK_SIZE * 4];
+    enc->lit_buf = new uint8_t[KRAKEN_CHUNK_SIZE + 256];
+    enc->split_buf = new uint8_t[KRAKEN_CHUNK_SIZE * 2];
+    enc->tmp_buf = new uint8_t[KRAKEN_CHUNK_SIZE * 2];
+    return true;
+}
+
+
+
+// Leviathan_FreeEncoder()
+static void Leviathan_FreeEncoder(LeviathanEncoder *enc)
+{
+    delete[] enc->nodes;
+    delete[] enc->matches;
+    delete[] enc->num_matches;
+    delete[] enc->lits;
+    delete[] enc->sub_lits;
+    delete[] enc->lit_pos;
+    delete[] enc->lit_first;
+    delete[] enc->cmds;
+    delete[] enc->offs;
+    delete[] enc->packed_offs;
+    delete[] enc->lit_lens;
+    delete[] enc->match_lens;
+    delete[] enc->packed_lens;
+    delete[] enc->long_lens;
+    delete[] enc->lz_buf;
+    delete[] enc->lit_buf;
+    delete[] enc->split_buf;
+    delete[] enc->tmp_buf;
+    MatchFinder_Free(&enc->mf);
+}
+
+
+
+// Leviathan_Worker()
+//
+// Encodes slices of the input until there are none left. A slice starts
+// with the match finder one window back and fresh prices.
+static void Leviathan_Worker(LeviathanCompressor *c)
+{
+    LeviathanEncoder enc;
+
+    if (!Leviathan_InitEncoder(&enc, c))
+    {
+        c->failed = true;
+        return;
+    }
+
+    size_t window = (size_t)enc.mf.window_mask + 1;
+    for (;;)
+    {
+        size_t first = c->next_slice++ * LEVIATHAN_SLICE_QUANTA;
+        if (first >= c->num_quanta || c->failed)
+        {
+            break;
+        }
+
+        size_t slice_start = first * KRAKEN_QUANTUM_SIZE;
+        MatchFinder_Reset(&enc.mf, slice_start > window ? slice_start - window : 0);
+        Leviathan_ResetPrices(&enc.prices);
+        for (size_t q = first; q != Min(first + LEVIATHAN_SLICE_QUANTA, c->num_quanta); q++)
+        {
+            size_t start = q * KRAKEN_QUANTUM_SIZE;
+            size_t end = Min(start + KRAKEN_QUANTUM_SIZE, c->src_size);
+            uint8_t *out = c->quanta + q * LEVIATHAN_QUANTUM_BUF_SIZE;
+            uint8_t *p = out;
+
+            for (size_t chunk = start; chunk < end; chunk += KRAKEN_CHUNK_SIZE)
+            {
+                p += Leviathan_EncodeChunk(&enc, chunk, Min(chunk + KRAKEN_CHUNK_SIZE, end), p);
+            }
+            c->quantum_sizes[q] = (int)(p - out);
+        }
+    }
+    Leviathan_FreeEncoder(&enc);
+}
+
+
+
+// Leviathan_CopyQuantum()
+//
+// Hands Kraken_WriteBlocks() the chunks a worker wrote for a quantum.
+static int Leviathan_CopyQuantum(void *ctx, size_t start, size_t, uint8_t *dst)
+{
+    LeviathanCompressor *c = (LeviathanCompressor *)ctx;
+    size_t q = start / KRAKEN_QUANTUM_SIZE;
+
+    memcpy(dst, c->quanta + q * LEVIATHAN_QUANTUM_BUF_SIZE, c->quantum_sizes[q]);
+    return c->quantum_sizes[q];
+}
+
+
+
+// Leviathan_Compress()
+//
+// Compresses |src| as Leviathan at |level| 1 to 9, with |space_speed| and
+// |max_memory| as Kraken_Compress() takes them, on |threads| threads or one
+// per core if 0. Each thread has a match finder, so there are no more
+// threads than fit in |max_memory|. Returns the compressed size, or -1 if
+// |src_size| is over KRAKEN_MAX_COMPRESS_SIZE or memory runs out.
+int Leviathan_Compress(const byte *src, size_t src_size, byte *dst, int level, int space_speed, size_t max_memory,
+                       int threads)
+{
+    LeviathanCompressor c;
+
+    if (src_size > KRAKEN_MAX_COMPRESS_SIZE)
+    {
+        return -1;
+    }
+    c.src = src;
+    c.src_size = src_size;
+    c.params = &kLeviathanLevels[level - 1];
+    c.space_speed = space_speed;
+    c.max_memory = max_memory;
+    c.num_quanta = (src_size + KRAKEN_QUANTUM_SIZE - 1) / KRAKEN_QUANTUM_SIZE;
+    c.quanta = new uint8_t[c.num_quanta * LEVIATHAN_QUANTUM_BUF_SIZE];
+    c.quantum_sizes = new int[c.num_quanta];
+    c.next_slice = 0;
+    c.failed = false;
+
+    size_t num_slices = (c.num_quanta + LEVIATHAN_SLICE_QUANTA - 1) / LEVIATHAN_SLICE_QUANTA;
+    if (threads <= 0)
+    {
+        threads = (int)std::thread::hardware_concurrency();
+    }
+    threads = (int)Max(Min(threads, num_slices), 1);
+    if (max_memory)
+    {
+        int hash_bits = c.params->hash_bits;
+        int window_bits = c.params->window_bits;
+        size_t finder_size = MatchFinder_FitSizes(src_size, c.params->finder, c.params->max_chain, 0,
+                                                  &hash_bits, &window_bits);
+        threads = (int)Max(Min(threads, max_memory / finder_size), 1);
+    }
+
+    std::thread *workers = new std::thread[threads - 1];
+    for (int i = 0; i != threads - 1; i++)
+    {
+        workers[i] = std::thread(Leviathan_Worker, &c);
+    }
+    Leviathan_Worker(&c);
+    for (int i = 0; i != threads - 1; i++)
+    {
+        workers[i].join();
+    }
+    delete[] workers;
+
+    int n = c.failed ? -1 : Kraken_WriteBlocks(src, src_size, dst, 12, Leviathan_CopyQuantum, &c);
+
+    delete[] c.quanta;
+    delete[] c.quantum_sizes;
+    return n;
+}
@@ -0,0 +1,490 @@
+/*
+------------------------------------------------------------------------------
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+------------------------------------------------------------------------------
+*/
+
+
+#include "stdafx.h"
+
+
+// The LZ execution engine shared by the Kraken, Mermaid and Leviathan
+// decoders. A decoder picks three policies:
+//
+//   Literals  how literal runs reach the output: LzLiteralsRaw copies them,
+//             LzLiteralsDelta adds them to the bytes at the last offset.
+//             Leviathan has further modes with the same interface.
+//   Format    how a command byte splits into a literal length code, a recent
+//             offset index and a match, and how many recent offsets there
+//             are. Mermaid's tokens do not fit the recent offset command
+//             loop, so it runs its own loop on top of the literal policies.
+//   Bounds    which checks beyond the always present ones are made.
+//             LzBounds is the one OOZLIN_FUZZ_SAFE selects.
+//
+// Wide literal and match copies may write up to LZ_COPY_OVERRUN bytes past
+// the end of a run. Commands that start within SAFE_SPACE bytes of the end of
+// the block take the exact path instead, which writes nothing past the end,
+// so the output needs no slack after it. Include after utilities.h.
+
+
+
+// Bounds policy of the decoders that trust their input. The engine only makes
+// the checks that keep valid streams in bounds.
+struct LzBoundsUnchecked {
+    enum { kChecked = 0 };
+};
+
+// Bounds policy of the fuzz safe build. Once per command it also checks that
+// the output and every stream stay within their ends, so invalid input fails
+// before the streams are read past their margins.
+struct LzBoundsChecked {
+    enum { kChecked = 1 };
+};
+
+#if OOZLIN_FUZZ_SAFE
+typedef LzBoundsChecked LzBounds;
+#else
+typedef LzBoundsUnchecked LzBounds;
+#endif
+
+// How far the wide copies may write past the end of a run
+#define LZ_COPY_OVERRUN 16
+
+
+
+// The streams of one LZ block that LzEngine_Process() consumes
+struct LzCommandStreams {
+    const uint8_t *cmd_stream;
+    const uint8_t *cmd_stream_end;
+    const int *len_stream;
+    const int *len_stream_end;
+    const int *offs_stream;
+    const int *offs_stream_end;
+};
+
+
+
+// LzCopyLiterals()
+//
+// Copies |litlen| literals 16 bytes at a time. May write up to 15 bytes past
+// the end.
+static __forceinline void LzCopyLiterals(uint8_t *dst, const uint8_t *lit_stream, size_t litlen)
+{
+    COPY_128(dst, lit_stream);
+    for (size_t i = 16; i < litlen; i += 16)
+    {
+        COPY_128(dst + i, lit_stream + i);
+    }
+}
+
+
+
+// LzAddLiterals()
+//
+// dst[i] = lit_stream[i] + dst[last_offset + i] for |litlen| bytes. The delta
+// source must be final before it is read, so the adds are 16 bytes wide only
+// when the offset reaches back at least 16 bytes, else 8. May write up to 15
+// bytes past the end.
+static __forceinline void LzAddLiterals(uint8_t *dst, const uint8_t *lit_stream, size_t last_offset, size_t litlen)
+{
+    if (last_offset <= (size_t)-16)
+    {
+        COPY_128_ADD(dst, lit_stream, &dst[last_offset]);
+        for (size_t i = 16; i < litlen; i += 16)
+        {
+            COPY_128_ADD(dst + i, lit_stream + i, &dst[last_offset + i]);
+        }
+    }
+    else
+    {
+        COPY_64_ADD(dst, lit_stream, &dst[last_offset]);
+        for (size_t i = 8; i < litlen; i += 8)
+        {
+            COPY_64_ADD(dst + i, lit_stream + i, &dst[last_offset + i]);
+        }
+    }
+}
+
+
+
+// LzCopyLiteralsExact()
+//
+// Copies |litlen| literals without writing past the end.
+static __forceinline void LzCopyLiteralsExact(uint8_t *dst, const uint8_t *lit_stream, size_t litlen)
+{
+    for (; litlen >= 64; litlen -= 64)
+    {
+        COPY_64_BYTES(dst, lit_stream);
+        dst += 64, lit_stream += 64;
+    }
+    for (; litlen >= 8; litlen -= 8)
+    {
+        COPY_64(dst, lit_stream);
+        dst += 8, lit_stream += 8;
+    }
+    for (; litlen > 0; litlen--)
+    {
+        *dst++ = *lit_stream++;
+    }
+}
+
+
+
+// LzAddLiteralsExact()
+//
+// Same as LzAddLiterals() without writing past the end.
+static __forceinline void LzAddLiteralsExact(uint8_t *dst, const uint8_t *lit_stream, size_t last_offset, size_t litlen)
+{
+    if (last_offset <= (size_t)-16)
+    {
+        for (; litlen >= 16; litlen -= 16)
+        {
+            COPY_128_ADD(dst, lit_stream, &dst[last_offset]);
+            dst += 16, lit_stream += 16;
+        }
+    }
+    for (; litlen >= 8; litlen -= 8)
+    {
+        COPY_64_ADD(dst, lit_stream, &dst[last_offset]);
+        dst += 8, lit_stream += 8;
+    }
+    for (; litlen > 0; litlen--, dst++)
+    {
+        *dst = *lit_stream++ + dst[last_offset];
+    }
+}
+
+
+
+// LzCopyMatchExact()
+//
+// Copies a match one byte at a time, for the exact path. Fails if it doesn't
+// fit before |dst_end|.
+static __forceinline bool LzCopyMatchExact(uint8_t *&dst, const uint8_t *copyfrom, size_t matchlen, const uint8_t *dst_end)
+{
+    if (matchlen > (size_t)(dst_end - dst))
+    {
+        return false;  // copy length out of bounds
+    }
+    for (size_t i = 0; i != matchlen; i++)
+    {
+        dst[i] = copyfrom[i];
+    }
+    dst += matchlen;
+    return true;
+}
+
+
+
+// LzReadLiteralLength()
+//
+// Literal length codes 0 to 2 are the length, 3 takes the next entry of the
+// length stream.
+static __forceinline uint32_t LzReadLiteralLength(uint32_t lit_code, const int *&len_stream)
+{
+    // use cmov
+    uint32_t len_stream_value = *len_stream & 0xffffff;
+    const int *next_len_stream = len_stream + 1;
+    len_stream = (lit_code == 3) ? next_len_stream : len_stream;
+    return (lit_code == 3) ? len_stream_value : lit_code;
+}
+
+
+
+// Literal policy that copies the literals
+struct LzLiteralsRaw {
+
+    const uint8_t *lit_stream;
+    const uint8_t *lit_stream_end;
+
+    __forceinline LzLiteralsRaw(const uint8_t *lit_stream, const uint8_t *lit_stream_end)
+        : lit_stream(lit_stream), lit_stream_end(lit_stream_end)
+    {
+    }
+
+    __forceinline void Copy(uint8_t *&dst, size_t litlen, size_t last_offset)
+    {
+        LzCopyLiterals(dst, lit_stream, litlen);
+        dst += litlen;
+        lit_stream += litlen;
+    }
+
+    __forceinline void CopyExact(uint8_t *&dst, size_t litlen, size_t last_offset)
+    {
+        LzCopyLiteralsExact(dst, lit_stream, litlen);
+        dst += litlen;
+        lit_stream += litlen;
+    }
+
+    __forceinline bool HasLiterals(const uint8_t *dst, size_t n)
+    {
+        return n <= (size_t)(lit_stream_end - lit_stream);
+    }
+
+    // Runs longer than 24 that reach past |copy_end| are copied exactly, after
+    // a check against |match_zone_end|. |copy_end| is never past the match
+    // zone. With |kExact| every run takes that path.
+    template<typename Bounds, bool kExact>
+    __forceinline bool CopyLiterals(uint32_t lit_code, uint8_t *&dst, const int *&len_stream,
+                                    uint8_t *match_zone_end, uint8_t *copy_end, size_t last_offset)
+    {
+        uint32_t litlen = LzReadLiteralLength(lit_code, len_stream);
+        if (Bounds::kChecked && !HasLiterals(dst, litlen))
+        {
+            return false;
+        }
+        if (kExact || (litlen > 24 && litlen > copy_end - dst))
+        {
+            if (litlen > match_zone_end - dst)
+            {
+                return false;  // out of bounds
+            }
+            CopyExact(dst, litlen, last_offset);
+        }
+        else
+        {
+            Copy(dst, litlen, last_offset);
+        }
+        return true;
+    }
+
+    template<typename Bounds>
+    __forceinline bool CopyFinalLiterals(size_t final_len, uint8_t *&dst, size_t last_offset, bool nontemporal)
+    {
+        if (nontemporal && final_len >= NONTEMPORAL_MIN_SIZE)
+        {
+            CopyNonTemporal(dst, lit_stream, final_len);
+            dst += final_len, lit_stream += final_len;
+            return true;
+        }
+        CopyExact(dst, final_len, last_offset);
+        return true;
+    }
+};
+
+
+
+// Literal policy that adds the literals to the bytes at the last offset
+struct LzLiteralsDelta {
+
+    const uint8_t *lit_stream;
+    const uint8_t *lit_stream_end;
+
+    __forceinline LzLiteralsDelta(const uint8_t *lit_stream, const uint8_t *lit_stream_end)
+        : lit_stream(lit_stream), lit_stream_end(lit_stream_end)
+    {
+    }
+
+    __forceinline void Copy(uint8_t *&dst, size_t litlen, size_t last_offset)
+    {
+        LzAddLiterals(dst, lit_stream, last_offset, litlen);
+        dst += litlen;
+        lit_stream += litlen;
+    }
+
+    __forceinline void CopyExact(uint8_t *&dst, size_t litlen, size_t last_offset)
+    {
+        LzAddLiteralsExact(dst, lit_stream, last_offset, litlen);
+        dst += litlen;
+        lit_stream += litlen;
+    }
+
+    __forceinline bool HasLiterals(const uint8_t *dst, size_t n)
+    {
+        return n <= (size_t)(lit_stream_end - lit_stream);
+    }
+
+    template<typename Bounds, bool kExact>
+    __forceinline bool CopyLiterals(uint32_t lit_code, uint8_t *&dst, const int *&len_stream,
+                                    uint8_t *match_zone_end, uint8_t *copy_end, size_t last_offset)
+    {
+        uint32_t litlen = LzReadLiteralLength(lit_code, len_stream);
+        if (Bounds::kChecked && !HasLiterals(dst, litlen))
+        {
+            return false;
+        }
+        if (kExact || (litlen > 24 && litlen > copy_end - dst))
+        {
+            if (litlen > match_zone_end - dst)
+            {
+                return false;  // out of bounds
+            }
+            CopyExact(dst, litlen, last_offset);
+        }
+        else
+        {
+            Copy(dst, litlen, last_offset);
+        }
+        return true;
+    }
+
+    template<typename Bounds>
+    __forceinline bool CopyFinalLiterals(size_t final_len, uint8_t *&dst, size_t last_offset, bool nontemporal)
+    {
+        CopyExact(dst, final_len, last_offset);
+        return true;
+    }
+};
+
+
+
+// The recent offsets of a format with |kCount| of them, most recent first at
+// offs[8]. offs[8 + kCount] holds the next explicit offset, so that a command
+// picks it with the same index arithmetic as a recent one.
+template<int kCount>
+struct LzRecentOffsets {
+
+    int32_t offs[16];
+
+    __forceinline LzRecentOffsets()
+    {
+        for (size_t i = 8; i != 16; i++)
+        {
+            offs[i] = -8;
+        }
+    }
+
+    __forceinline void SetNext(int32_t offset)
+    {
+        offs[8 + kCount] = offset;
+    }
+
+    // Returns the offset at |index| and moves it to the front
+    __forceinline int32_t Use(size_t index)
+    {
+        int32_t offset = offs[index + 8];
+        __m128i temp = _mm_loadu_si128((const __m128i *)&offs[index + 4]);
+        _mm_storeu_si128((__m128i *)&offs[index + 1], _mm_loadu_si128((const __m128i *)&offs[index]));
+        _mm_storeu_si128((__m128i *)&offs[index + 5], temp);
+        offs[8] = offset;
+        return offset;
+    }
+};
+
+
+
+// LzEngine_RunCommands()
+//
+// Runs commands until the streams end, or without |kExact| until the output
+// reaches |tail_start|. From before |tail_start| a command's short copies
+// stay clear of |dst_end|, and long ones go exact if they reach its last
+// LZ_COPY_OVERRUN bytes. A match after literals that ran into the tail is
+// also copied exactly.
+template<typename Format, typename Bounds, bool kExact, typename Literals>
+static __forceinline bool LzEngine_RunCommands(LzCommandStreams &s, Literals &lits,
+                                               LzRecentOffsets<Format::kRecentOffsets> &recent, size_t &last_offset,
+                                               uint8_t *&dst, uint8_t *dst_end, uint8_t *tail_start,
+                                               uint8_t *match_zone_end, uint8_t *window_base)
+{
+    uint8_t *copy_end = dst_end - LZ_COPY_OVERRUN;
+
+    while (s.cmd_stream < s.cmd_stream_end && (kExact || dst < tail_start))
+    {
+        uint32_t cmd = *s.cmd_stream++;
+        size_t offs_index = Format::OffsetIndex(cmd);
+
+        recent.SetNext(*s.offs_stream);
+
+        if (!lits.template CopyLiterals<Bounds, kExact>(Format::LiteralCode(cmd), dst, s.len_stream,
+                                                        kExact ? dst_end : match_zone_end, copy_end, last_offset))
+        {
+            return false;
+        }
+        if (Bounds::kChecked && (dst > dst_end || s.len_stream > s.len_stream_end))
+        {
+            return false;
+        }
+
+        last_offset = recent.Use(offs_index);
+        s.offs_stream += offs_index == Format::kRecentOffsets;
+
+        if ((uintptr_t)last_offset < (uintptr_t)(window_base - dst))
+        {
+            return false;  // offset out of bounds
+        }
+
+        if (kExact || dst >= tail_start)
+        {
+            if (!Format::template CopyMatch<true>(cmd, dst, dst + last_offset, s.len_stream, s.len_stream_end, dst_end))
+            {
+                return false;
+            }
+        }
+        else if (!Format::template CopyMatch<false>(cmd, dst, dst + last_offset, s.len_stream, s.len_stream_end, dst_end))
+        {
+            return false;
+        }
+        if (Bounds::kChecked && (dst > dst_end || s.len_stream > s.len_stream_end || s.offs_stream > s.offs_stream_end))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+
+// LzEngine_Process()
+//
+// Runs the commands of one block, each a literal run followed by a match at
+// a recent or explicit offset, then copies the final literals up to
+// |dst_end|. |window_base| is the lowest address a match may read.
+template<typename Format, typename Bounds, typename Literals>
+static __forceinline bool LzEngine_Process(const LzCommandStreams &streams, Literals &lits,
+                                           uint8_t *dst, uint8_t *dst_end, uint8_t *window_base,
+                                           bool nontemporal)
+{
+    LzCommandStreams s = streams;
+    uint8_t *match_zone_end = (dst_end - dst >= Format::kMatchZoneTail) ? dst_end - Format::kMatchZoneTail : dst;
+    uint8_t *tail_start = (dst_end - dst >= SAFE_SPACE) ? dst_end - SAFE_SPACE : dst;
+    LzRecentOffsets<Format::kRecentOffsets> recent;
+    size_t last_offset = -8;
+
+    if (!LzEngine_RunCommands<Format, Bounds, false>(s, lits, recent, last_offset, dst, dst_end, tail_start,
+                                                     match_zone_end, window_base) ||
+        !LzEngine_RunCommands<Format, Bounds, true>(s, lits, recent, last_offset, dst, dst_end, tail_start,
+                                                    match_zone_end, window_base))
+    {
+        return false;
+    }
+
+    // check for incorrect input
+    if (s.offs_stream != s.offs_stream_end || s.len_stream != s.len_stream_end)
+    {
+        return false;
+    }
+
+    // copy final literals
+    if (dst > dst_end)
+    {
+        return false;
+    }
+    size_t final_len = dst_end - dst;
+    if constexpr (Format::kExactLiterals)
+    {
+        if (final_len != (size_t)(lits.lit_stream_end - lits.lit_stream))
+        {
+            return false;
+        }
+    }
+    if (Bounds::kChecked && !lits.HasLiterals(dst, final_len))
+    {
+        return false;
+    }
+    if (final_len != 0)
+    {
+        return lits.template CopyFinalLiterals<Bounds>(final_len, dst, last_offset, nontemporal);
+    }
+    return true;
+}
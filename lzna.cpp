@@ -19,6 +19,8 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "stdafx.h"
 #include "lzna.h"
+#include "utilities.h"
+#include "matchcopy.h"
 
 
 
@@ -123,7 +125,7 @@ static void LznaFarDistModel_Init(LznaFarDistModel *d)
 
 
 
-void LZNA_InitLookup(LznaState *lut)
+static void LznaState_Build(LznaState *lut)
 {
     int i;
 
@@ -163,6 +165,25 @@ void LZNA_InitLookup(LznaState *lut)
 
 
 
+// Decoder restarts copy this snapshot of the initial models instead of
+// running all the small init loops again.
+static const LznaState *LznaState_Initial()
+{
+    static LznaState initial;
+    static const bool built = (LznaState_Build(&initial), true);
+    (void)built;
+    return &initial;
+}
+
+
+
+void LZNA_InitLookup(LznaState *lut)
+{
+    memcpy(lut, LznaState_Initial(), sizeof(LznaState));
+}
+
+
+
 // Initialize bit reader with 2 parallel streams. Every decode operation
 // swaps the two streams.
 static void LznaBitReader_Init(LznaBitReader *tab, const byte *src)
@@ -280,6 +301,90 @@ static uint32_t __forceinline LznaReadNibble(LznaBitReader *tab, LznaNibbleModel
 
 
 
+// Refill one RANS state held in a register. Unlike LznaRenormalize() this
+// does not swap the streams, which lets a caller that reads from both
+// streams keep the two states in registers.
+static uint64_t __forceinline LznaRefill(uint64_t x, const uint32_t **src)
+{
+    if (x < 0x80000000)
+    {
+        x = (x << 32) | *(*src)++;
+    }
+    return x;
+}
+
+
+
+// Decode a 4-bit value from the RANS state |x| without renormalizing.
+// prob[0] is always 0, so prob[1..16] fits in one ymm register and a single
+// compare finds the symbol. prob[16] is the constant 0x8000 which compares
+// as negative; its lane is forced on, which ends the search and turns its
+// update into a no-op ((0x7FD9 + 128 - 0x8000) >> 7 == 0).
+static __attribute__((target("avx2"))) inline uint32_t LznaDecodeNibbleAVX2(uint64_t *px, LznaNibbleModel *model)
+{
+    uint64_t x = *px;
+    uint32_t sym;
+    unsigned int start;
+    unsigned int end;
+    __m256i p;
+    __m256i c;
+
+    p = _mm256_loadu_si256((const __m256i *)&model->prob[1]);
+    c = _mm256_cmpgt_epi16(p, _mm256_set1_epi16(x & 0x7FFF));
+    c = _mm256_or_si256(c, _mm256_setr_epi16(0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, -1));
+
+    sym = __builtin_ctz(_mm256_movemask_epi8(c)) >> 1;
+    start = model->prob[sym];
+    end = model->prob[sym + 1];
+
+    c = _mm256_and_si256(c, _mm256_set1_epi16(0x7FD9));
+    c = _mm256_add_epi16(c, _mm256_setr_epi16(8, 16, 24, 32, 40, 48, 56, 64,
+                                              72, 80, 88, 96, 104, 112, 120, 128));
+    p = _mm256_add_epi16(_mm256_srai_epi16(_mm256_sub_epi16(c, p), 7), p);
+    _mm256_storeu_si256((__m256i *)&model->prob[1], p);
+
+    *px = (end - start) * (x >> 15) + (x & 0x7FFF) - start;
+    return sym;
+}
+
+
+
+// Read a 4-bit value, AVX2 version of LznaReadNibble()
+static __attribute__((target("avx2"))) inline uint32_t LznaReadNibbleAVX2(LznaBitReader *tab, LznaNibbleModel *model)
+{
+    uint64_t x = tab->bits_a;
+    uint32_t sym = LznaDecodeNibbleAVX2(&x, model);
+
+    tab->bits_a = tab->bits_b;
+    tab->bits_b = LznaRefill(x, &tab->src);
+    return sym;
+}
+
+
+
+// Read a literal byte as two nibbles. The high nibble comes from stream a and
+// the low nibble from stream b, so both states are known up front and the
+// two stream swaps cancel out. The low nibble model is |lower| when the high
+// nibble agrees with |match_val|, otherwise |nomatch|.
+static __attribute__((target("avx2"))) inline uint32_t LznaReadLiteralAVX2(LznaBitReader *tab, LznaLiteralModel *model, uint32_t match_val)
+{
+    uint64_t xa = tab->bits_a;
+    uint64_t xb = tab->bits_b;
+    uint32_t hi;
+    uint32_t lo;
+
+    hi = LznaDecodeNibbleAVX2(&xa, &model->upper[match_val >> 4]);
+    xa = LznaRefill(xa, &tab->src);
+    lo = LznaDecodeNibbleAVX2(&xb, (hi != (match_val >> 4)) ? &model->nomatch[hi] : &model->lower[match_val & 0xF]);
+    xb = LznaRefill(xb, &tab->src);
+
+    tab->bits_a = xa;
+    tab->bits_b = xb;
+    return (hi << 4) + lo;
+}
+
+
+
 // Read a 3-bit value using an adaptive RANS model
 static uint32_t __forceinline LznaRead3bit(LznaBitReader *tab, Lzna3bitModel *model)
 {
@@ -430,97 +535,29 @@ static const uint8_t next_state_lit[12] = {
 
 
 
-static void LznaCopyLongDist(byte *dst, size_t dist, size_t length)
-{
-    const byte *src = dst - dist;
-    ((uint64_t*)dst)[0] = ((uint64_t*)src)[0];
-    ((uint64_t*)dst)[1] = ((uint64_t*)src)[1];
-
-    if (length > 16)
-    {
-        do {
-            ((uint64_t*)dst)[2] = ((uint64_t*)src)[2];
-            dst += 8;
-            src += 8;
-            length -= 8;
-        } while (length > 16);
-    }
-}
-
-
-
-static void LznaCopyShortDist(byte *dst, size_t dist, size_t length)
+// Copy a match with the kernel that matches the decode loop's target. A match
+// that reaches past |copy_end| leaves no room for the kernel's overrun and is
+// copied exactly, which fails if it doesn't end by |dst_end|.
+template<bool kAvx2>
+static __forceinline bool LznaCopyMatch(byte *dst, size_t dist, size_t length, const byte *dst_end, const byte *copy_end)
 {
-    const byte *src = dst - dist;
-
-    if (dist >= 4)
+    if ((ptrdiff_t)length > copy_end - dst)
     {
-        ((uint32_t*)dst)[0] = ((uint32_t*)src)[0];
-        ((uint32_t*)dst)[1] = ((uint32_t*)src)[1];
-        ((uint32_t*)dst)[2] = ((uint32_t*)src)[2];
-        if (length > 12)
+        if (length > (size_t)(dst_end - dst))
         {
-            ((uint32_t*)dst)[3] = ((uint32_t*)src)[3];
-            if (length > 16)
-            {
-                do {
-                    ((uint32_t*)dst)[4] = ((uint32_t*)src)[4];
-                    length -= 4;
-                    dst += 4;
-                    src += 4;
-                } while (length > 16);
-            }
+            return false;
         }
+        CopyMatchExact(dst, dist, length);
     }
-    else if (dist == 1)
+    else if constexpr (kAvx2)
     {
-        memset(dst, *src, length);
+        CopyMatchAVX2(dst, dist, length);
     }
     else
     {
-        ((byte*)dst)[0] = ((byte*)src)[0];
-        ((byte*)dst)[1] = ((byte*)src)[1];
-        ((byte*)dst)[2] = ((byte*)src)[2];
-        ((byte*)dst)[3] = ((byte*)src)[3];
-        ((byte*)dst)[4] = ((byte*)src)[4];
-        ((byte*)dst)[5] = ((byte*)src)[5];
-        ((byte*)dst)[6] = ((byte*)src)[6];
-        ((byte*)dst)[7] = ((byte*)src)[7];
-        ((byte*)dst)[8] = ((byte*)src)[8];
-        while (length > 9)
-        {
-            ((byte*)dst)[9] = ((byte*)src)[9];
-            dst += 1;
-            src += 1;
-            length -= 1;
-        }
-    }
-}
-
-
-
-static void LznaCopy4to12(byte *dst, size_t dist, size_t length)
-{
-    const byte *src = dst - dist;
-
-    dst[0] = src[0];
-    dst[1] = src[1];
-    dst[2] = src[2];
-    dst[3] = src[3];
-    if (length > 4)
-    {
-        dst[4] = src[4];
-        dst[5] = src[5];
-        dst[6] = src[6];
-        dst[7] = src[7];
-        if (length > 8)
-        {
-            dst[8] = src[8];
-            dst[9] = src[9];
-            dst[10] = src[10];
-            dst[11] = src[11];
-        }
+        CopyMatchSSE2(dst, dist, length);
     }
+    return true;
 }
 
 
@@ -552,9 +589,13 @@ static void LznaPreprocessMatchHistory(LznaState *lut)
 
 
 
-int LZNA_DecodeQuantum(byte *dst, byte *dst_end, byte *dst_start,
-                       const byte *src_in, const byte *src_end,
-                       LznaState *lut)
+// The body of LZNA_DecodeQuantum(), instantiated once for the SSE2 baseline
+// and once for AVX2. The AVX2 instance is only ever inlined into a
+// target("avx2") function.
+template<bool kAvx2>
+static __forceinline int LznaDecodeQuantum(byte *dst, byte *dst_end, byte *dst_start,
+                                           const byte *src_in, const byte *src_end,
+                                           LznaState *lut)
 {
     LznaBitReader tab;
     uint32_t x;
@@ -563,11 +604,15 @@ int LZNA_DecodeQuantum(byte *dst, byte *dst_end, byte *dst_start,
     uint32_t state;
     uint32_t length;
     uint32_t dist;
+    const byte *copy_end;
 
     LznaPreprocessMatchHistory(lut);
     LznaBitReader_Init(&tab, src_in);
     dist = lut->match_history[4];
 
+    // the last 8 bytes are the final state, the vector match copies stay
+    // MATCHCOPY_OVERRUN bytes clear of the end
+    copy_end = dst_end - MATCHCOPY_OVERRUN;
     state = 5;
     dst_end -= 8;
 
@@ -580,19 +625,37 @@ int LZNA_DecodeQuantum(byte *dst, byte *dst_end, byte *dst_start,
         else
         {
             LznaLiteralModel *model = &lut->literal[0];
-            x = LznaReadNibble(&tab, &model->upper[0]);
-            x = (x << 4) + LznaReadNibble(&tab, (x != 0) ? &model->nomatch[x] : &model->lower[0]);
+            if constexpr (kAvx2)
+            {
+                x = LznaReadLiteralAVX2(&tab, model, 0);
+            }
+            else
+            {
+                x = LznaReadNibble(&tab, &model->upper[0]);
+                x = (x << 4) + LznaReadNibble(&tab, (x != 0) ? &model->nomatch[x] : &model->lower[0]);
+            }
         }
         *dst++ = x;
         dst_offs += 1;
     }
     while (dst < dst_end)
     {
+        if (OOZLIN_FUZZ_SAFE && (const byte *)tab.src > src_end)
+        {
+            return -1;
+        }
         match_val = *(dst - dist);
 
         if (LznaRead1Bit(&tab, &lut->is_literal[(dst_offs & 7) + 8 * state], 13, 5))
         {
-            x = LznaReadNibble(&tab, &lut->type[(dst_offs & 7) + 8 * state]);
+            if constexpr (kAvx2)
+            {
+                x = LznaReadNibbleAVX2(&tab, &lut->type[(dst_offs & 7) + 8 * state]);
+            }
+            else
+            {
+                x = LznaReadNibble(&tab, &lut->type[(dst_offs & 7) + 8 * state]);
+            }
             if (x == 0)
             {
                 // Copy 1 byte from most recent distance
@@ -607,6 +670,10 @@ int LZNA_DecodeQuantum(byte *dst, byte *dst_end, byte *dst_start,
                     // Copy count 3-4
                     length = 3 + LznaRead1Bit(&tab, &lut->short_length[state][dst_offs & 3], 14, 4);
                     dist = LznaReadNearDistance(&tab, lut, &lut->near_dist[length - 3]);
+                    if (OOZLIN_FUZZ_SAFE && dist > dst_offs)
+                    {
+                        return -1;
+                    }
                     dst[0] = (dst - dist)[0];
                     dst[1] = (dst - dist)[1];
                     dst[2] = (dst - dist)[2];
@@ -617,13 +684,13 @@ int LZNA_DecodeQuantum(byte *dst, byte *dst_end, byte *dst_start,
                     // Copy count 5-12
                     length = 5 + LznaRead3bit(&tab, &lut->medium_length);
                     dist = LznaReadFarDistance(&tab, lut);
-                    if (dist >= 8) {
-                        ((uint64_t*)dst)[0] = ((uint64_t*)(dst - dist))[0];
-                        ((uint64_t*)dst)[1] = ((uint64_t*)(dst - dist))[1];
+                    if (OOZLIN_FUZZ_SAFE && dist > dst_offs)
+                    {
+                        return -1;
                     }
-                    else
+                    if (!LznaCopyMatch<kAvx2>(dst, dist, length, dst_end, copy_end))
                     {
-                        LznaCopy4to12(dst, dist, length);
+                        return -1;
                     }
                 }
                 else
@@ -631,13 +698,13 @@ int LZNA_DecodeQuantum(byte *dst, byte *dst_end, byte *dst_start,
                     // Copy count 13-
                     length = LznaReadLength(&tab, &lut->long_length, dst_offs) + 13;
                     dist = LznaReadFarDistance(&tab, lut);
-                    if (dist >= 8)
+                    if (OOZLIN_FUZZ_SAFE && (dist > dst_offs || length > dst_end - dst))
                     {
-                        LznaCopyLongDist(dst, dist, length);
+                        return -1;
                     }
-                    else
+                    if (!LznaCopyMatch<kAvx2>(dst, dist, length, dst_end, copy_end))
                     {
-                        LznaCopyShortDist(dst, dist, length);
+                        return -1;
                     }
                 }
                 state = (state >= 7) ? 10 : 7;
@@ -675,27 +742,22 @@ int LZNA_DecodeQuantum(byte *dst, byte *dst_end, byte *dst_start,
                 {
                     // Copy 11- bytes from recent distance
                     length = 11 + LznaReadLength(&tab, &lut->long_length_recent, dst_offs);
-                    if (dist >= 8)
+                    if (OOZLIN_FUZZ_SAFE && length > dst_end - dst)
                     {
-                        LznaCopyLongDist(dst, dist, length);
+                        return -1;
                     }
-                    else
+                    if (!LznaCopyMatch<kAvx2>(dst, dist, length, dst_end, copy_end))
                     {
-                        LznaCopyShortDist(dst, dist, length);
+                        return -1;
                     }
                 }
                 else
                 {
                     // Copy 3-10 bytes from recent distance
                     length = 3 + LznaRead3bit(&tab, &lut->short_length_recent[idx].a[dst_offs & 3]);
-                    if (dist >= 8)
-                    {
-                        ((uint64_t*)dst)[0] = ((uint64_t*)(dst - dist))[0];
-                        ((uint64_t*)dst)[1] = ((uint64_t*)(dst - dist))[1];
-                    }
-                    else
+                    if (!LznaCopyMatch<kAvx2>(dst, dist, length, dst_end, copy_end))
                     {
-                        LznaCopy4to12(dst, dist, length);
+                        return -1;
                     }
                 }
                 state = (state >= 7) ? 11 : 8;
@@ -707,8 +769,15 @@ int LZNA_DecodeQuantum(byte *dst, byte *dst_end, byte *dst_start,
         {
             // Output a literal
             LznaLiteralModel *model = &lut->literal[dst_offs & 3];
-            x = LznaReadNibble(&tab, &model->upper[match_val >> 4]);
-            x = (x << 4) + LznaReadNibble(&tab, ((match_val >> 4) != x) ? &model->nomatch[x] : &model->lower[match_val & 0xF]);
+            if constexpr (kAvx2)
+            {
+                x = LznaReadLiteralAVX2(&tab, model, match_val);
+            }
+            else
+            {
+                x = LznaReadNibble(&tab, &model->upper[match_val >> 4]);
+                x = (x << 4) + LznaReadNibble(&tab, ((match_val >> 4) != x) ? &model->nomatch[x] : &model->lower[match_val & 0xF]);
+            }
             *dst++ = x;
             dst_offs += 1;
             state = next_state_lit[state];
@@ -727,6 +796,31 @@ int LZNA_DecodeQuantum(byte *dst, byte *dst_end, byte *dst_start,
 
 
 
+// flatten pulls the nibble readers into the target("avx2") function, which
+// always_inline cannot do from the untargeted template.
+static __attribute__((target("avx2"), flatten)) int LznaDecodeQuantumAVX2(byte *dst, byte *dst_end, byte *dst_start,
+                                                                            const byte *src_in, const byte *src_end,
+                                                                            LznaState *lut)
+{
+    return LznaDecodeQuantum<true>(dst, dst_end, dst_start, src_in, src_end, lut);
+}
+
+
+
+// LZNA_DecodeQuantum()
+int LZNA_DecodeQuantum(byte *dst, byte *dst_end, byte *dst_start,
+                       const byte *src_in, const byte *src_end,
+                       LznaState *lut)
+{
+    if (CpuFeatures() & kCpuFeature_AVX2)
+    {
+        return LznaDecodeQuantumAVX2(dst, dst_end, dst_start, src_in, src_end, lut);
+    }
+    return LznaDecodeQuantum<false>(dst, dst_end, dst_start, src_in, src_end, lut);
+}
+
+
+
 // LZNA_ParseWholeMatchInfo()
 const byte *LZNA_ParseWholeMatchInfo(const byte *p, uint32_t *dist)
 {
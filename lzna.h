@@ -111,15 +111,18 @@ static void __forceinline LznaRenormalize(LznaBitReader *tab);
 static uint32_t __forceinline LznaReadBit(LznaBitReader *tab);
 static uint32_t __forceinline LznaReadNBits(LznaBitReader *tab, int bits);
 static uint32_t __forceinline LznaReadNibble(LznaBitReader *tab, LznaNibbleModel *model);
+static uint64_t __forceinline LznaRefill(uint64_t x, const uint32_t **src);
+static __attribute__((target("avx2"))) uint32_t LznaDecodeNibbleAVX2(uint64_t *px, LznaNibbleModel *model);
+static __attribute__((target("avx2"))) uint32_t LznaReadNibbleAVX2(LznaBitReader *tab, LznaNibbleModel *model);
+static __attribute__((target("avx2"))) uint32_t LznaReadLiteralAVX2(LznaBitReader *tab, LznaLiteralModel *model, uint32_t match_val);
 static uint32_t __forceinline LznaRead3bit(LznaBitReader *tab, Lzna3bitModel *model);
 static uint32_t __forceinline LznaRead1Bit(LznaBitReader *tab, LznaBitModel *model, int nbits, int shift);
 static uint32_t __forceinline LznaReadFarDistance(LznaBitReader *tab, LznaState *lut);
 static uint32_t __forceinline LznaReadNearDistance(LznaBitReader *tab, LznaState *lut, LznaNearDistModel *model);
 static uint32_t __forceinline LznaReadLength(LznaBitReader *tab, LznaLongLengthModel *model, int64_t dst_offs);
-static void LznaCopyLongDist(byte *dst, size_t dist, size_t length);
-static void LznaCopyShortDist(byte *dst, size_t dist, size_t length);
-static void LznaCopy4to12(byte *dst, size_t dist, size_t length);
 static void LznaPreprocessMatchHistory(LznaState *lut);
+static __attribute__((target("avx2"))) int LznaDecodeQuantumAVX2(byte *dst, byte *dst_end, byte *dst_start, const byte *src,
+                                                                  const byte *src_end, struct LznaState *lut);
 int LZNA_DecodeQuantum(byte *dst, byte *dst_end, byte *dst_start, const byte *src,
                        const byte *src_end, struct LznaState *lut);
 const byte *LZNA_ParseWholeMatchInfo(const byte *p, uint32_t *dist);
@@ -18,7 +18,12 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "utilities.h"
 #include "kraken.h"
+#include "kraken_enc.h"
+#include "entropy_enc.h"
+#include "matchfinder.h"
 #include "stdafx.h"
+#include <atomic>
+#include <thread>
 
 
 
@@ -26,8 +31,14 @@ bool arg_stdout;
 bool arg_force;
 bool arg_quiet;
 bool arg_dll;
+bool arg_nontemporal;
 int arg_compressor = kCompressor_Kraken;
 int arg_level = 4;
+int arg_space_speed = ENCODE_BYTES_DEFAULT_SPACE_SPEED;
+size_t arg_max_memory = MatchFinder_DefaultMaxMemory();
+int arg_threads = 1;
+bool arg_tune;
+double arg_min_decode;
 char arg_direction;
 char *verifyfolder;
 
@@ -77,6 +88,10 @@ int ParseCmdLine(int argc, char *argv[])
             {
                 arg_dll = true;
                 continue;
+            } else if (!strcmp(s, "nontemporal"))
+            {
+                arg_nontemporal = true;
+                continue;
             } else if (!strcmp(s, "kraken"))
             {
                 s = (char *)"mk";
@@ -102,6 +117,32 @@ int ParseCmdLine(int argc, char *argv[])
                 arg_level = atoi(s + 6);
                 continue;
             }
+            else if (!strncmp(s, "space-speed=", 12))
+            {
+                arg_space_speed = atoi(s + 12);
+                continue;
+            }
+            else if (!strncmp(s, "max-memory=", 11))
+            {
+                arg_max_memory = (size_t)atoi(s + 11) << 20;
+                continue;
+            }
+            else if (!strncmp(s, "threads=", 8))
+            {
+                arg_threads = atoi(s + 8);
+                continue;
+            }
+            else if (!strcmp(s, "tune"))
+            {
+                arg_tune = true;
+                continue;
+            }
+            else if (!strncmp(s, "min-decode=", 11))
+            {
+                arg_min_decode = atof(s + 11);
+                arg_tune = true;
+                continue;
+            }
             else
             {
                 return -1;
@@ -155,9 +196,9 @@ int ParseCmdLine(int argc, char *argv[])
 
 
 // Verify()
-bool Verify(const char *filename, uint8_t *output, int outbytes, const char *curfile)
+bool Verify(const char *filename, uint8_t *output, size_t outbytes, const char *curfile)
 {
-    int test_size;
+    size_t test_size;
     byte *test = load_file(filename, &test_size);
     if (!test)
     {
@@ -166,14 +207,14 @@ bool Verify(const char *filename, uint8_t *output, int outbytes, const char *cur
     }
     if (test_size != outbytes)
     {
-        fprintf(stderr, "%s: ERROR: File size difference: %d vs %d\n", filename, outbytes, test_size);
+        fprintf(stderr, "%s: ERROR: File size difference: %zu vs %zu\n", filename, outbytes, test_size);
         return false;
     }
-    for (int i = 0; i != test_size; i++)
+    for (size_t i = 0; i != test_size; i++)
     {
         if (test[i] != output[i])
         {
-            fprintf(stderr, "%s: ERROR: File difference at 0x%x. Was %d instead of %d\n", curfile, i, output[i], test[i]);
+            fprintf(stderr, "%s: ERROR: File difference at 0x%zx. Was %d instead of %d\n", curfile, i, output[i], test[i]);
             return false;
         }
     }
@@ -183,18 +224,344 @@ bool Verify(const char *filename, uint8_t *output, int outbytes, const char *cur
 
 
 
+// Quanta in a piece the dll compresses on its own, as many as a Leviathan
+// slice
+#define DLL_PIECE_QUANTA 16
+
+
+// Input cut in pieces that threads take in turn. Piece i is written at
+// |dst| + i * |piece_bound|, and squeezed together at the end.
+struct DllPieces {
+    OodleLZ_CompressFunc compress;
+    byte *src;
+    size_t src_size;
+    byte *dst;
+    size_t piece_bound;
+    size_t num_pieces;
+    size_t *piece_sizes;
+    std::atomic<size_t> next_piece;
+    std::atomic<bool> failed;
+};
+
+
+
+// DllPieceBound()
+//
+// Bytes the dll may write for a piece of |size| bytes.
+size_t DllPieceBound(size_t size)
+{
+    return Max(Kraken_CompressBound(size), size + 65536);
+}
+
+
+
+// DllWorker()
+//
+// Compresses pieces until there are none left.
+void DllWorker(DllPieces *p)
+{
+    size_t piece_size = (size_t)DLL_PIECE_QUANTA * KRAKEN_QUANTUM_SIZE;
+
+    for (;;)
+    {
+        size_t i = p->next_piece++;
+        if (i >= p->num_pieces || p->failed)
+        {
+            break;
+        }
+        size_t start = i * piece_size;
+        size_t size = Min(piece_size, p->src_size - start);
+        size_t n = p->compress(arg_compressor, p->src + start, size, p->dst + i * p->piece_bound, arg_level,
+                               0, 0, 0, 0, 0);
+        if ((!n && size) || n > p->piece_bound)
+        {
+            p->failed = true;
+            break;
+        }
+        p->piece_sizes[i] = n;
+    }
+}
+
+
+
+// CompressWithDll()
+//
+// Compresses |src| with the dll in pieces of DLL_PIECE_QUANTA quanta on
+// |threads| threads, or one per core if 0. Each piece is compressed on its
+// own, so it starts a block that resets the decoder and has no matches
+// before it, and the pieces one after another decode as a single stream.
+// The output doesn't depend on the number of threads. |dst| needs
+// DllPieceBound() bytes per piece. Returns the compressed size, or -1 if a
+// piece fails.
+int64_t CompressWithDll(OodleLZ_CompressFunc compress, byte *src, size_t src_size, byte *dst, int threads)
+{
+    size_t piece_size = (size_t)DLL_PIECE_QUANTA * KRAKEN_QUANTUM_SIZE;
+    DllPieces p;
+
+    p.compress = compress;
+    p.src = src;
+    p.src_size = src_size;
+    p.dst = dst;
+    p.piece_bound = DllPieceBound(piece_size);
+    p.num_pieces = Max((src_size + piece_size - 1) / piece_size, 1);
+    p.piece_sizes = new size_t[p.num_pieces];
+    p.next_piece = 0;
+    p.failed = false;
+
+    if (threads <= 0)
+    {
+        threads = (int)std::thread::hardware_concurrency();
+    }
+    threads = (int)Max(Min(threads, p.num_pieces), 1);
+
+    std::thread *workers = new std::thread[threads - 1];
+    for (int i = 0; i != threads - 1; i++)
+    {
+        workers[i] = std::thread(DllWorker, &p);
+    }
+    DllWorker(&p);
+    for (int i = 0; i != threads - 1; i++)
+    {
+        workers[i].join();
+    }
+    delete[] workers;
+
+    int64_t n = 0;
+    if (p.failed)
+    {
+        n = -1;
+    }
+    else
+    {
+        for (size_t i = 0; i != p.num_pieces; i++)
+        {
+            memmove(dst + n, dst + i * p.piece_bound, p.piece_sizes[i]);
+            n += p.piece_sizes[i];
+        }
+    }
+    delete[] p.piece_sizes;
+    return n;
+}
+
+
+
+// Seconds()
+double Seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+
+
+// Quanta of the input the tuner compresses, taken from evenly spread places
+#define TUNE_SAMPLE_QUANTA 8
+
+// Seconds the tuner decodes each setting for, at least twice
+#define TUNE_DECODE_SECONDS 0.1
+
+// Inputs smaller than this decode too fast to time and are not tuned
+#define TUNE_MIN_SIZE 4096
+
+// The codecs the tuner tries, those with a native encoder
+static const struct {
+    int compressor;
+    const char *name;
+} kTuneCodecs[] = {
+    { kCompressor_Kraken,    "kraken" },
+    { kCompressor_Mermaid,   "mermaid" },
+    { kCompressor_Selkie,    "selkie" },
+    { kCompressor_Leviathan, "leviathan" },
+};
+
+
+// A codec and level the tuner tried
+struct TuneResult {
+    int codec;
+    int level;
+    int size;
+    double compress_speed;
+    double decode_speed;
+    bool pareto;
+};
+
+
+
+// TuneSetting()
+//
+// Compresses |sample| with |codec| at |level| and decodes it until
+// TUNE_DECODE_SECONDS have passed, keeping the best decode speed in MB/s.
+// Returns false if either fails or the decode is too fast to time.
+bool TuneSetting(const byte *sample, size_t sample_size, int codec, int level, TuneResult *r)
+{
+    byte *comp = new byte[Kraken_CompressBound(sample_size) + SAFE_SPACE];
+    byte *dec = new byte[sample_size];
+    bool ok = false;
+
+    double start = Seconds();
+    int n = Kraken_Compress(kTuneCodecs[codec].compressor, sample, sample_size, comp, level, arg_space_speed,
+                            arg_max_memory);
+    double t = Seconds() - start;
+    if (n >= 0)
+    {
+        memset(comp + n, 0, SAFE_SPACE);
+        r->codec = codec;
+        r->level = level;
+        r->size = n;
+        r->compress_speed = sample_size * 1e-6 / t;
+        r->decode_speed = 0;
+
+        double best = 1e30;
+        double total = 0;
+        ok = true;
+        for (int reps = 0; ok && (reps < 2 || total < TUNE_DECODE_SECONDS); reps++)
+        {
+            start = Seconds();
+            ok = Kraken_Decompress(comp, n, dec, sample_size, false) == (int)sample_size &&
+                 !memcmp(dec, sample, sample_size);
+            t = Seconds() - start;
+            if (t < best)
+            {
+                best = t;
+            }
+            total += t;
+        }
+        ok = ok && best > 0;
+        r->decode_speed = ok ? sample_size * 1e-6 / best : 0;
+    }
+    delete[] comp;
+    delete[] dec;
+    return ok;
+}
+
+
+
+// Tune()
+//
+// Tries every native codec at levels 1 to 9 on a sample of |input|, prints
+// them with the ones no other setting beats on both size and decode speed
+// marked, and picks one: the smallest that decodes at |min_decode| MB/s or
+// more if that is set, otherwise the smallest counting --space-speed bytes
+// for every microsecond of decoding, as the encoders weigh their choices.
+// Sets |compressor| and |level| to the pick, or returns false if there is
+// none. An input under TUNE_MIN_SIZE bytes keeps them as they are.
+bool Tune(const char *filename, const byte *input, size_t input_size, double min_decode, int *compressor,
+          int *level)
+{
+    if (input_size < TUNE_MIN_SIZE)
+    {
+        fprintf(stderr, "%s: too small to tune, %zu bytes\n", filename, input_size);
+        return true;
+    }
+
+    // The whole input if it is small, else quanta spread over it
+    size_t sample_size = Min(input_size, (size_t)TUNE_SAMPLE_QUANTA * KRAKEN_QUANTUM_SIZE);
+    byte *sample = new byte[sample_size];
+    if (sample_size < input_size)
+    {
+        for (size_t i = 0; i != TUNE_SAMPLE_QUANTA; i++)
+        {
+            size_t from = (input_size - KRAKEN_QUANTUM_SIZE) / (TUNE_SAMPLE_QUANTA - 1) * i;
+            memcpy(sample + i * KRAKEN_QUANTUM_SIZE, input + from, KRAKEN_QUANTUM_SIZE);
+        }
+    }
+    else
+    {
+        memcpy(sample, input, sample_size);
+    }
+
+    const int num_codecs = sizeof(kTuneCodecs) / sizeof(kTuneCodecs[0]);
+    TuneResult results[num_codecs * 9];
+    int num_results = 0;
+
+    fprintf(stderr, "%s: tuning on %zu bytes\n", filename, sample_size);
+    for (int codec = 0; codec != num_codecs; codec++)
+    {
+        for (int l = 1; l <= 9; l++)
+        {
+            if (TuneSetting(sample, sample_size, codec, l, &results[num_results]))
+            {
+                num_results++;
+            }
+        }
+    }
+    delete[] sample;
+
+    // A setting is on the frontier if nothing else is as small and decodes
+    // as fast, and strictly better on one of them
+    for (int i = 0; i != num_results; i++)
+    {
+        TuneResult *r = &results[i];
+        r->pareto = true;
+        for (int j = 0; j != num_results && r->pareto; j++)
+        {
+            const TuneResult *o = &results[j];
+            if (o->size <= r->size && o->decode_speed >= r->decode_speed &&
+                (o->size < r->size || o->decode_speed > r->decode_speed))
+            {
+                r->pareto = false;
+            }
+        }
+    }
+
+    int pick = -1;
+    for (int i = 0; i != num_results; i++)
+    {
+        const TuneResult *r = &results[i];
+        if (min_decode > 0)
+        {
+            if (r->decode_speed >= min_decode && (pick < 0 || r->size < results[pick].size))
+            {
+                pick = i;
+            }
+        }
+        else
+        {
+            double cost = r->size + arg_space_speed * sample_size / r->decode_speed;
+            if (pick < 0 || cost < results[pick].size + arg_space_speed * sample_size / results[pick].decode_speed)
+            {
+                pick = i;
+            }
+        }
+    }
+
+    fprintf(stderr, "  codec      level      size   ratio  comp MB/s   dec MB/s\n");
+    for (int i = 0; i != num_results; i++)
+    {
+        const TuneResult *r = &results[i];
+        fprintf(stderr, "%c %-10s %5d %9d %7.3f %10.2f %10.1f%s\n", (i == pick) ? '>' : ' ',
+                kTuneCodecs[r->codec].name, r->level, r->size, (double)r->size / sample_size, r->compress_speed,
+                r->decode_speed, r->pareto ? "  *" : "");
+    }
+    if (pick < 0)
+    {
+        fprintf(stderr, "%s: no setting decodes at %.1f MB/s\n", filename, min_decode);
+        return false;
+    }
+    fprintf(stderr, "%s: picked --%s -%d\n", filename, kTuneCodecs[results[pick].codec].name, results[pick].level);
+    *compressor = kTuneCodecs[results[pick].codec].compressor;
+    *level = results[pick].level;
+    return true;
+}
+
+
+
+
 // Main
 int main(int argc, char *argv[])
 {
 
     void *oodleLib;
-    clock_t start;
-    clock_t end;
+    double start;
+    double end;
     int argi;
 
     if (argc < 2 || (argi = ParseCmdLine(argc, argv)) < 0 ||
         argi >= argc ||                                         // no files
-        arg_direction != 'b' && (argc - argi) > 2 ||            // too many files
+        arg_direction != 'b' && (arg_direction == 'z' || !arg_tune) &&
+        (argc - argi) > 2 ||                                    // too many files
         arg_direction == 't' && (argc - argi) != 2              // missing argument for verify
         )
     {
@@ -202,21 +569,36 @@ int main(int argc, char *argv[])
         "Usage: oozlin [options] input [output]\n"
         " -c --stdout              write to stdout\n"
         " -d --decompress          decompress (default)\n"
-        " -z --compress            compress (requires oo2ext_7_win64.dll)\n"
+        " -z --compress            compress (Hydra needs oo2ext_7_win64.dll)\n"
         " -b                       just benchmark, don't overwrite anything\n"
         " -f                       force overwrite existing file\n"
-        " --dll                    decompress with the dll\n"
+        " --dll                    compress or decompress with the dll\n"
+        " --nontemporal            bypass the cache for output writes (huge files)\n"
         " --verify                 decompress and verify that it matches output\n"
         " --verify=<folder>        verify with files in this folder\n"
         " -<1-9> --level=<-4..10>  compression level\n"
+        " --space-speed=<bytes>    bytes of output a microsecond of decode time is\n"
+        "                          worth to the native encoders (%d)\n"
+        " --max-memory=<MB>        memory of the native match finders, 0 for what\n"
+        "                          the level asks for (%d)\n"
+        " --threads=<n>            compress with the dll in 4 MB pieces on n\n"
+        "                          threads, 0 for one per core (1)\n"
+        " --tune                   try the native codecs and levels on a sample and\n"
+        "                          show size against decode speed, with -z compress\n"
+        "                          with the pick\n"
+        " --min-decode=<MB/s>      make --tune pick the smallest setting that decodes\n"
+        "                          this fast\n"
         " -m<k>                    [k|m|s|l|h] compressor selection\n"
         " --kraken --mermaid --selkie --leviathan --hydra    compressor selection\n\n"
-        "(Warning! not fuzz safe, so please trust the input)\n"
+        "%s\n", ENCODE_BYTES_DEFAULT_SPACE_SPEED, (int)(MatchFinder_DefaultMaxMemory() >> 20),
+        OOZLIN_FUZZ_SAFE ? "(Fuzz safe build)" : "(Warning! not fuzz safe, so please trust the input)"
         );
         return 1;
     }
 
-    bool write_mode = (argi + 1 < argc) && (arg_direction != 't' && arg_direction != 'b');
+    // --tune without -z only reports
+    bool tune_only = arg_tune && arg_direction != 'z';
+    bool write_mode = (argi + 1 < argc) && (arg_direction != 't' && arg_direction != 'b') && !tune_only;
 
     if (!arg_force && write_mode)
     {
@@ -231,26 +613,33 @@ int main(int argc, char *argv[])
 
     int nverify = 0;
 
-    // load linoodle lib
-    oodleLib = dlopen("libs/liblinoodle.so", RTLD_LAZY);
-    if (oodleLib == nullptr)
+    // The linoodle lib is only needed with --dll, or to compress with a codec
+    // that has no native encoder
+    OodleLZ_CompressFunc OodLZ_Compress = NULL;
+    OodleLZ_DecompressFunc OodLZ_Decompress = NULL;
+    if (arg_dll || (arg_direction == 'z' && !Kraken_HasEncoder(arg_compressor)))
     {
-        fprintf(stderr, "Can't load library: %s\n", dlerror());
-    }
-    else
-    {
-        fprintf(stdout, "Library is loaded..\n");
-    }
+        // load linoodle lib
+        oodleLib = dlopen("libs/liblinoodle.so", RTLD_LAZY);
+        if (oodleLib == nullptr)
+        {
+            fprintf(stderr, "Can't load library: %s\n", dlerror());
+        }
+        else
+        {
+            fprintf(stdout, "Library is loaded..\n");
+        }
 
-    // reset errors
-    dlerror();
+        // reset errors
+        dlerror();
 
-    // load symbols
-    auto OodLZ_Compress   = reinterpret_cast<OodleLZ_CompressFunc>(dlsym(oodleLib, "OodleLZ_Compress"));
-    auto OodLZ_Decompress = reinterpret_cast<OodleLZ_DecompressFunc>(dlsym(oodleLib, "OodleLZ_Decompress"));
-    if (!OodLZ_Compress || !OodLZ_Decompress)
-    {
-        error("error loading", LIBNAME);
+        // load symbols
+        OodLZ_Compress   = reinterpret_cast<OodleLZ_CompressFunc>(dlsym(oodleLib, "OodleLZ_Compress"));
+        OodLZ_Decompress = reinterpret_cast<OodleLZ_DecompressFunc>(dlsym(oodleLib, "OodleLZ_Decompress"));
+        if (!OodLZ_Compress || !OodLZ_Decompress)
+        {
+            error("error loading", LIBNAME);
+        }
     }
 
 
@@ -258,35 +647,80 @@ int main(int argc, char *argv[])
     {
         const char *curfile = argv[argi];
 
-        int input_size;
+        size_t input_size;
         byte *input = load_file(curfile, &input_size);
 
         byte *output = NULL;
         size_t outbytes = 0;
 
+        if (arg_tune)
+        {
+            bool picked = Tune(curfile, input, input_size, arg_min_decode, &arg_compressor, &arg_level);
+            if (tune_only)
+            {
+                delete[] input;
+                continue;
+            }
+            if (!picked)
+            {
+                return 1;
+            }
+        }
 
         if (arg_direction == 'z')
         {
-            // compress using the .so wrapped dll
-            output = new byte[input_size + 65536];
+            bool pieces = OodLZ_Compress && arg_threads != 1;
+            size_t piece_size = (size_t)DLL_PIECE_QUANTA * KRAKEN_QUANTUM_SIZE;
+            size_t bound = pieces ? DllPieceBound(piece_size) * Max((input_size + piece_size - 1) / piece_size, 1)
+                                  : DllPieceBound(input_size);
+            output = new byte[bound + 8];
             if (!output)
             {
                 error("memory error", curfile);
             }
             *(uint64*)output = input_size;
-            start = clock();
-            outbytes = OodLZ_Compress(arg_compressor, input, input_size,
-                                      output + 8, arg_level, 0, 0, 0, 0, 0);
-            if (outbytes < 0)
+            start = Seconds();
+            if (pieces)
             {
-                error("compress failed", curfile);
+                int64_t n = CompressWithDll(OodLZ_Compress, input, input_size, output + 8, arg_threads);
+                if (n < 0)
+                {
+                    error("compress failed", curfile);
+                }
+                outbytes = n;
+            }
+            else if (OodLZ_Compress)
+            {
+                // compress using the .so wrapped dll, which returns 0 or -1
+                // when it fails
+                int64_t n = (int64_t)OodLZ_Compress(arg_compressor, input, input_size,
+                                                    output + 8, arg_level, 0, 0, 0, 0, 0);
+                if (n < 0 || (n == 0 && input_size))
+                {
+                    error("compress failed", curfile);
+                }
+                outbytes = n;
+            }
+            else
+            {
+                if (input_size > KRAKEN_MAX_COMPRESS_SIZE)
+                {
+                    error("too large for the native encoders, use --dll", curfile);
+                }
+                int n = Kraken_Compress(arg_compressor, input, input_size, output + 8, arg_level, arg_space_speed,
+                                        arg_max_memory);
+                if (n < 0)
+                {
+                    error("compress failed", curfile);
+                }
+                outbytes = n;
             }
             outbytes += 8;
-            end = clock();
-            double seconds = (double)(end - start) / (int64_t)CLOCKS_PER_SEC;
+            end = Seconds();
+            double seconds = end - start;
             if (!arg_quiet)
             {
-                fprintf(stderr, "%-20s: %8d => %8ld (%.6f seconds, %.6f MB/s)\n",
+                fprintf(stderr, "%-20s: %8zu => %8zu (%.6f seconds, %.6f MB/s)\n",
                         argv[argi], input_size, outbytes, seconds,
                         (input_size * 1e-6) / seconds);
             }
@@ -303,21 +737,21 @@ int main(int argc, char *argv[])
                 error("file too large", curfile);
             }
 
-            output = new byte[unpacked_size + SAFE_SPACE];
+            output = new byte[unpacked_size];
 
             if (!output)
             {
                 error("memory error", curfile);
             }
 
-            start = clock();
+            start = Seconds();
             if (arg_dll)
             {
                 outbytes = OodLZ_Decompress(input + hdrsize, input_size - hdrsize, output, unpacked_size, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
             }
             else
             {
-                outbytes = Kraken_Decompress(input + hdrsize, input_size - hdrsize, output, unpacked_size);
+                outbytes = Kraken_Decompress(input + hdrsize, input_size - hdrsize, output, unpacked_size, arg_nontemporal);
             }
 
             if (outbytes != unpacked_size)
@@ -325,11 +759,11 @@ int main(int argc, char *argv[])
                 error("decompress error", curfile);
             }
 
-            end = clock();
-            double seconds = (double)(end - start) / (int64_t)CLOCKS_PER_SEC;
+            end = Seconds();
+            double seconds = end - start;
             if (!arg_quiet)
             {
-                fprintf(stderr, "%-20s: %8d => %8lld (%.6f seconds, %.6f MB/s)\n",
+                fprintf(stderr, "%-20s: %8zu => %8lld (%.6f seconds, %.6f MB/s)\n",
                         argv[argi], input_size, unpacked_size, seconds,
                         (unpacked_size * (float)1e-6) / seconds);
             }
@@ -0,0 +1,156 @@
+/*
+------------------------------------------------------------------------------
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+------------------------------------------------------------------------------
+*/
+
+
+#include "stdafx.h"
+
+
+// LZ match copies: |length| bytes from |dst| - |dist| to |dst|, where a
+// distance below the length repeats the last |dist| bytes. The kernels
+// work in whole vectors and may write up to MATCHCOPY_OVERRUN bytes past
+// |dst| + |length|. Matches that end closer than that to the end of the
+// output go through CopyMatchExact() instead.
+#define MATCHCOPY_OVERRUN 32
+
+// kMatchCopyShuffle[d][i] = i % d, for both 16 byte lanes of a pshufb
+extern const uint8_t kMatchCopyShuffle[16][32];
+// kMatchCopyStride16[d] and kMatchCopyStride32[d] are the largest multiple
+// of d that fits in 16 and 32 bytes
+extern const uint8_t kMatchCopyStride16[16];
+extern const uint8_t kMatchCopyStride32[16];
+
+
+
+// CopyMatchSSE2()
+//
+// Baseline kernel. Distances of 32 and up copy forward in 16 byte steps,
+// each step only reading bytes that are already final. With a shorter
+// distance every such load would straddle the stores just made, so one
+// period is kept in registers and stored at multiples of the period.
+static __forceinline void CopyMatchSSE2(byte *dst, size_t dist, size_t length)
+{
+    const byte *src = dst - dist;
+    byte *end = dst + length;
+
+    if (dist >= 32)
+    {
+        do {
+            _mm_storeu_si128((__m128i *)dst, _mm_loadu_si128((const __m128i *)src));
+            dst += 16;
+            src += 16;
+        } while (dst < end);
+    }
+    else if (dist >= 16)
+    {
+        // The second half of the period reads up to 16 bytes of output,
+        // which the first store provides
+        __m128i lo = _mm_loadu_si128((const __m128i *)src);
+        _mm_storeu_si128((__m128i *)dst, lo);
+        if (length > 16)
+        {
+            __m128i hi = _mm_loadu_si128((const __m128i *)(src + 16));
+            do {
+                _mm_storeu_si128((__m128i *)dst, lo);
+                _mm_storeu_si128((__m128i *)(dst + 16), hi);
+                dst += dist;
+            } while (dst < end);
+        }
+    }
+    else
+    {
+        // Write the first 16 bytes in steps no longer than the distance, then
+        // repeat them as a vector for longer matches
+        if (dist >= 8)
+        {
+            _mm_storel_epi64((__m128i *)dst, _mm_loadl_epi64((const __m128i *)src));
+            _mm_storel_epi64((__m128i *)(dst + 8), _mm_loadl_epi64((const __m128i *)(src + 8)));
+        }
+        else
+        {
+            for (int i = 0; i < 16; i++)
+            {
+                dst[i] = src[i];
+            }
+        }
+        if (length > 16)
+        {
+            __m128i pattern = _mm_loadu_si128((const __m128i *)dst);
+            size_t stride = kMatchCopyStride16[dist];
+            do {
+                dst += stride;
+                _mm_storeu_si128((__m128i *)dst, pattern);
+            } while (dst + 16 < end);
+        }
+    }
+}
+
+
+
+// CopyMatchAVX2()
+//
+// Same as CopyMatchSSE2(), except that long matches copy 32 bytes per step
+// and a distance below 16 builds its 32 byte pattern with pshufb. Matches of
+// up to 16 bytes stay on the SSE2 path, whose small loads forward from the
+// stores of the previous token.
+static __attribute__((target("avx2"))) inline void CopyMatchAVX2(byte *dst, size_t dist, size_t length)
+{
+    const byte *src = dst - dist;
+    byte *end = dst + length;
+
+    if (dist >= 64)
+    {
+        do {
+            _mm256_storeu_si256((__m256i *)dst, _mm256_loadu_si256((const __m256i *)src));
+            dst += 32;
+            src += 32;
+        } while (dst < end);
+    }
+    else if (dist < 16 && length > 16)
+    {
+        __m256i pattern;
+        size_t stride = kMatchCopyStride32[dist];
+
+        pattern = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)src));
+        pattern = _mm256_shuffle_epi8(pattern, _mm256_loadu_si256((const __m256i *)kMatchCopyShuffle[dist]));
+        do {
+            _mm256_storeu_si256((__m256i *)dst, pattern);
+            dst += stride;
+        } while (dst < end);
+    }
+    else
+    {
+        CopyMatchSSE2(dst, dist, length);
+    }
+}
+
+
+
+// CopyMatchExact()
+//
+// One byte at a time, so nothing past |dst| + |length| is written.
+static __forceinline void CopyMatchExact(byte *dst, size_t dist, size_t length)
+{
+    for (size_t i = 0; i != length; i++)
+    {
+        dst[i] = dst[i - dist];
+    }
+}
+
+
+
+// Prototypes
+void CopyMatch(byte *dst, size_t dist, size_t length);
@@ -0,0 +1,589 @@
+/*
+------------------------------------------------------------------------------
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+------------------------------------------------------------------------------
+*/
+
+#include "matchfinder.h"
+#include "suffixarray.h"
+#include "utilities.h"
+#include "kraken.h"
+#include <unistd.h>
+
+
+
+// MatchFinder_DefaultMaxMemory()
+//
+// Half the machine's memory, at least MATCHFINDER_DEFAULT_MAX_MEMORY. That
+// fits every level's finder at full size, so it only sets how many
+// Leviathan threads run, never the output.
+size_t MatchFinder_DefaultMaxMemory()
+{
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long page_size = sysconf(_SC_PAGESIZE);
+
+    if (pages <= 0 || page_size <= 0)
+    {
+        return MATCHFINDER_DEFAULT_MAX_MEMORY;
+    }
+    return Max((size_t)pages * page_size / 2, MATCHFINDER_DEFAULT_MAX_MEMORY);
+}
+
+
+
+// MatchFinder_FitSizes()
+//
+// Caps the window to the input, then shrinks the larger of the window and
+// the hash table until the match finder takes at most |max_memory| bytes,
+// or 0 for no limit. A suffix array's block shrinks with its window, down
+// to 16 KB each. Returns the bytes it takes.
+size_t MatchFinder_FitSizes(size_t src_size, int type, int max_chain, size_t max_memory,
+                            int *hash_bits, int *window_bits)
+{
+    size_t ways = (type == kMatchFinder_Hash) ? max_chain : (type == kMatchFinder_SuffixArray) ? 0 : 1;
+    size_t nodes = (type == kMatchFinder_Hash) ? 0 : (type == kMatchFinder_Chain) ? 1 : 2;
+
+    while (*window_bits > 12 && ((size_t)1 << (*window_bits - 1)) >= src_size)
+    {
+        (*window_bits)--;
+    }
+    for (;;)
+    {
+        size_t head_size = (sizeof(uint32_t) * ways) << *hash_bits;
+        size_t node_size = (sizeof(uint32_t) * nodes) << *window_bits;
+
+        // The four range arrays of a block and its window, which the sort's
+        // scratch fits in
+        if (type == kMatchFinder_SuffixArray)
+        {
+            size_t n = ((size_t)1 << *window_bits) + Min((size_t)1 << *window_bits, MATCHFINDER_SA_BLOCK_SIZE) + 1;
+            node_size = 2 * sizeof(int32_t) * n + Max(2 * sizeof(int32_t) * n, SUFFIXARRAY_WORK_SIZE(n));
+        }
+
+        if (!max_memory || head_size + node_size <= max_memory)
+        {
+            return head_size + node_size;
+        }
+        if (node_size > head_size && *window_bits > (type == kMatchFinder_SuffixArray ? 14 : 16))
+        {
+            (*window_bits)--;
+        }
+        else if (*hash_bits > 12)
+        {
+            (*hash_bits)--;
+        }
+        else
+        {
+            return head_size + node_size;  // as small as it goes
+        }
+    }
+}
+
+
+
+// MatchFinder_Init()
+//
+// Sets up a match finder of |type| over |src|, sized by
+// MatchFinder_FitSizes(). For kMatchFinder_Hash |max_chain| is the number of
+// positions a bucket holds.
+bool MatchFinder_Init(MatchFinder *mf, const uint8_t *src, size_t src_size, int type,
+                      int hash_bits, int window_bits, int max_chain, int nice_len, size_t max_memory)
+{
+    MatchFinder_FitSizes(src_size, type, max_chain, max_memory, &hash_bits, &window_bits);
+
+    mf->src = src;
+    mf->src_size = src_size;
+    mf->type = type;
+    mf->hash_bits = hash_bits;
+    mf->window_mask = (1u << window_bits) - 1;
+    mf->max_chain = max_chain;
+    mf->nice_len = nice_len;
+    mf->next_insert = 0;
+    mf->head = NULL;
+    mf->chain = NULL;
+    mf->tree = NULL;
+    mf->sa_parent = NULL;
+    mf->sa_leaf = NULL;
+    mf->sa_len = NULL;
+    mf->sa_last = NULL;
+    mf->sa_block = Min((size_t)1 << window_bits, MATCHFINDER_SA_BLOCK_SIZE);
+    mf->sa_start = 0;
+    mf->sa_end = 0;
+    mf->sa_next = 0;
+
+    if (type == kMatchFinder_SuffixArray)
+    {
+        size_t n = ((size_t)1 << window_bits) + mf->sa_block + 1;
+        mf->sa_parent = (int32_t *)malloc(sizeof(int32_t) * n);
+        mf->sa_leaf = (int32_t *)malloc(sizeof(int32_t) * n);
+        mf->sa_len = (int32_t *)malloc(Max(2 * sizeof(int32_t) * n, SUFFIXARRAY_WORK_SIZE(n)));
+        if (!mf->sa_parent || !mf->sa_leaf || !mf->sa_len)
+        {
+            MatchFinder_Free(mf);
+            return false;
+        }
+        mf->sa_last = mf->sa_len + n;
+        return true;
+    }
+
+    mf->head = (uint32_t *)malloc((sizeof(uint32_t) * (type == kMatchFinder_Hash ? max_chain : 1)) << hash_bits);
+    mf->chain = (type == kMatchFinder_Chain) ? (uint32_t *)malloc(sizeof(uint32_t) << window_bits) : NULL;
+    mf->tree = (type == kMatchFinder_Tree) ? (uint32_t *)malloc((2 * sizeof(uint32_t)) << window_bits) : NULL;
+    if (!mf->head || (type == kMatchFinder_Chain && !mf->chain) || (type == kMatchFinder_Tree && !mf->tree))
+    {
+        MatchFinder_Free(mf);
+        return false;
+    }
+    MatchFinder_Reset(mf, 0);
+    return true;
+}
+
+
+
+// MatchFinder_Free()
+void MatchFinder_Free(MatchFinder *mf)
+{
+    free(mf->head);
+    free(mf->chain);
+    free(mf->tree);
+    free(mf->sa_parent);
+    free(mf->sa_leaf);
+    free(mf->sa_len);
+    mf->head = NULL;
+    mf->chain = NULL;
+    mf->tree = NULL;
+    mf->sa_parent = NULL;
+    mf->sa_leaf = NULL;
+    mf->sa_len = NULL;
+    mf->sa_last = NULL;
+}
+
+
+
+// MatchFinder_Reset()
+//
+// Empties the match finder and starts inserting from |pos|, so that a
+// search can begin anywhere in the input after the positions of one window
+// before it are inserted again. A suffix array finder drops its block and
+// sorts it again at the next search.
+void MatchFinder_Reset(MatchFinder *mf, size_t pos)
+{
+    if (mf->type == kMatchFinder_SuffixArray)
+    {
+        mf->sa_end = 0;
+        return;
+    }
+    memset(mf->head, 0xFF, (sizeof(uint32_t) * (mf->type == kMatchFinder_Hash ? mf->max_chain : 1)) << mf->hash_bits);
+    mf->next_insert = pos;
+}
+
+
+
+// MatchFinder_TreeWalk()
+//
+// Inserts |pos| at the root of its tree. Walking down, the nodes that sort
+// lower than |pos| go to its left and the others to its right, and the
+// matches on the way that are at least |min_dist| back go to |matches| the
+// way MatchFinder_FindMatches() returns them, if it isn't NULL. Lengths are
+// compared up to nice_len, a node that matches that far is replaced by
+// |pos|, and the walk returns true.
+static bool MatchFinder_TreeWalk(MatchFinder *mf, size_t pos, size_t end, size_t min_dist,
+                                 MatchFinderMatch *matches, int max_matches, int *num_matches)
+{
+    const uint8_t *src = mf->src;
+    size_t limit = Min(mf->src_size - pos, (size_t)mf->nice_len);
+    size_t max_len = end - pos;
+    size_t best_len = MATCHFINDER_MIN_MATCH - 1;
+    bool nice = false;
+    int n = 0;
+
+    uint32_t *bucket = &mf->head[MatchFinder_Hash(src + pos, mf->hash_bits)];
+    uint32_t cur = *bucket;
+    *bucket = (uint32_t)pos;
+
+    // Where the next node lower and higher than |pos| go, and how many bytes
+    // every node on that side is known to share with it
+    uint32_t *left = &mf->tree[2 * (pos & mf->window_mask)];
+    uint32_t *right = left + 1;
+    size_t left_len = 0;
+    size_t right_len = 0;
+
+    for (int depth = mf->max_chain;; depth--)
+    {
+        size_t d = pos - cur;
+        if (cur == MATCHFINDER_NIL || d > mf->window_mask || !depth)
+        {
+            *left = *right = MATCHFINDER_NIL;
+            break;
+        }
+
+        uint32_t *node = &mf->tree[2 * (cur & mf->window_mask)];
+        size_t len = Min(left_len, right_len);
+        len += MatchLength(src + pos + len, src + cur + len, src + pos + limit);
+
+        if (matches && d >= min_dist && Min(len, max_len) > best_len)
+        {
+            best_len = Min(len, max_len);
+            if (n == max_matches)
+            {
+                n--;
+            }
+            matches[n].len = (uint32_t)best_len;
+            matches[n].dist = (uint32_t)d;
+            n++;
+        }
+
+        if (len >= limit)
+        {
+            *left = node[0];
+            *right = node[1];
+            nice = (limit == (size_t)mf->nice_len);
+            break;
+        }
+        if (src[cur + len] < src[pos + len])
+        {
+            *left = cur;
+            left = &node[1];
+            left_len = len;
+            cur = node[1];
+        }
+        else
+        {
+            *right = cur;
+            right = &node[0];
+            right_len = len;
+            cur = node[0];
+        }
+    }
+
+    // The walk stops comparing at nice_len, the longest may go on
+    if (n && best_len == limit && best_len < max_len)
+    {
+        uint32_t d = matches[n - 1].dist;
+        matches[n - 1].len = (uint32_t)MatchLength(src + pos, src + pos - d, src + end);
+    }
+    if (num_matches)
+    {
+        *num_matches = n;
+    }
+    return nice;
+}
+
+
+
+// MatchFinder_InsertUpTo()
+//
+// Inserts the positions before |pos| that aren't inserted yet.
+void MatchFinder_InsertUpTo(MatchFinder *mf, size_t pos)
+{
+    size_t end = Min(pos, mf->src_size >= MATCHFINDER_MIN_MATCH ? mf->src_size - MATCHFINDER_MIN_MATCH + 1 : 0);
+
+    if (mf->type == kMatchFinder_Hash)
+    {
+        int ways = mf->max_chain;
+        for (size_t p = mf->next_insert; p < end; p++)
+        {
+            uint32_t *bucket = &mf->head[(size_t)MatchFinder_Hash(mf->src + p, mf->hash_bits) * ways];
+            for (int k = ways - 1; k > 0; k--)
+            {
+                bucket[k] = bucket[k - 1];
+            }
+            bucket[0] = (uint32_t)p;
+        }
+    }
+    else if (mf->type == kMatchFinder_Chain)
+    {
+        for (size_t p = mf->next_insert; p < end; p++)
+        {
+            uint32_t h = MatchFinder_Hash(mf->src + p, mf->hash_bits);
+            mf->chain[p & mf->window_mask] = mf->head[h];
+            mf->head[h] = (uint32_t)p;
+        }
+    }
+    else if (mf->type == kMatchFinder_Tree)
+    {
+        // Inside a long repeat the next positions would only find the same
+        // match a byte shorter, so a quarter of nice_len of them are left out
+        for (size_t p = mf->next_insert; p < end; p++)
+        {
+            if (MatchFinder_TreeWalk(mf, p, p, 0, NULL, 0, NULL))
+            {
+                p += mf->nice_len / 4;
+            }
+        }
+    }
+    if (pos > mf->next_insert)
+    {
+        mf->next_insert = pos;
+    }
+}
+
+
+
+// MatchFinder_SortBlock()
+//
+// Sorts the suffixes of the block |pos| is in and the window before it and
+// builds the tree of their ranges, with shared lengths up to nice_len.
+// Returns false if memory runs out.
+static bool MatchFinder_SortBlock(MatchFinder *mf, size_t pos)
+{
+    size_t block = pos - pos % mf->sa_block;
+    size_t window = (size_t)mf->window_mask + 1;
+
+    mf->sa_start = block > window ? block - window : 0;
+    mf->sa_end = Min(block + mf->sa_block, mf->src_size);
+    mf->sa_next = mf->sa_start;
+
+    int n = (int)(mf->sa_end - mf->sa_start);
+    SuffixArray_Build(mf->src + mf->sa_start, n, mf->sa_parent, mf->sa_leaf, (uint8_t *)mf->sa_len);
+    SuffixArray_BuildLcp(mf->src + mf->sa_start, n, mf->sa_parent, mf->sa_leaf, mf->sa_len);
+    if (!SuffixArray_BuildIntervals(n, mf->sa_parent, mf->sa_len, mf->sa_leaf, mf->nice_len))
+    {
+        mf->sa_end = 0;
+        return false;
+    }
+    memset(mf->sa_last, 0xFF, sizeof(int32_t) * n);
+    return true;
+}
+
+
+
+// MatchFinder_SuffixMatches()
+//
+// MatchFinder_FindMatches() for a suffix array finder. Each position at
+// least |min_dist| back is first marked as the latest in the ranges it is
+// in, then the ranges of |pos| are walked from the smallest, that share the
+// most, up. A range whose latest position is closer than those of the
+// smaller ranges gives a candidate. Both walks go up at most max_chain
+// ranges.
+static int MatchFinder_SuffixMatches(MatchFinder *mf, size_t pos, size_t end, size_t min_dist,
+                                     MatchFinderMatch *matches, int max_matches)
+{
+    const int32_t *parent = mf->sa_parent;
+    const int32_t *leaf = mf->sa_leaf;
+    const int32_t *len = mf->sa_len;
+    int32_t *last = mf->sa_last;
+    int32_t base = (int32_t)mf->sa_start;
+    int32_t cur = (int32_t)pos - base;
+
+    for (; mf->sa_next + min_dist <= pos; mf->sa_next++)
+    {
+        int32_t q = (int32_t)mf->sa_next - base;
+        int32_t x = leaf[q];
+        for (int steps = mf->max_chain; steps && len[x] >= MATCHFINDER_MIN_MATCH; steps--)
+        {
+            last[x] = q;
+            x = parent[x];
+        }
+    }
+
+    // The candidates longest and farthest first
+    MatchFinderMatch found[64];
+    int num_found = 0;
+    int32_t closest = -1;
+
+    int32_t x = leaf[cur];
+    for (int steps = mf->max_chain; steps && len[x] >= MATCHFINDER_MIN_MATCH; steps--)
+    {
+        int32_t j = last[x];
+        if (j > closest && (size_t)(cur - j) >= min_dist && (uint32_t)(cur - j) <= mf->window_mask)
+        {
+            closest = j;
+            found[num_found].len = (uint32_t)len[x];
+            found[num_found].dist = (uint32_t)(cur - j);
+            if (++num_found == 64)
+            {
+                break;
+            }
+        }
+        x = parent[x];
+    }
+    if (!num_found)
+    {
+        return 0;
+    }
+
+    // Shared lengths stop at nice_len, so the longest may go on
+    size_t max_len = end - pos;
+    if (found[0].len >= (uint32_t)mf->nice_len)
+    {
+        const uint8_t *src = mf->src;
+        found[0].len = (uint32_t)MatchLength(src + pos, src + pos - found[0].dist, src + end);
+    }
+
+    // Shortest first, each clamped to |end| and longer than the one before
+    int n = 0;
+    for (int i = num_found - 1; i >= 0; i--)
+    {
+        uint32_t l = (uint32_t)Min(found[i].len, max_len);
+        if (l < MATCHFINDER_MIN_MATCH || (n && l <= matches[n - 1].len))
+        {
+            continue;
+        }
+        if (n == max_matches)
+        {
+            n--;
+        }
+        matches[n].len = l;
+        matches[n].dist = found[i].dist;
+        n++;
+    }
+    return n;
+}
+
+
+
+// MatchFinder_FindRecent()
+//
+// Finds the longest match for |pos| that ends by |end| at one of the |count|
+// offsets in |recent|, the first of equal ones. Two bytes are enough, as a
+// recent offset is cheap to code. Returns its length and sets |index|, or
+// returns 0 if there is none.
+size_t MatchFinder_FindRecent(const MatchFinder *mf, size_t pos, size_t end, const uint32_t *recent, int count,
+                              int *index)
+{
+    const uint8_t *src = mf->src;
+    size_t best_len = 0;
+
+    if (end - pos < 2)
+    {
+        return 0;
+    }
+
+    uint16_t first = *(const uint16_t *)(src + pos);
+    for (int i = 0; i != count; i++)
+    {
+        size_t d = recent[i];
+        if (d <= pos && *(const uint16_t *)(src + pos - d) == first)
+        {
+            size_t len = 2 + MatchLength(src + pos + 2, src + pos - d + 2, src + end);
+            if (len > best_len)
+            {
+                best_len = len;
+                *index = i;
+            }
+        }
+    }
+    return best_len;
+}
+
+
+
+// MatchFinder_FindMatches()
+//
+// Returns the candidates for |pos| that end by |end|, are at least
+// |min_dist| back and are longer than the ones before them, up to
+// |max_matches|. They come out shortest and closest first, the last is the
+// longest. A tree finder searches a position as it inserts it, so it finds
+// nothing for one that is already inserted.
+int MatchFinder_FindMatches(MatchFinder *mf, size_t pos, size_t end, size_t min_dist,
+                            MatchFinderMatch *matches, int max_matches)
+{
+    const uint8_t *src = mf->src;
+    size_t best_len = MATCHFINDER_MIN_MATCH - 1;
+    size_t max_len = end - pos;
+    int n = 0;
+
+    MatchFinder_InsertUpTo(mf, pos);
+    if (max_len < MATCHFINDER_MIN_MATCH)
+    {
+        return 0;
+    }
+
+    if (mf->type == kMatchFinder_SuffixArray)
+    {
+        if ((!mf->sa_end || pos / mf->sa_block != (mf->sa_end - 1) / mf->sa_block) &&
+            !MatchFinder_SortBlock(mf, pos))
+        {
+            return 0;
+        }
+        return MatchFinder_SuffixMatches(mf, pos, end, min_dist, matches, max_matches);
+    }
+    if (mf->type == kMatchFinder_Tree)
+    {
+        if (pos < mf->next_insert)
+        {
+            return 0;
+        }
+        mf->next_insert = pos + 1;
+        MatchFinder_TreeWalk(mf, pos, end, min_dist, matches, max_matches, &n);
+        return n;
+    }
+
+    // The hash buckets and the chain list candidates latest first
+    uint32_t h = MatchFinder_Hash(src + pos, mf->hash_bits);
+    const uint32_t *bucket = (mf->type == kMatchFinder_Hash) ? &mf->head[(size_t)h * mf->max_chain] : NULL;
+    uint32_t cur = bucket ? bucket[0] : mf->head[h];
+    for (int depth = 1; cur != MATCHFINDER_NIL; depth++)
+    {
+        size_t d = pos - cur;
+        if (d > mf->window_mask)
+        {
+            break;
+        }
+
+        // A bucket only holds the latest positions, which in bytes that
+        // repeat every few are all closer than |min_dist|. The same bytes
+        // are then also at the first multiple of the distance that is far
+        // enough back.
+        if (bucket && d < min_dist)
+        {
+            d *= (min_dist + d - 1) / d;
+        }
+        if (d >= min_dist && d <= pos && d <= mf->window_mask && src[pos - d + best_len] == src[pos + best_len])
+        {
+            size_t len = MatchLength(src + pos, src + pos - d, src + end);
+            if (len > best_len)
+            {
+                best_len = len;
+                if (n == max_matches)
+                {
+                    n--;
+                }
+                matches[n].len = (uint32_t)len;
+                matches[n].dist = (uint32_t)d;
+                n++;
+                if (len >= (size_t)mf->nice_len || len == max_len)
+                {
+                    break;
+                }
+            }
+        }
+        if (depth == mf->max_chain)
+        {
+            break;
+        }
+        cur = bucket ? bucket[depth] : mf->chain[cur & mf->window_mask];
+    }
+    return n;
+}
+
+
+
+// MatchFinder_FindMatch()
+//
+// Finds the longest match for |pos| that ends by |end| and is at least
+// |min_dist| back. Returns its length and sets |dist|, or returns 0 if there
+// is none of MATCHFINDER_MIN_MATCH bytes.
+size_t MatchFinder_FindMatch(MatchFinder *mf, size_t pos, size_t end, size_t min_dist, uint32_t *dist)
+{
+    MatchFinderMatch m;
+
+    if (!MatchFinder_FindMatches(mf, pos, end, min_dist, &m, 1))
+    {
+        return 0;
+    }
+    *dist = m.dist;
+    return m.len;
+}
@@ -0,0 +1,157 @@
+/*
+------------------------------------------------------------------------------
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+------------------------------------------------------------------------------
+*/
+
+#include "stdafx.h"
+
+
+// Shortest match the match finder reports, the length it hashes
+#define MATCHFINDER_MIN_MATCH 4
+
+// Marks an empty hash bucket
+#define MATCHFINDER_NIL 0xFFFFFFFF
+
+// Least memory the native encoders give their match finders unless told
+// otherwise, see MatchFinder_DefaultMaxMemory()
+#define MATCHFINDER_DEFAULT_MAX_MEMORY ((size_t)1 << 30)
+
+
+// How a match finder keeps the positions it has seen
+enum {
+    // Each bucket of |head| holds the latest max_chain positions with that
+    // hash. Cheapest to fill, for the fast levels.
+    kMatchFinder_Hash,
+
+    // |chain| links every position to the previous one with the same hash
+    kMatchFinder_Chain,
+
+    // |tree| holds a binary tree per hash, each position with the ones before
+    // it that sort lower on its left and the others on its right. A search
+    // is also the insert, so it costs as much to fill as to search, but finds
+    // the longest matches in few steps.
+    kMatchFinder_Tree,
+
+    // The suffixes of a block and the window before it, sorted, make a tree
+    // of the ranges of suffixes that share a prefix. Each range remembers
+    // the latest position seen in it, so a search finds the closest match
+    // of every length. Nothing is inserted, a block is sorted when a search
+    // first needs it and its positions are walked in order.
+    kMatchFinder_SuffixArray,
+};
+
+// Most bytes a suffix array finder sorts at once, after the window before
+// them. As big as a Leviathan slice, so a thread sorts each of its slices
+// once. A smaller window takes a block no bigger than itself.
+#define MATCHFINDER_SA_BLOCK_SIZE 0x400000
+
+
+// Match finder over a whole input. Positions are inserted in order. The
+// chain and tree nodes are a ring of 1 << window_bits entries, so matches
+// reach back at most that far, and the suffix array covers as much before
+// its block.
+typedef struct MatchFinder {
+    const uint8_t *src;
+    size_t src_size;
+    int type;
+
+    uint32_t *head;
+    uint32_t *chain;
+    uint32_t *tree;
+    int hash_bits;
+    uint32_t window_mask;
+
+    // The ranges of the bytes from |sa_start| to |sa_end|: the parent and
+    // shared length of each, and the latest position seen in it, of those
+    // before |sa_next|. |sa_leaf| is the smallest range of each position.
+    // The first three hold the suffix array, ranks and shared lengths
+    // while sorting, and |sa_last| follows |sa_len| in one allocation, the
+    // sort's scratch until then. Blocks are |sa_block| bytes.
+    int32_t *sa_parent;
+    int32_t *sa_leaf;
+    int32_t *sa_len;
+    int32_t *sa_last;
+    size_t sa_block;
+    size_t sa_start;
+    size_t sa_end;
+    size_t sa_next;
+
+    // Candidates tried per search, and the length that ends it early
+    int max_chain;
+    int nice_len;
+
+    // All positions below this are inserted
+    size_t next_insert;
+} MatchFinder;
+
+
+
+// A match from MatchFinder_FindMatches()
+typedef struct MatchFinderMatch {
+    uint32_t len;
+    uint32_t dist;
+} MatchFinderMatch;
+
+
+
+// MatchFinder_Hash()
+static __forceinline uint32_t MatchFinder_Hash(const uint8_t *p, int hash_bits)
+{
+    return (*(const uint32_t *)p * 0x9E3779B1u) >> (32 - hash_bits);
+}
+
+
+
+// MatchLength()
+//
+// Number of equal bytes at |a| and |b|, up to |a_end|.
+static __forceinline size_t MatchLength(const uint8_t *a, const uint8_t *b, const uint8_t *a_end)
+{
+    const uint8_t *a_start = a;
+
+    while (a_end - a >= 8)
+    {
+        uint64_t x = *(const uint64_t *)a ^ *(const uint64_t *)b;
+        if (x)
+        {
+            return a - a_start + (__builtin_ctzll(x) >> 3);
+        }
+        a += 8;
+        b += 8;
+    }
+    while (a < a_end && *a == *b)
+    {
+        a++;
+        b++;
+    }
+    return a - a_start;
+}
+
+
+
+// Prototypes
+size_t MatchFinder_DefaultMaxMemory();
+size_t MatchFinder_FitSizes(size_t src_size, int type, int max_chain, size_t max_memory,
+                            int *hash_bits, int *window_bits);
+bool MatchFinder_Init(MatchFinder *mf, const uint8_t *src, size_t src_size, int type,
+                      int hash_bits, int window_bits, int max_chain, int nice_len, size_t max_memory);
+void MatchFinder_Free(MatchFinder *mf);
+void MatchFinder_Reset(MatchFinder *mf, size_t pos);
+void MatchFinder_InsertUpTo(MatchFinder *mf, size_t pos);
+size_t MatchFinder_FindRecent(const MatchFinder *mf, size_t pos, size_t end, const uint32_t *recent, int count,
+                              int *index);
+size_t MatchFinder_FindMatch(MatchFinder *mf, size_t pos, size_t end, size_t min_dist, uint32_t *dist);
+int MatchFinder_FindMatches(MatchFinder *mf, size_t pos, size_t end, size_t min_dist,
+                            MatchFinderMatch *matches, int max_matches);
@@ -19,10 +19,15 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "stdafx.h"
 #include "mermaid.h"
 #include "kraken.h"
+#include "utilities.h"
+#include "lzengine.h"
 
 
-// Mermaid_DecodFarOffsets()
-int Mermaid_DecodeFarOffsets(const byte *src, const byte *src_end, uint32_t *output, size_t output_size, int64_t offset)
+// Mermaid_DecodeFarOffsetsScalar()
+//
+// Decodes |output_size| 3-byte offsets, each optionally followed by an
+// extension byte once |offset| is big enough to need one.
+static int Mermaid_DecodeFarOffsetsScalar(const byte *src, const byte *src_end, uint32_t *output, size_t output_size, int64_t offset)
 {
     const byte *src_cur = src;
     size_t i;
@@ -74,10 +79,97 @@ int Mermaid_DecodeFarOffsets(const byte *src, const byte *src_end, uint32_t *out
 }
 
 
+
+// Mermaid_DecodeFarOffsetsSSSE3()
+//
+// Expands four 3-byte offsets to 32 bits with one shuffle. Groups that contain
+// an extension byte are left to the scalar decoder.
+static __attribute__((target("ssse3")))
+int Mermaid_DecodeFarOffsetsSSSE3(const byte *src, const byte *src_end, uint32_t *output, size_t output_size, int64_t offset)
+{
+    const __m128i expand = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    const byte *src_cur = src;
+    size_t i = 0;
+    int n;
+
+    if (offset < (0xC00000 - 1))
+    {
+        // every offset must be within the window
+        const __m128i limit = _mm_set1_epi32((int32_t)offset);
+        for (; i + 4 <= output_size && src_end - src_cur >= 16; i += 4)
+        {
+            __m128i off = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)src_cur), expand);
+            if (_mm_movemask_epi8(_mm_cmpgt_epi32(off, limit)))
+            {
+                return -1;
+            }
+            _mm_storeu_si128((__m128i *)&output[i], off);
+            src_cur += 12;
+        }
+    }
+    else
+    {
+        // offsets without extension byte are <= 0xBFFFFF, so always
+        // within the window here
+        const __m128i extended = _mm_set1_epi32(0xBFFFFF);
+        while (i + 4 <= output_size && src_end - src_cur >= 16)
+        {
+            __m128i off = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)src_cur), expand);
+            if (_mm_movemask_epi8(_mm_cmpgt_epi32(off, extended)))
+            {
+                n = Mermaid_DecodeFarOffsetsScalar(src_cur, src_end, &output[i], 4, offset);
+                if (n < 0)
+                {
+                    return -1;
+                }
+                src_cur += n;
+            }
+            else
+            {
+                _mm_storeu_si128((__m128i *)&output[i], off);
+                src_cur += 12;
+            }
+            i += 4;
+        }
+    }
+
+    n = Mermaid_DecodeFarOffsetsScalar(src_cur, src_end, &output[i], output_size - i, offset);
+    if (n < 0)
+    {
+        return -1;
+    }
+    return src_cur + n - src;
+}
+
+
+
+// Mermaid_DecodeFarOffsets()
+int Mermaid_DecodeFarOffsets(const byte *src, const byte *src_end, uint32_t *output, size_t output_size, int64_t offset)
+{
+    if (CpuFeatures() & kCpuFeature_SSSE3)
+    {
+        return Mermaid_DecodeFarOffsetsSSSE3(src, src_end, output, output_size, offset);
+    }
+    return Mermaid_DecodeFarOffsetsScalar(src, src_end, output, output_size, offset);
+}
+
+
 // Mermaid_CombineOffs16()
+//
+// Interleaves the separately entropy coded low and high bytes of the near
+// offsets into little endian 16-bit values.
 void Mermaid_CombineOffs16(uint16_t *dst, size_t size, const uint8_t *lo, const uint8_t *hi)
 {
-    for (size_t i = 0; i != size; i++)
+    size_t i = 0;
+
+    for (; i + 16 <= size; i += 16)
+    {
+        __m128i l = _mm_loadu_si128((const __m128i *)&lo[i]);
+        __m128i h = _mm_loadu_si128((const __m128i *)&hi[i]);
+        _mm_storeu_si128((__m128i *)&dst[i + 0], _mm_unpacklo_epi8(l, h));
+        _mm_storeu_si128((__m128i *)&dst[i + 8], _mm_unpackhi_epi8(l, h));
+    }
+    for (; i != size; i++)
     {
         dst[i] = lo[i] + hi[i] * 256;
     }
@@ -107,6 +199,10 @@ bool Mermaid_ReadLzTable(int mode, const byte *src, const byte *src_end, byte *d
 
     if (offset == 0)
     {
+        if (dst_size < 8)
+        {
+            return false;  // the first 8 bytes are stored
+        }
         COPY_64(dst, src);
         dst += 8;
         src += 8;
@@ -309,400 +405,327 @@ bool Mermaid_ReadLzTable(int mode, const byte *src, const byte *src_end, byte *d
 
 
 
-// Mermaid_Mode0()
-const byte *Mermaid_Mode0(byte *dst, size_t dst_size, byte *dst_ptr_end,
-                          byte *dst_start, const byte *src_end, MermaidLzTable *lz,
-                          int32_t *saved_dist, size_t startoff)
-{
-    const byte *dst_end = dst + dst_size;
-    const byte *cmd_stream = lz->cmd_stream;
-    const byte *cmd_stream_end = lz->cmd_stream_end;
-    const byte *length_stream = lz->length_stream;
-    const byte *lit_stream = lz->lit_stream;
-    const byte *lit_stream_end = lz->lit_stream_end;
-    const uint16_t *off16_stream = lz->off16_stream;
-    const uint16_t *off16_stream_end = lz->off16_stream_end;
-    const uint32_t *off32_stream = lz->off32_stream;
-    const uint32_t *off32_stream_end = lz->off32_stream_end;
-    intptr_t recent_offs = *saved_dist;
-    const byte *match;
-    intptr_t length;
-    const byte *dst_begin = dst;
-
-    dst += startoff;
-
-    while (cmd_stream < cmd_stream_end)
-    {
-        uintptr_t cmd = *cmd_stream++;
-        if (cmd >= 24)
-        {
-            intptr_t new_dist = *off16_stream;
-            uintptr_t use_distance = (uintptr_t)(cmd >> 7) - 1;
-            uintptr_t litlen = (cmd & 7);
-            COPY_64_ADD(dst, lit_stream, &dst[recent_offs]);
-            dst += litlen;
-            lit_stream += litlen;
-            recent_offs ^= use_distance & (recent_offs ^ -new_dist);
-            off16_stream = (uint16_t*)((uintptr_t)off16_stream + (use_distance & 2));
-            match = dst + recent_offs;
-            COPY_64(dst, match);
-            COPY_64(dst + 8, match + 8);
-            dst += (cmd >> 3) & 0xF;
-        }
-        else if (cmd > 2)
-        {
-            length = cmd + 5;
-
-            if (off32_stream == off32_stream_end)
-            {
-                return NULL;
-            }
-            match = dst_begin - *off32_stream++;
-            recent_offs = (match - dst);
-
-            if (dst_end - dst < length)
-            {
-                return NULL;
-            }
-            COPY_64(dst, match);
-            COPY_64(dst + 8, match + 8);
-            COPY_64(dst + 16, match + 16);
-            COPY_64(dst + 24, match + 24);
-            dst += length;
-            _mm_prefetch((char*)dst_begin - off32_stream[3], _MM_HINT_T0);
-        }
-        else if (cmd == 0)
-        {
-            if (src_end - length_stream == 0)
-            {
-                return NULL;
-            }
-            length = *length_stream;
-            if (length > 251)
-            {
-                if (src_end - length_stream < 3)
-                {
-                    return NULL;
-                }
-                length += (size_t)*(uint16_t*)(length_stream + 1) * 4;
-                length_stream += 2;
-            }
-            length_stream += 1;
+// The stream positions of one 64k half while Mermaid_RunCommands() consumes
+// them
+struct MermaidStreams {
+    const byte *cmd_stream;
+    const byte *cmd_stream_end;
+    const byte *length_stream;
+    const uint16_t *off16_stream;
+    const uint16_t *off16_stream_end;
+    const uint32_t *off32_stream;
+    const uint32_t *off32_stream_end;
+};
 
-            length += 64;
-            if (dst_end - dst < length || lit_stream_end - lit_stream < length)
-            {
-                return NULL;
-            }
 
-            do
-            {
-                COPY_64_ADD(dst, lit_stream, &dst[recent_offs]);
-                COPY_64_ADD(dst + 8, lit_stream + 8, &dst[recent_offs + 8]);
-                dst += 16;
-                lit_stream += 16;
-                length -= 16;
-            } while (length > 0);
-            dst += length;
-            lit_stream += length;
-        }
-        else if (cmd == 1)
-        {
-            if (src_end - length_stream == 0)
-            {
-                return NULL;
-            }
-            length = *length_stream;
-            if (length > 251)
-            {
-                if (src_end - length_stream < 3)
-                {
-                    return NULL;
-                }
-                length += (size_t)*(uint16_t*)(length_stream + 1) * 4;
-                length_stream += 2;
-            }
-            length_stream += 1;
-            length += 91;
 
-            if (off16_stream == off16_stream_end)
-            {
-                return NULL;
-            }
-            match = dst - *off16_stream++;
-            recent_offs = (match - dst);
-            do
-            {
-                COPY_64(dst, match);
-                COPY_64(dst + 8, match + 8);
-                dst += 16;
-                match += 16;
-                length -= 16;
-            } while (length > 0);
-            dst += length;
-        }
-        else /* flag == 2 */
-        {
-            if (src_end - length_stream == 0)
-            {
-                return NULL;
-            }
-            length = *length_stream;
-            if (length > 251)
-            {
-                if (src_end - length_stream < 3)
-                {
-                    return NULL;
-                }
-                length += (size_t)*(uint16_t*)(length_stream + 1) * 4;
-                length_stream += 2;
-            }
-            length_stream += 1;
-            length += 29;
-            if (off32_stream == off32_stream_end)
-            {
-                return NULL;
-            }
-            match = dst_begin - *off32_stream++;
-            recent_offs = (match - dst);
-            do
-            {
-                COPY_64(dst, match);
-                COPY_64(dst + 8, match + 8);
-                dst += 16;
-                match += 16;
-                length -= 16;
-            } while (length > 0);
-            dst += length;
-            _mm_prefetch((char*)dst_begin - off32_stream[3], _MM_HINT_T0);
-        }
-    }
+// Mermaid_ReadLength()
+//
+// Reads the length of a long token from the length stream, or returns -1 if
+// the stream ends.
+static __forceinline intptr_t Mermaid_ReadLength(const byte *&length_stream, const byte *src_end)
+{
+    intptr_t length;
 
-    length = dst_end - dst;
-    if (length >= 8)
+    if (src_end - length_stream == 0)
     {
-        do
-        {
-            COPY_64_ADD(dst, lit_stream, &dst[recent_offs]);
-            dst += 8;
-            lit_stream += 8;
-            length -= 8;
-        } while (length >= 8);
+        return -1;
     }
-    if (length > 0)
+    length = *length_stream;
+    if (length > 251)
     {
-        do
+        if (src_end - length_stream < 3)
         {
-            *dst = *lit_stream++ + dst[recent_offs];
-            dst++;
-        } while (--length);
+            return -1;
+        }
+        length += (size_t)*(uint16_t*)(length_stream + 1) * 4;
+        length_stream += 2;
     }
+    length_stream += 1;
+    return length;
+}
 
-    *saved_dist = (int32_t)recent_offs;
-    lz->length_stream = length_stream;
-    lz->off16_stream = off16_stream;
-    lz->lit_stream = lit_stream;
-    return length_stream;
+
+
+// Mermaid_CommandStop()
+//
+// A short token writes at most 32 bytes from where it starts, and moves the
+// output by no more than that. So the fast loop can run (tail_start - dst) /
+// 32 of them without checking the output position, up to the returned
+// command.
+static __forceinline const byte *Mermaid_CommandStop(const MermaidStreams &s, const byte *dst, const byte *tail_start)
+{
+    size_t n = (dst < tail_start) ? (size_t)(tail_start - dst) >> 5 : 0;
+    return s.cmd_stream + Min(n, (size_t)(s.cmd_stream_end - s.cmd_stream));
 }
 
 
 
-// Mermaid_Mode1()
-const byte *Mermaid_Mode1(byte *dst, size_t dst_size, byte *dst_ptr_end, byte *dst_start,
-                         const byte *src_end, MermaidLzTable *lz, int32_t *saved_dist,
-                         size_t startoff)
+// Mermaid_RunCommands()
+//
+// Runs commands until the command stream ends, or without |kExact| until the
+// output reaches |tail_start|. Long tokens go exact if they reach the last
+// LZ_COPY_OVERRUN bytes of the half, and start a new run of short ones after
+// them. With |kExact| nothing is written past |dst_end|.
+template<typename Literals, bool kExact>
+static __forceinline bool Mermaid_RunCommands(MermaidStreams &s, Literals &lits, intptr_t &recent_offs, byte *&dst,
+                                              const byte *dst_end, const byte *tail_start, const byte *dst_begin,
+                                              const byte *dst_start, const byte *src_end)
 {
-    const byte *dst_end = dst + dst_size;
-    const byte *cmd_stream = lz->cmd_stream;
-    const byte *cmd_stream_end = lz->cmd_stream_end;
-    const byte *length_stream = lz->length_stream;
-    const byte *lit_stream = lz->lit_stream;
-    const byte *lit_stream_end = lz->lit_stream_end;
-    const uint16_t *off16_stream = lz->off16_stream;
-    const uint16_t *off16_stream_end = lz->off16_stream_end;
-    const uint32_t *off32_stream = lz->off32_stream;
-    const uint32_t *off32_stream_end = lz->off32_stream_end;
-    intptr_t recent_offs = *saved_dist;
+    const byte *copy_end = dst_end - LZ_COPY_OVERRUN;
+    const byte *cmd_stop;
     const byte *match;
     intptr_t length;
-    const byte *dst_begin = dst;
 
-    dst += startoff;
-
-    while (cmd_stream < cmd_stream_end)
+    while ((cmd_stop = kExact ? s.cmd_stream_end : Mermaid_CommandStop(s, dst, tail_start)) != s.cmd_stream)
     {
-        uintptr_t flag = *cmd_stream++;
-        if (flag >= 24)
-        {
-            intptr_t new_dist = *off16_stream;
-            uintptr_t use_distance = (uintptr_t)(flag >> 7) - 1;
-            uintptr_t litlen = (flag & 7);
-            COPY_64(dst, lit_stream);
-            dst += litlen;
-            lit_stream += litlen;
-            recent_offs ^= use_distance & (recent_offs ^ -new_dist);
-            off16_stream = (uint16_t*)((uintptr_t)off16_stream + (use_distance & 2));
-            match = dst + recent_offs;
-            COPY_64(dst, match);
-            COPY_64(dst + 8, match + 8);
-            dst += (flag >> 3) & 0xF;
-        }
-        else if (flag > 2)
-        {
-            length = flag + 5;
-
-            if (off32_stream == off32_stream_end)
-            {
-                return NULL;
-            }
-            match = dst_begin - *off32_stream++;
-            recent_offs = (match - dst);
-
-            if (dst_end - dst < length)
-            {
-                return NULL;
-            }
-            COPY_64(dst, match);
-            COPY_64(dst + 8, match + 8);
-            COPY_64(dst + 16, match + 16);
-            COPY_64(dst + 24, match + 24);
-            dst += length;
-            _mm_prefetch((char*)dst_begin - off32_stream[3], _MM_HINT_T0);
-        }
-        else if (flag == 0)
+        while (s.cmd_stream < cmd_stop)
         {
-            if (src_end - length_stream == 0)
+            uintptr_t cmd = *s.cmd_stream++;
+            if (cmd >= 24)
             {
-                return NULL;
+                intptr_t new_dist = *s.off16_stream;
+                uintptr_t use_distance = (uintptr_t)(cmd >> 7) - 1;
+                uintptr_t litlen = (cmd & 7);
+                if (kExact)
+                {
+                    if (litlen > (uintptr_t)(dst_end - dst))
+                    {
+                        return false;
+                    }
+                    lits.CopyExact(dst, litlen, recent_offs);
+                }
+                else
+                {
+                    lits.Copy(dst, litlen, recent_offs);
+                }
+                recent_offs ^= use_distance & (recent_offs ^ -new_dist);
+                s.off16_stream = (uint16_t*)((uintptr_t)s.off16_stream + (use_distance & 2));
+                match = dst + recent_offs;
+                if (LzBounds::kChecked && (match < dst_start || lits.lit_stream > lits.lit_stream_end ||
+                                           s.off16_stream > s.off16_stream_end))
+                {
+                    return false;
+                }
+                if (kExact)
+                {
+                    if (!LzCopyMatchExact(dst, match, (cmd >> 3) & 0xF, dst_end))
+                    {
+                        return false;
+                    }
+                    continue;
+                }
+                COPY_64(dst, match);
+                COPY_64(dst + 8, match + 8);
+                dst += (cmd >> 3) & 0xF;
+                if (LzBounds::kChecked && dst > dst_end)
+                {
+                    return false;
+                }
             }
-            length = *length_stream;
-            if (length > 251)
+            else if (cmd > 2)
             {
-                if (src_end - length_stream < 3)
+                length = cmd + 5;
+
+                if (s.off32_stream == s.off32_stream_end)
                 {
-                    return NULL;
+                    return false;
                 }
-                length += (size_t)*(uint16_t*)(length_stream + 1) * 4;
-                length_stream += 2;
-            }
-            length_stream += 1;
+                match = dst_begin - *s.off32_stream++;
+                recent_offs = (match - dst);
 
-            length += 64;
-            if (dst_end - dst < length || lit_stream_end - lit_stream < length)
-            {
-                return NULL;
+                if (dst_end - dst < length || (LzBounds::kChecked && match < dst_start))
+                {
+                    return false;
+                }
+                if (kExact)
+                {
+                    LzCopyMatchExact(dst, match, length, dst_end);
+                }
+                else
+                {
+                    COPY_64(dst, match);
+                    COPY_64(dst + 8, match + 8);
+                    COPY_64(dst + 16, match + 16);
+                    COPY_64(dst + 24, match + 24);
+                    dst += length;
+                }
+                _mm_prefetch((char*)dst_begin - s.off32_stream[3], _MM_HINT_T0);
             }
-
-            do
-            {
-                COPY_64(dst, lit_stream);
-                COPY_64(dst + 8, lit_stream + 8);
-                dst += 16;
-                lit_stream += 16;
-                length -= 16;
-            } while (length > 0);
-            dst += length;
-            lit_stream += length;
-        }
-        else if (flag == 1)
-        {
-            if (src_end - length_stream == 0)
+            else if (cmd == 0)
             {
-                return NULL;
+                length = Mermaid_ReadLength(s.length_stream, src_end);
+                if (length < 0)
+                {
+                    return false;
+                }
+                length += 64;
+                if (lits.lit_stream_end - lits.lit_stream < length)
+                {
+                    return false;
+                }
+                if (kExact || length > copy_end - dst)
+                {
+                    if (dst_end - dst < length)
+                    {
+                        return false;
+                    }
+                    lits.CopyExact(dst, length, recent_offs);
+                }
+                else
+                {
+                    lits.Copy(dst, length, recent_offs);
+                }
+                if (!kExact)
+                {
+                    break;  // start a new run
+                }
             }
-            length = *length_stream;
-            if (length > 251)
+            else if (cmd == 1)
             {
-                if (src_end - length_stream < 3)
+                length = Mermaid_ReadLength(s.length_stream, src_end);
+                if (length < 0)
                 {
-                    return NULL;
+                    return false;
                 }
-                length += (size_t)*(uint16_t*)(length_stream + 1) * 4;
-                length_stream += 2;
-            }
-            length_stream += 1;
-            length += 91;
+                length += 91;
 
-            if (off16_stream == off16_stream_end)
-            {
-                return NULL;
-            }
-            match = dst - *off16_stream++;
-            recent_offs = (match - dst);
-            do
-            {
-                COPY_64(dst, match);
-                COPY_64(dst + 8, match + 8);
-                dst += 16;
-                match += 16;
-                length -= 16;
-            } while (length > 0);
-            dst += length;
-        }
-        else /* flag == 2 */
-        {
-            if (src_end - length_stream == 0)
-            {
-                return NULL;
+                if (s.off16_stream == s.off16_stream_end)
+                {
+                    return false;
+                }
+                match = dst - *s.off16_stream++;
+                recent_offs = (match - dst);
+                if (LzBounds::kChecked && match < dst_start)
+                {
+                    return false;
+                }
+                if (kExact || length > copy_end - dst)
+                {
+                    if (!LzCopyMatchExact(dst, match, length, dst_end))
+                    {
+                        return false;
+                    }
+                }
+                else
+                {
+                    do
+                    {
+                        COPY_64(dst, match);
+                        COPY_64(dst + 8, match + 8);
+                        dst += 16;
+                        match += 16;
+                        length -= 16;
+                    } while (length > 0);
+                    dst += length;
+                }
+                if (!kExact)
+                {
+                    break;  // start a new run
+                }
             }
-            length = *length_stream;
-            if (length > 251)
+            else /* flag == 2 */
             {
-                if (src_end - length_stream < 3)
+                length = Mermaid_ReadLength(s.length_stream, src_end);
+                if (length < 0)
                 {
-                    return NULL;
+                    return false;
+                }
+                length += 29;
+                if (s.off32_stream == s.off32_stream_end)
+                {
+                    return false;
+                }
+                match = dst_begin - *s.off32_stream++;
+                recent_offs = (match - dst);
+                if (LzBounds::kChecked && match < dst_start)
+                {
+                    return false;
+                }
+                if (kExact || length > copy_end - dst)
+                {
+                    if (!LzCopyMatchExact(dst, match, length, dst_end))
+                    {
+                        return false;
+                    }
+                }
+                else
+                {
+                    do
+                    {
+                        COPY_64(dst, match);
+                        COPY_64(dst + 8, match + 8);
+                        dst += 16;
+                        match += 16;
+                        length -= 16;
+                    } while (length > 0);
+                    dst += length;
+                }
+                _mm_prefetch((char*)dst_begin - s.off32_stream[3], _MM_HINT_T0);
+                if (!kExact)
+                {
+                    break;  // start a new run
                 }
-                length += (size_t)*(uint16_t*)(length_stream + 1) * 4;
-                length_stream += 2;
             }
-            length_stream += 1;
-            length += 29;
+        }
+    }
+    return true;
+}
 
-            if (off32_stream == off32_stream_end)
-            {
-                return NULL;
-            }
-            match = dst_begin - *off32_stream++;
-            recent_offs = (match - dst);
 
-            do
-            {
-                COPY_64(dst, match);
-                COPY_64(dst + 8, match + 8);
-                dst += 16;
-                match += 16;
-                length -= 16;
-            } while (length > 0);
-            dst += length;
 
-            _mm_prefetch((char*)dst_begin - off32_stream[3], _MM_HINT_T0);
-        }
+// Mermaid_ProcessLz()
+//
+// Runs the commands of one 64k half of a block. The token format does not fit
+// LzEngine_Process(), but the literals go through the same policies. Like
+// there, the commands within SAFE_SPACE bytes of the end of the half take the
+// exact path.
+template<typename Literals>
+const byte *Mermaid_ProcessLz(byte *dst, size_t dst_size, byte *dst_ptr_end,
+                              byte *dst_start, const byte *src_end, MermaidLzTable *lz,
+                              int32_t *saved_dist, size_t startoff)
+{
+    const byte *dst_end = dst + dst_size;
+    const byte *tail_start = (dst_size >= SAFE_SPACE) ? dst_end - SAFE_SPACE : dst;
+    MermaidStreams s;
+    Literals lits(lz->lit_stream, lz->lit_stream_end);
+    intptr_t recent_offs = *saved_dist;
+    intptr_t length;
+    const byte *dst_begin = dst;
+
+    s.cmd_stream = lz->cmd_stream;
+    s.cmd_stream_end = lz->cmd_stream_end;
+    s.length_stream = lz->length_stream;
+    s.off16_stream = lz->off16_stream;
+    s.off16_stream_end = lz->off16_stream_end;
+    s.off32_stream = lz->off32_stream;
+    s.off32_stream_end = lz->off32_stream_end;
+
+    dst += startoff;
+
+    if (!Mermaid_RunCommands<Literals, false>(s, lits, recent_offs, dst, dst_end, tail_start,
+                                              dst_begin, dst_start, src_end) ||
+        !Mermaid_RunCommands<Literals, true>(s, lits, recent_offs, dst, dst_end, tail_start,
+                                             dst_begin, dst_start, src_end))
+    {
+        return NULL;
     }
 
     length = dst_end - dst;
-    if (length >= 8)
+    if (LzBounds::kChecked && (length < 0 || !lits.HasLiterals(dst, length)))
     {
-        do
-        {
-            COPY_64(dst, lit_stream);
-            dst += 8;
-            lit_stream += 8;
-            length -= 8;
-        } while (length >= 8);
+        return NULL;
     }
-    if (length > 0)
+    if (length > 0 && !lits.template CopyFinalLiterals<LzBounds>(length, dst, recent_offs, false))
     {
-        do
-        {
-            *dst++ = *lit_stream++;
-        } while (--length);
+        return NULL;
     }
 
     *saved_dist = (int32_t)recent_offs;
-    lz->length_stream = length_stream;
-    lz->off16_stream = off16_stream;
-    lz->lit_stream = lit_stream;
-    return length_stream;
+    lz->length_stream = s.length_stream;
+    lz->off16_stream = s.off16_stream;
+    lz->lit_stream = lits.lit_stream;
+    return s.length_stream;
 }
 
 
@@ -742,13 +765,13 @@ bool Mermaid_ProcessLzRuns(int mode, const byte *src, const byte *src_end,
 
         if (mode == 0)
         {
-            src_cur = Mermaid_Mode0(dst, dst_size_cur, dst_end, dst_start, src_end, lz,
-                                    &saved_dist, (offset == 0) && (iteration == 0) ? 8 : 0);
+            src_cur = Mermaid_ProcessLz<LzLiteralsDelta>(dst, dst_size_cur, dst_end, dst_start, src_end, lz,
+                                                         &saved_dist, (offset == 0) && (iteration == 0) ? 8 : 0);
         }
         else
         {
-            src_cur = Mermaid_Mode1(dst, dst_size_cur, dst_end, dst_start, src_end, lz, &saved_dist,
-                                    (offset == 0) && (iteration == 0) ? 8 : 0);
+            src_cur = Mermaid_ProcessLz<LzLiteralsRaw>(dst, dst_size_cur, dst_end, dst_start, src_end, lz,
+                                                       &saved_dist, (offset == 0) && (iteration == 0) ? 8 : 0);
         }
         if (src_cur == NULL)
         {
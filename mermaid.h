@@ -90,12 +90,10 @@ void Mermaid_CombineOffs16(uint16_t *dst, size_t size, const uint8_t *lo, const
 bool Mermaid_ReadLzTable(int mode, const byte *src, const byte *src_end, byte *dst,
                          int dst_size, int64_t offset, byte *scratch, byte *scratch_end,
                          MermaidLzTable *lz);
-const byte *Mermaid_Mode0(byte *dst, size_t dst_size, byte *dst_ptr_end,
-                          byte *dst_start, const byte *src_end, MermaidLzTable *lz,
-                          int32_t *saved_dist, size_t startoff);
-const byte *Mermaid_Mode1(byte *dst, size_t dst_size, byte *dst_ptr_end, byte *dst_start,
-                         const byte *src_end, MermaidLzTable *lz, int32_t *saved_dist,
-                         size_t startoff);
+template<typename Literals>
+const byte *Mermaid_ProcessLz(byte *dst, size_t dst_size, byte *dst_ptr_end,
+                              byte *dst_start, const byte *src_end, MermaidLzTable *lz,
+                              int32_t *saved_dist, size_t startoff);
 bool Mermaid_ProcessLzRuns(int mode, const byte *src, const byte *src_end,
                            byte *dst, size_t dst_size, uint64_t offset,
                            byte *dst_end, MermaidLzTable *lz);
@@ -0,0 +1,619 @@
+/*
+------------------------------------------------------------------------------
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+------------------------------------------------------------------------------
+*/
+
+#include "mermaid_enc.h"
+#include "kraken_enc.h"
+#include "entropy_enc.h"
+#include "matchfinder.h"
+#include "utilities.h"
+#include "kraken.h"
+
+
+// Each chunk is run as two 64k halves, with their own far offsets and
+// commands. A command never crosses into the next half.
+#define MERMAID_HALF_SIZE 0x10000
+
+// Mermaid offsets are at least 8, and those past 64k are far offsets
+#define MERMAID_MIN_OFFSET 8
+#define MERMAID_MAX_NEAR_OFFSET 0xFFFF
+
+// The shortest match a far offset can code
+#define MERMAID_MIN_FAR_MATCH 8
+
+// Lengths from which the long commands take over
+#define MERMAID_LONG_LITERALS 64
+#define MERMAID_LONG_NEAR_MATCH 91
+#define MERMAID_LONG_FAR_MATCH 29
+
+// Room Mermaid_DecodeQuantum() gives Mermaid_ReadLzTable() for the decoded
+// arrays of a chunk, less the MermaidLzTable and the padding it adds
+#define MERMAID_SCRATCH_SIZE(n) ((int)Min(2 * (n) + 32, 0x40000) - 256)
+
+
+// Match finder and parser settings of a compression level
+struct MermaidLevelParams {
+    int finder;
+    int hash_bits;
+    int window_bits;
+    int max_chain;
+    int nice_len;
+
+    // How many times in a row a match may be given up for a better one at
+    // the next position
+    int lazy;
+
+    // Step faster over data without matches
+    bool skip;
+};
+
+
+// Mermaid is tuned for decode speed, so it searches less than Kraken at the
+// same level
+static const MermaidLevelParams kMermaidLevels[9] = {
+    { kMatchFinder_Hash,  16, 19,   1,  32, 0, true },
+    { kMatchFinder_Hash,  16, 20,   1,  32, 0, true },
+    { kMatchFinder_Hash,  17, 20,   2,  32, 0, true },
+    { kMatchFinder_Chain, 17, 21,   4,  48, 1, false },
+    { kMatchFinder_Chain, 18, 22,   8,  64, 1, false },
+    { kMatchFinder_Chain, 18, 22,  12,  96, 1, false },
+    { kMatchFinder_Tree,  19, 23,   8, 128, 2, false },
+    { kMatchFinder_Tree,  20, 23,  12, 192, 2, false },
+    { kMatchFinder_Tree,  20, 24,  24, 256, 2, false },
+};
+
+
+// A match candidate
+struct MermaidMatch {
+    size_t len;
+    uint32_t dist;
+    int score;
+};
+
+
+// Encoder state. The arrays hold one chunk the way Mermaid_ReadLzTable()
+// reads it, before entropy coding.
+struct MermaidEncoder {
+    const uint8_t *src;
+    size_t src_size;
+    const MermaidLevelParams *params;
+    MatchFinder mf;
+
+    // Selkie codes the literals raw and doesn't entropy code any array
+    bool selkie;
+
+    // How Kraken_EncodeBytes() codes the arrays: the bytes a microsecond of
+    // decode time is worth, and kEncodeBytes_Fast at the lower levels
+    int space_speed;
+    int entropy_flags;
+
+    // Literals, as is and as the difference to the byte at the last offset
+    uint8_t *lits;
+    uint8_t *delta_lits;
+    int lits_size;
+
+    // Commands, the first |cmds_half| of them for the first 64k
+    uint8_t *cmds;
+    int cmds_size;
+    int cmds_half;
+
+    uint16_t *off16;
+    int off16_size;
+
+    // Far offsets of each half, counted back from the start of the half
+    uint32_t *off32[2];
+    int off32_size[2];
+
+    // The length stream, as it is written
+    uint8_t *lens;
+    int lens_size;
+
+    // Distance of the last match
+    uint32_t recent;
+
+    // The output of one chunk, and room for arrays that are tried on the side
+    uint8_t *lz_buf;
+    uint8_t *tmp_buf;
+};
+
+
+
+// Mermaid_MatchScore()
+//
+// Rough number of bits a match saves over coding its bytes as literals.
+static __forceinline int Mermaid_MatchScore(size_t len, uint32_t dist, bool recent)
+{
+    return (int)len * 6 - (recent ? 6 : dist <= MERMAID_MAX_NEAR_OFFSET ? 20 : 30);
+}
+
+
+
+// Mermaid_FindMatch()
+//
+// Finds the best scoring match at |pos|, at the recent offset or from the
+// match finder. Far matches need MERMAID_MIN_FAR_MATCH bytes unless they are
+// at the recent offset. A score of 0 means there is none worth taking. A
+// recent match of nice_len or more is taken without searching.
+static void Mermaid_FindMatch(MermaidEncoder *enc, size_t pos, size_t end, MermaidMatch *m)
+{
+    uint32_t dist;
+    int index;
+
+    m->len = 0;
+    m->score = 0;
+    size_t len = MatchFinder_FindRecent(&enc->mf, pos, end, &enc->recent, 1, &index);
+    if (len)
+    {
+        m->len = len;
+        m->dist = enc->recent;
+        m->score = Mermaid_MatchScore(len, m->dist, true);
+        if (len >= (size_t)enc->params->nice_len)
+        {
+            return;
+        }
+    }
+
+    len = MatchFinder_FindMatch(&enc->mf, pos, end, MERMAID_MIN_OFFSET, &dist);
+    if (len && (dist <= MERMAID_MAX_NEAR_OFFSET || len >= MERMAID_MIN_FAR_MATCH))
+    {
+        int score = Mermaid_MatchScore(len, dist, dist == enc->recent);
+        if (score > m->score)
+        {
+            m->len = len;
+            m->dist = dist;
+            m->score = score;
+        }
+    }
+}
+
+
+
+// Mermaid_PushLength()
+//
+// Adds |v| to the length stream, as Mermaid_ReadLength() reads it.
+static void Mermaid_PushLength(MermaidEncoder *enc, uint32_t v)
+{
+    uint8_t *p = enc->lens + enc->lens_size;
+
+    if (v <= 251)
+    {
+        p[0] = (uint8_t)v;
+        enc->lens_size += 1;
+        return;
+    }
+    uint32_t b = 252 + ((v - 252) & 3);
+    uint32_t w = (v - b) >> 2;
+    p[0] = (uint8_t)b;
+    p[1] = (uint8_t)w;
+    p[2] = (uint8_t)(w >> 8);
+    enc->lens_size += 3;
+}
+
+
+
+// Mermaid_EmitLiterals()
+//
+// Adds |n| literals from |pos|, the delta literals relative to the last
+// match offset.
+static void Mermaid_EmitLiterals(MermaidEncoder *enc, size_t pos, size_t n)
+{
+    const uint8_t *src = enc->src + pos;
+    uint8_t *lits = enc->lits + enc->lits_size;
+    uint8_t *delta_lits = enc->delta_lits + enc->lits_size;
+    uint32_t last_dist = enc->recent;
+
+    for (size_t i = 0; i != n; i++)
+    {
+        lits[i] = src[i];
+        delta_lits[i] = src[i] - src[i - last_dist];
+    }
+    enc->lits_size += (int)n;
+}
+
+
+
+// Mermaid_EmitLiteralRun()
+//
+// Adds the commands for all but the last few of |n| literals from |pos|.
+// Returns how many are left, at most 7, for the next short command to take.
+static size_t Mermaid_EmitLiteralRun(MermaidEncoder *enc, size_t pos, size_t n)
+{
+    if (n >= MERMAID_LONG_LITERALS)
+    {
+        enc->cmds[enc->cmds_size++] = 0;
+        Mermaid_PushLength(enc, (uint32_t)(n - MERMAID_LONG_LITERALS));
+        Mermaid_EmitLiterals(enc, pos, n);
+        return 0;
+    }
+    for (; n > 7; n -= 7, pos += 7)
+    {
+        enc->cmds[enc->cmds_size++] = 0x80 | 7;
+        Mermaid_EmitLiterals(enc, pos, 7);
+    }
+    return n;
+}
+
+
+
+// Mermaid_EmitMatch()
+//
+// Adds |litlen| literals from |pos| followed by a match, in |half| of the
+// chunk. |half_start| is where the far offsets of that half count from.
+static void Mermaid_EmitMatch(MermaidEncoder *enc, size_t pos, size_t litlen, size_t len, uint32_t dist,
+                              int half, size_t half_start)
+{
+    bool recent = (dist == enc->recent);
+    bool near = (dist <= MERMAID_MAX_NEAR_OFFSET);
+    uint32_t cmd;
+
+    pos += litlen;
+    litlen = Mermaid_EmitLiteralRun(enc, pos - litlen, litlen);
+    if ((near && len >= MERMAID_LONG_NEAR_MATCH) || (!near && (!recent || len > 45)))
+    {
+        // A long command, or a far match, takes no literals
+        if (litlen)
+        {
+            enc->cmds[enc->cmds_size++] = (uint8_t)(0x80 | litlen);
+            Mermaid_EmitLiterals(enc, pos - litlen, litlen);
+        }
+        if (near)
+        {
+            enc->cmds[enc->cmds_size++] = 1;
+            Mermaid_PushLength(enc, (uint32_t)(len - MERMAID_LONG_NEAR_MATCH));
+            enc->off16[enc->off16_size++] = (uint16_t)dist;
+        }
+        else
+        {
+            if (len < MERMAID_LONG_FAR_MATCH)
+            {
+                enc->cmds[enc->cmds_size++] = (uint8_t)(len - 5);
+            }
+            else
+            {
+                enc->cmds[enc->cmds_size++] = 2;
+                Mermaid_PushLength(enc, (uint32_t)(len - MERMAID_LONG_FAR_MATCH));
+            }
+            enc->off32[half][enc->off32_size[half]++] = (uint32_t)(half_start - (pos - dist));
+        }
+        enc->recent = dist;
+        return;
+    }
+
+    // Short commands, the first with the literals and a new near offset
+    Mermaid_EmitLiterals(enc, pos - litlen, litlen);
+    cmd = (uint32_t)litlen | (uint32_t)Min(len, (size_t)15) << 3;
+    if (recent)
+    {
+        cmd |= 0x80;
+    }
+    else
+    {
+        enc->off16[enc->off16_size++] = (uint16_t)dist;
+    }
+    enc->cmds[enc->cmds_size++] = (uint8_t)cmd;
+    enc->recent = dist;
+    for (len -= Min(len, (size_t)15); len; len -= Min(len, (size_t)15))
+    {
+        enc->cmds[enc->cmds_size++] = (uint8_t)(0x80 | Min(len, (size_t)15) << 3);
+    }
+}
+
+
+
+// Mermaid_ParseHalf()
+//
+// Greedy or lazy parse of the bytes from |start| to |end|, in |half| of a
+// chunk that begins at |half_start|. Literals after the last match are left
+// for the decoder to take up to the end of the half.
+static void Mermaid_ParseHalf(MermaidEncoder *enc, int half, size_t half_start, size_t start, size_t end)
+{
+    const MermaidLevelParams *params = enc->params;
+    size_t pos = start;
+    size_t lit_start = start;
+    MermaidMatch m;
+    MermaidMatch next;
+
+    while (pos + MATCHFINDER_MIN_MATCH <= end)
+    {
+        Mermaid_FindMatch(enc, pos, end, &m);
+        if (m.score <= 0)
+        {
+            pos += params->skip ? 1 + ((pos - lit_start) >> 6) : 1;
+            continue;
+        }
+
+        // A better match one byte on is worth a literal
+        for (int i = 0; i < params->lazy && pos + MATCHFINDER_MIN_MATCH < end; i++)
+        {
+            Mermaid_FindMatch(enc, pos + 1, end, &next);
+            if (next.score <= m.score + 4)
+            {
+                break;
+            }
+            m = next;
+            pos++;
+        }
+
+        Mermaid_EmitMatch(enc, lit_start, pos - lit_start, m.len, m.dist, half, half_start);
+        pos += m.len;
+        lit_start = pos;
+    }
+    Mermaid_EmitLiterals(enc, lit_start, end - lit_start);
+}
+
+
+
+// Mermaid_ParseChunk()
+//
+// Parses the chunk from |start| to |end| one half at a time. The recent
+// offset starts over with each chunk and the first 8 bytes of the input are
+// stored.
+static void Mermaid_ParseChunk(MermaidEncoder *enc, size_t start, size_t end)
+{
+    size_t half_end = Min(start + MERMAID_HALF_SIZE, end);
+
+    enc->lits_size = 0;
+    enc->cmds_size = 0;
+    enc->off16_size = 0;
+    enc->off32_size[0] = 0;
+    enc->off32_size[1] = 0;
+    enc->lens_size = 0;
+    enc->recent = MERMAID_MIN_OFFSET;
+
+    Mermaid_ParseHalf(enc, 0, start, start == 0 ? 8 : start, half_end);
+    enc->cmds_half = enc->cmds_size;
+    if (half_end < end)
+    {
+        Mermaid_ParseHalf(enc, 1, half_end, half_end, end);
+    }
+}
+
+
+
+// Mermaid_WriteFarOffsets()
+//
+// Writes |n| far offsets in 3 bytes each, plus a fourth for those from
+// 0xC00000 on, as Mermaid_DecodeFarOffsets() reads them.
+static uint8_t *Mermaid_WriteFarOffsets(uint8_t *dst, const uint32_t *offs, int n)
+{
+    for (int i = 0; i != n; i++)
+    {
+        uint32_t off = offs[i];
+        if (off < 0xC00000)
+        {
+            dst[0] = (uint8_t)off;
+            dst[1] = (uint8_t)(off >> 8);
+            dst[2] = (uint8_t)(off >> 16);
+            dst += 3;
+        }
+        else
+        {
+            uint32_t v = 0xC00000 | (off & 0x3FFFFF);
+            dst[0] = (uint8_t)v;
+            dst[1] = (uint8_t)(v >> 8);
+            dst[2] = (uint8_t)(v >> 16);
+            dst[3] = (uint8_t)((off >> 22) - 3);
+            dst += 4;
+        }
+    }
+    return dst;
+}
+
+
+
+// Mermaid_WriteBytes()
+//
+// Entropy codes an array, or stores it for Selkie. Sets |*cost| as
+// Kraken_EncodeBytes() does if |cost| isn't NULL.
+static int Mermaid_WriteBytes(MermaidEncoder *enc, uint8_t *dst, const uint8_t *src, int src_size,
+                              double *cost = NULL)
+{
+    if (enc->selkie)
+    {
+        int n = Kraken_WriteStoredBytes(dst, src, src_size, false);
+        if (cost)
+        {
+            *cost = n;
+        }
+        return n;
+    }
+    return Kraken_EncodeBytes(dst, src, src_size, enc->entropy_flags | kEncodeBytes_NoScratch, enc->space_speed, cost);
+}
+
+
+
+// Mermaid_WriteLzTable()
+//
+// Writes the arrays of the parsed chunk as Mermaid_ReadLzTable() reads them.
+// |start| is the start of the chunk, the first 8 bytes of the input are
+// stored in front. Returns the size and sets the literal |mode|, or returns
+// 0 if the decoder would run out of scratch space for the arrays.
+static int Mermaid_WriteLzTable(MermaidEncoder *enc, size_t start, int size, uint8_t *dst, int *mode)
+{
+    uint8_t *p = dst;
+    int scratch = enc->lits_size + enc->cmds_size + 4 * (enc->off32_size[0] + enc->off32_size[1]) + 64;
+
+    if (scratch > MERMAID_SCRATCH_SIZE(size))
+    {
+        return 0;
+    }
+
+    if (start == 0)
+    {
+        memcpy(p, enc->src, 8);
+        p += 8;
+    }
+
+    double raw_cost, delta_cost;
+    int raw_size = Mermaid_WriteBytes(enc, p, enc->lits, enc->lits_size, &raw_cost);
+    *mode = 1;
+    if (!enc->selkie)
+    {
+        int delta_size = Kraken_EncodeBytes(enc->tmp_buf, enc->delta_lits, enc->lits_size,
+                                            enc->entropy_flags | kEncodeBytes_NoScratch, enc->space_speed, &delta_cost);
+        if (delta_cost < raw_cost)
+        {
+            memcpy(p, enc->tmp_buf, delta_size);
+            raw_size = delta_size;
+            *mode = 0;
+        }
+    }
+    p += raw_size;
+
+    p += Mermaid_WriteBytes(enc, p, enc->cmds, enc->cmds_size);
+    if (size > MERMAID_HALF_SIZE)
+    {
+        *(uint16_t *)p = (uint16_t)enc->cmds_half;
+        p += 2;
+    }
+
+    // The near offsets as is, or their high and low bytes entropy coded
+    int off16_size = 2 + enc->off16_size * 2;
+    if (!enc->selkie && enc->off16_size >= 32 && scratch + 4 * enc->off16_size + 1 <= MERMAID_SCRATCH_SIZE(size))
+    {
+        uint8_t *hi = enc->tmp_buf;
+        uint8_t *lo = enc->tmp_buf + enc->off16_size;
+        uint8_t *q = enc->tmp_buf + 2 * enc->off16_size;
+        for (int i = 0; i != enc->off16_size; i++)
+        {
+            hi[i] = (uint8_t)(enc->off16[i] >> 8);
+            lo[i] = (uint8_t)enc->off16[i];
+        }
+        q[0] = 0xFF;
+        q[1] = 0xFF;
+        int flags = enc->entropy_flags | kEncodeBytes_NoScratch;
+        int n = 2 + Kraken_EncodeBytes(q + 2, hi, enc->off16_size, flags, enc->space_speed);
+        n += Kraken_EncodeBytes(q + n, lo, enc->off16_size, flags, enc->space_speed);
+        if (n < off16_size)
+        {
+            memcpy(p, q, n);
+            off16_size = n;
+        }
+    }
+    if (off16_size == 2 + enc->off16_size * 2)
+    {
+        *(uint16_t *)p = (uint16_t)enc->off16_size;
+        memcpy(p + 2, enc->off16, enc->off16_size * 2);
+    }
+    p += off16_size;
+
+    // The far offset counts, with 4095 taking the next 2 bytes
+    uint32_t n1 = enc->off32_size[0];
+    uint32_t n2 = enc->off32_size[1];
+    uint32_t counts = Min(n1, 4095u) << 12 | Min(n2, 4095u);
+    p[0] = (uint8_t)counts;
+    p[1] = (uint8_t)(counts >> 8);
+    p[2] = (uint8_t)(counts >> 16);
+    p += 3;
+    if (n1 >= 4095)
+    {
+        *(uint16_t *)p = (uint16_t)n1;
+        p += 2;
+    }
+    if (n2 >= 4095)
+    {
+        *(uint16_t *)p = (uint16_t)n2;
+        p += 2;
+    }
+    p = Mermaid_WriteFarOffsets(p, enc->off32[0], n1);
+    p = Mermaid_WriteFarOffsets(p, enc->off32[1], n2);
+
+    memcpy(p, enc->lens, enc->lens_size);
+    p += enc->lens_size;
+    return (int)(p - dst);
+}
+
+
+
+// Mermaid_EncodeQuantum()
+static int Mermaid_EncodeQuantum(void *ctx, size_t start, size_t end, uint8_t *dst)
+{
+    MermaidEncoder *enc = (MermaidEncoder *)ctx;
+    uint8_t *p = dst;
+
+    for (size_t chunk = start; chunk < end; chunk += KRAKEN_CHUNK_SIZE)
+    {
+        size_t chunk_end = Min(chunk + KRAKEN_CHUNK_SIZE, end);
+        int size = (int)(chunk_end - chunk);
+        int lz_size = 0;
+        int mode = 0;
+
+        if (size >= 32)
+        {
+            Mermaid_ParseChunk(enc, chunk, chunk_end);
+            lz_size = Mermaid_WriteLzTable(enc, chunk, size, enc->lz_buf, &mode);
+        }
+        p += Kraken_WriteChunk(p, enc->src + chunk, size, enc->lz_buf, lz_size, mode, enc->tmp_buf, !enc->selkie,
+                               enc->space_speed, enc->entropy_flags);
+    }
+    return (int)(p - dst);
+}
+
+
+
+// Mermaid_Compress()
+//
+// Compresses |src| as Mermaid, or as Selkie if |selkie|, at |level| 1 to 9,
+// with |space_speed| and |max_memory| as Kraken_Compress() takes them. Both
+// are written as Mermaid blocks. Returns the compressed size, or -1 if
+// |src_size| is over KRAKEN_MAX_COMPRESS_SIZE or memory runs out.
+int Mermaid_Compress(const byte *src, size_t src_size, byte *dst, int level, int space_speed, size_t max_memory,
+                     bool selkie)
+{
+    MermaidEncoder enc;
+
+    if (src_size > KRAKEN_MAX_COMPRESS_SIZE)
+    {
+        return -1;
+    }
+    enc.src = src;
+    enc.src_size = src_size;
+    enc.params = &kMermaidLevels[level - 1];
+    enc.selkie = selkie;
+    enc.space_speed = space_speed;
+    enc.entropy_flags = (level <= 3) ? kEncodeBytes_Fast : 0;
+    if (!MatchFinder_Init(&enc.mf, src, src_size, enc.params->finder, enc.params->hash_bits,
+                          enc.params->window_bits, enc.params->max_chain, enc.params->nice_len, max_memory))
+    {
+        return -1;
+    }
+
+    // Every command but the last of a match covers at least 2 bytes, and a
+    // long length at least 29
+    enc.lits = new uint8_t[KRAKEN_CHUNK_SIZE];
+    enc.delta_lits = new uint8_t[KRAKEN_CHUNK_SIZE];
+    enc.cmds = new uint8_t[KRAKEN_CHUNK_SIZE];
+    enc.off16 = new uint16_t[KRAKEN_CHUNK_SIZE / MATCHFINDER_MIN_MATCH];
+    enc.off32[0] = new uint32_t[MERMAID_HALF_SIZE / MERMAID_MIN_FAR_MATCH];
+    enc.off32[1] = new uint32_t[MERMAID_HALF_SIZE / MERMAID_MIN_FAR_MATCH];
+    enc.lens = new uint8_t[KRAKEN_CHUNK_SIZE / MERMAID_LONG_FAR_MATCH * 3 + 3];
+    enc.lz_buf = new uint8_t[KRAKEN_CHUNK_SIZE * 4];
+    enc.tmp_buf = new uint8_t[KRAKEN_CHUNK_SIZE * 2];
+
+    int n = Kraken_WriteBlocks(src, src_size, dst, 10, Mermaid_EncodeQuantum, &enc);
+
+    delete[] enc.lits;
+    delete[] enc.delta_lits;
+    delete[] enc.cmds;
+    delete[] enc.off16;
+    delete[] enc.off32[0];
+    delete[] enc.off32[1];
+    delete[] enc.lens;
+    delete[] enc.lz_buf;
+    delete[] enc.tmp_buf;
+    MatchFinder_Free(&enc.mf);
+    return n;
+}
@@ -18,7 +18,9 @@
 
 #define __forceinline __attribute__((always_inline)) inline
 
-#define COPY_64(d, s) {*(uint64_t*)(d) = *(uint64_t*)(s); }
+// Through memcpy, as |d| and |s| are rarely 8 byte aligned: a plain uint64_t
+// access lets the vectorizer assume they are, and get overlapping copies wrong
+#define COPY_64(d, s) { uint64_t copy_64_; memcpy(&copy_64_, (s), 8); memcpy((d), &copy_64_, 8); }
 #define COPY_64_BYTES(d, s) {                                                 \
         _mm_storeu_si128((__m128i*)d + 0, _mm_loadu_si128((__m128i*)s + 0));  \
         _mm_storeu_si128((__m128i*)d + 1, _mm_loadu_si128((__m128i*)s + 1));  \
@@ -26,11 +28,19 @@
         _mm_storeu_si128((__m128i*)d + 3, _mm_loadu_si128((__m128i*)s + 3));  \
 }
 #define COPY_64_ADD(d, s, t) _mm_storel_epi64((__m128i *)(d), _mm_add_epi8(_mm_loadl_epi64((__m128i *)(s)), _mm_loadl_epi64((__m128i *)(t))))
+#define COPY_128(d, s) _mm_storeu_si128((__m128i *)(d), _mm_loadu_si128((const __m128i *)(s)))
+#define COPY_128_ADD(d, s, t) _mm_storeu_si128((__m128i *)(d), _mm_add_epi8(_mm_loadu_si128((const __m128i *)(s)), _mm_loadu_si128((const __m128i *)(t))))
 
 // include file for x86 SSE2 types 
 // compile with -msse2 (instructions available)
 #ifdef __SSE2__
 #include <emmintrin.h>
+// wider instruction sets are only used from functions with a matching
+// target attribute, selected at runtime through CpuFeatures()
+#include <immintrin.h>
+// utilities.h provides its own portable _rotl()
+#undef _rotl
+#undef _rotr
 #else
 #warning SSE2 support is not available.
 #endif
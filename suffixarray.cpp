@@ -0,0 +1,335 @@
+/*
+------------------------------------------------------------------------------
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+------------------------------------------------------------------------------
+*/
+
+// Suffix array construction by induced sorting (SA-IS, Nong, Zhang and Chan
+// 2009), the longest common prefixes of neighbouring suffixes (Kasai et al.
+// 2001), and the tree of ranges of suffixes that share a prefix (Abouelhoda
+// et al. 2004). All take time linear in the input.
+
+#include "suffixarray.h"
+#include "utilities.h"
+
+
+
+// SuffixArray_Buckets()
+//
+// Sets |bkt| to the start of the bucket of each symbol in the sorted
+// suffixes, or to its end if |end|.
+static void SuffixArray_Buckets(const int32_t *s, int n, int k, int32_t *bkt, bool end)
+{
+    int32_t sum = 0;
+
+    memset(bkt, 0, sizeof(int32_t) * k);
+    for (int i = 0; i != n; i++)
+    {
+        bkt[s[i]]++;
+    }
+    for (int c = 0; c != k; c++)
+    {
+        sum += bkt[c];
+        bkt[c] = end ? sum : sum - bkt[c];
+    }
+}
+
+
+
+// SuffixArray_Induce()
+//
+// Sorts the L type suffixes from the sorted suffixes in |sa| left to right,
+// then the S type ones right to left.
+static void SuffixArray_Induce(const int32_t *s, int32_t *sa, int n, int k, const uint8_t *stype, int32_t *bkt)
+{
+    SuffixArray_Buckets(s, n, k, bkt, false);
+    for (int i = 0; i != n; i++)
+    {
+        int32_t j = sa[i] - 1;
+        if (j >= 0 && !stype[j])
+        {
+            sa[bkt[s[j]]++] = j;
+        }
+    }
+    SuffixArray_Buckets(s, n, k, bkt, true);
+    for (int i = n - 1; i >= 0; i--)
+    {
+        int32_t j = sa[i] - 1;
+        if (j >= 0 && stype[j])
+        {
+            sa[--bkt[s[j]]] = j;
+        }
+    }
+}
+
+
+
+// SuffixArray_Sais()
+//
+// Sorts the suffixes of |s|, |n| symbols below |k| that end in a 0 found
+// nowhere else. The leftmost S type suffixes are sorted first, by sorting
+// the string of their names in the upper part of |sa| if the names aren't
+// all different. The suffix types and buckets go at |work|, the recursion's
+// after them; it has at most half the symbols and names.
+static void SuffixArray_Sais(const int32_t *s, int32_t *sa, int n, int k, uint8_t *work)
+{
+    uint8_t *stype = work;
+    int32_t *bkt = (int32_t *)(work + ((n + 3) & ~3));
+
+    // A suffix is S type if it sorts before the one after it
+    stype[n - 1] = 1;
+    for (int i = n - 2; i >= 0; i--)
+    {
+        stype[i] = s[i] < s[i + 1] || (s[i] == s[i + 1] && stype[i + 1]);
+    }
+#define SA_IS_LMS(i) ((i) > 0 && stype[i] && !stype[(i) - 1])
+
+    // Put the LMS suffixes at the ends of their buckets and induce from them
+    SuffixArray_Buckets(s, n, k, bkt, true);
+    for (int i = 0; i != n; i++)
+    {
+        sa[i] = -1;
+    }
+    for (int i = 1; i != n; i++)
+    {
+        if (SA_IS_LMS(i))
+        {
+            sa[--bkt[s[i]]] = i;
+        }
+    }
+    SuffixArray_Induce(s, sa, n, k, stype, bkt);
+
+    // Gather the LMS suffixes, now sorted by their LMS substrings, and name
+    // them by those
+    int n1 = 0;
+    for (int i = 0; i != n; i++)
+    {
+        if (SA_IS_LMS(sa[i]))
+        {
+            sa[n1++] = sa[i];
+        }
+    }
+    for (int i = n1; i != n; i++)
+    {
+        sa[i] = -1;
+    }
+    int names = 0;
+    int32_t prev = -1;
+    for (int i = 0; i != n1; i++)
+    {
+        int32_t pos = sa[i];
+        bool diff = (prev < 0);
+        for (int d = 0; !diff; d++)
+        {
+            if (s[pos + d] != s[prev + d] || stype[pos + d] != stype[prev + d])
+            {
+                diff = true;
+            }
+            else if (d > 0 && (SA_IS_LMS(pos + d) || SA_IS_LMS(prev + d)))
+            {
+                break;
+            }
+        }
+        if (diff)
+        {
+            names++;
+            prev = pos;
+        }
+        sa[n1 + pos / 2] = names - 1;
+    }
+    for (int i = n - 1, j = n - 1; i >= n1; i--)
+    {
+        if (sa[i] >= 0)
+        {
+            sa[j--] = sa[i];
+        }
+    }
+
+    // Sort the names, recursing if some are equal
+    int32_t *s1 = sa + n - n1;
+    if (names < n1)
+    {
+        SuffixArray_Sais(s1, sa, n1, names, (uint8_t *)(bkt + k));
+    }
+    else
+    {
+        for (int i = 0; i != n1; i++)
+        {
+            sa[s1[i]] = i;
+        }
+    }
+
+    // Put the sorted LMS suffixes back at the ends of their buckets and
+    // induce the rest from them
+    for (int i = 1, j = 0; i != n; i++)
+    {
+        if (SA_IS_LMS(i))
+        {
+            s1[j++] = i;
+        }
+    }
+    for (int i = 0; i != n1; i++)
+    {
+        sa[i] = s1[sa[i]];
+    }
+    for (int i = n1; i != n; i++)
+    {
+        sa[i] = -1;
+    }
+    SuffixArray_Buckets(s, n, k, bkt, true);
+    for (int i = n1 - 1; i >= 0; i--)
+    {
+        int32_t j = sa[i];
+        sa[i] = -1;
+        sa[--bkt[s[j]]] = j;
+    }
+    SuffixArray_Induce(s, sa, n, k, stype, bkt);
+#undef SA_IS_LMS
+}
+
+
+
+// SuffixArray_Build()
+//
+// Sets |sa| to the start of every suffix of the |n| bytes at |src| in sorted
+// order, where a suffix sorts before the longer ones it is a prefix of.
+// |sa| and |tmp| need room for n + 1 entries and |work|, 4 byte aligned,
+// for SUFFIXARRAY_WORK_SIZE(n) bytes.
+void SuffixArray_Build(const uint8_t *src, int n, int32_t *sa, int32_t *tmp, uint8_t *work)
+{
+    // Bytes become 1 to 256, after them comes the 0 SA-IS needs
+    for (int i = 0; i != n; i++)
+    {
+        tmp[i] = src[i] + 1;
+    }
+    tmp[n] = 0;
+    SuffixArray_Sais(tmp, sa, n + 1, 257, work);
+    memmove(sa, sa + 1, sizeof(int32_t) * n);
+}
+
+
+
+// SuffixArray_BuildLcp()
+//
+// Sets |rank| to the index in |sa| of each suffix, and lcp[i] to the length
+// of the common prefix of the suffixes at sa[i - 1] and sa[i], 0 for the
+// first.
+void SuffixArray_BuildLcp(const uint8_t *src, int n, const int32_t *sa, int32_t *rank, int32_t *lcp)
+{
+    for (int i = 0; i != n; i++)
+    {
+        rank[sa[i]] = i;
+    }
+
+    // The common prefix of the suffix at i + 1 and the one before it is at
+    // most one shorter than that of the suffix at i
+    int h = 0;
+    for (int i = 0; i != n; i++)
+    {
+        int r = rank[i];
+        if (r == 0)
+        {
+            lcp[0] = 0;
+            h = 0;
+            continue;
+        }
+        int j = sa[r - 1];
+        while (i + h < n && j + h < n && src[i + h] == src[j + h])
+        {
+            h++;
+        }
+        lcp[r] = h;
+        if (h)
+        {
+            h--;
+        }
+    }
+}
+
+
+
+// SuffixArray_BuildIntervals()
+//
+// Turns the suffix array |sa| and common prefixes |lcp| of |n| bytes into
+// the tree of lcp-intervals: the ranges of suffixes that share a prefix
+// longer than the suffixes next to the range. Interval 0 is the root, of
+// all suffixes. In place, sa[i] becomes the parent of interval i and lcp[i]
+// the length its suffixes share, at most |max_lcp|. leaf[p] is set to the
+// smallest interval the suffix at p is in. Returns false if memory runs
+// out.
+bool SuffixArray_BuildIntervals(int n, int32_t *sa, int32_t *lcp, int32_t *leaf, int max_lcp)
+{
+    // The open intervals, longer prefixes on top. Interval i is made at step
+    // i or later, so it only overwrites entries that are already read.
+    int32_t *stack = (int32_t *)malloc(sizeof(int32_t) * (max_lcp + 2));
+    int top = 0;
+    int num = 1;
+
+    if (!stack)
+    {
+        return false;
+    }
+    stack[0] = 0;
+    lcp[0] = 0;
+
+    int32_t prev = sa[0];
+    for (int r = 1; r < n; r++)
+    {
+        int32_t next = sa[r];
+        int32_t len = lcp[r] < max_lcp ? lcp[r] : max_lcp;
+
+        if (len == lcp[stack[top]])
+        {
+            leaf[prev] = stack[top];
+        }
+        else if (len > lcp[stack[top]])
+        {
+            lcp[num] = len;
+            leaf[prev] = num;
+            stack[++top] = num++;
+        }
+        else
+        {
+            leaf[prev] = stack[top];
+            for (;;)
+            {
+                int32_t closed = stack[top--];
+                int32_t parent_len = lcp[stack[top]];
+                if (len == parent_len)
+                {
+                    sa[closed] = stack[top];
+                    break;
+                }
+                if (len > parent_len)
+                {
+                    lcp[num] = len;
+                    sa[closed] = num;
+                    stack[++top] = num++;
+                    break;
+                }
+                sa[closed] = stack[top];
+            }
+        }
+        prev = next;
+    }
+    leaf[prev] = stack[top];
+    for (; top > 0; top--)
+    {
+        sa[stack[top]] = stack[top - 1];
+    }
+    sa[0] = 0;
+
+    free(stack);
+    return true;
+}
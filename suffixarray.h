@@ -0,0 +1,28 @@
+/*
+------------------------------------------------------------------------------
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+------------------------------------------------------------------------------
+*/
+
+#include "stdafx.h"
+
+// Scratch bytes SuffixArray_Build() needs for |n| bytes: the suffix types
+// and buckets of each level of the sort, each at most half the one before
+#define SUFFIXARRAY_WORK_SIZE(n) (6 * ((size_t)(n) + 1) + 2048)
+
+
+// Prototypes
+void SuffixArray_Build(const uint8_t *src, int n, int32_t *sa, int32_t *tmp, uint8_t *work);
+void SuffixArray_BuildLcp(const uint8_t *src, int n, const int32_t *sa, int32_t *rank, int32_t *lcp);
+bool SuffixArray_BuildIntervals(int n, int32_t *sa, int32_t *lcp, int32_t *leaf, int max_lcp);
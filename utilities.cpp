@@ -105,7 +105,7 @@ void error(const char *s, const char *curfile)
 
 
 // load_file()
-byte *load_file(const char *filename, int *size)
+byte *load_file(const char *filename, size_t *size)
 {
     FILE *f = fopen(filename, "rb");
     if (!f) 
@@ -113,14 +113,17 @@ byte *load_file(const char *filename, int *size)
         error("file open error", filename);
     }
 
-    fseek(f, 0, SEEK_END);
-    int packed_size = ftell(f);
-    fseek(f, 0, SEEK_SET);
-    byte *input = new byte[packed_size];
+    fseeko(f, 0, SEEK_END);
+    size_t packed_size = ftello(f);
+    fseeko(f, 0, SEEK_SET);
+    // The decoders read ahead by a few bytes, so keep a zeroed margin behind
+    // the data
+    byte *input = new byte[packed_size + SAFE_SPACE];
     if (!input)
     {
         error("memory error", filename);
     }
+    memset(input + packed_size, 0, SAFE_SPACE);
 
     if (fread(input, 1, packed_size, f) != packed_size)
     {
@@ -144,4 +147,95 @@ void FillByteOverflow16(uint8_t *dst, uint8_t v, size_t n)
 
 
 
+// CopyNonTemporal()
+//
+// memcpy() with streaming stores, for output that is not read again soon.
+// The source may not overlap the destination.
+void CopyNonTemporal(uint8_t *dst, const uint8_t *src, size_t n)
+{
+    size_t head = (0 - (uintptr_t)dst) & 15;
+    if (n < head + 64)
+    {
+        memcpy(dst, src, n);
+        return;
+    }
+    memcpy(dst, src, head);
+    dst += head, src += head, n -= head;
+    for (; n >= 64; dst += 64, src += 64, n -= 64)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)(src + 0));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *)(src + 32));
+        __m128i d = _mm_loadu_si128((const __m128i *)(src + 48));
+        _mm_stream_si128((__m128i *)(dst + 0), a);
+        _mm_stream_si128((__m128i *)(dst + 16), b);
+        _mm_stream_si128((__m128i *)(dst + 32), c);
+        _mm_stream_si128((__m128i *)(dst + 48), d);
+    }
+    memcpy(dst, src, n);
+    _mm_sfence();
+}
+
+
+
+// FillNonTemporal()
+//
+// memset() with streaming stores.
+void FillNonTemporal(uint8_t *dst, uint8_t v, size_t n)
+{
+    size_t head = (0 - (uintptr_t)dst) & 15;
+    if (n < head + 64)
+    {
+        memset(dst, v, n);
+        return;
+    }
+    memset(dst, v, head);
+    dst += head, n -= head;
+    __m128i x = _mm_set1_epi8((char)v);
+    for (; n >= 64; dst += 64, n -= 64)
+    {
+        _mm_stream_si128((__m128i *)(dst + 0), x);
+        _mm_stream_si128((__m128i *)(dst + 16), x);
+        _mm_stream_si128((__m128i *)(dst + 32), x);
+        _mm_stream_si128((__m128i *)(dst + 48), x);
+    }
+    memset(dst, v, n);
+    _mm_sfence();
+}
+
 
+
+
+
+// DetectCpuFeatures()
+static uint32_t DetectCpuFeatures()
+{
+    uint32_t features = 0;
+
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3"))
+    {
+        features |= kCpuFeature_SSSE3;
+    }
+    if (__builtin_cpu_supports("bmi2"))
+    {
+        features |= kCpuFeature_BMI2;
+    }
+    if (__builtin_cpu_supports("avx2"))
+    {
+        features |= kCpuFeature_AVX2;
+    }
+    return features;
+}
+
+
+
+// CpuFeatures()
+//
+// Returns the kCpuFeature_* bits of the running cpu. Detected once, used to pick
+// between the SSE2 baseline and the wider kernels.
+uint32_t CpuFeatures()
+{
+    static const uint32_t features = DetectCpuFeatures();
+    return features;
+}
@@ -18,9 +18,31 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "stdafx.h"
 
 
-// The decompressor will write outside of the target buffer.
+// The decompressor may read up to this far past the end of its input, so
+// input buffers need the margin. The output needs none, the decoders take an
+// exact path for the last SAFE_SPACE bytes of each block.
 #define SAFE_SPACE 64
 
+// Built with OOZLIN_FUZZ_SAFE=1 the decoders also check what only invalid
+// input gets wrong: stream reads past their ends, match sources before the
+// window and runs past the output. The checks are made once per command or
+// token, so invalid input fails instead of reading outside the input and its
+// SAFE_SPACE margin or writing outside the output.
+#ifndef OOZLIN_FUZZ_SAFE
+#define OOZLIN_FUZZ_SAFE 0
+#endif
+
+// Smallest copy or fill that goes through streaming stores when the
+// nontemporal decode option is set.
+#define NONTEMPORAL_MIN_SIZE 4096
+
+// CPU features that have a runtime dispatched code path
+enum {
+    kCpuFeature_SSSE3 = 1 << 0,
+    kCpuFeature_BMI2 = 1 << 1,
+    kCpuFeature_AVX2 = 1 << 2,
+};
+
 // Global Vars
 enum {
     kCompressor_Kraken = 8,
@@ -54,8 +76,11 @@ void FreeAligned(void *p);
 uint32_t BSR(uint32_t x);
 uint32_t BSF(uint32_t x);
 void error(const char *s, const char *curfile = NULL);
-byte *load_file(const char *filename, int *size);
+byte *load_file(const char *filename, size_t *size);
 int ParseCmdLine(int argc, char *argv[]);
-bool Verify(const char *filename, uint8_t *output, int outbytes, const char *curfile);
+bool Verify(const char *filename, uint8_t *output, size_t outbytes, const char *curfile);
 void FillByteOverflow16(uint8_t *dst, uint8_t v, size_t n);
+void CopyNonTemporal(uint8_t *dst, const uint8_t *src, size_t n);
+void FillNonTemporal(uint8_t *dst, uint8_t v, size_t n);
 void LoadLib();
+uint32_t CpuFeatures();